@@ -1,3 +1,5 @@
+/* for memfd_create */
+#define _GNU_SOURCE
 #include "tecnicofs-client-api.h"
 #include <string.h>
 #include <stdlib.h>
@@ -5,108 +7,494 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 int scsocket;
 struct sockaddr_un client_addr, server_addr;
 socklen_t cli_addr_len, ser_addr_len;
 
+/* Wire format of the requests, and identifier of the latest one */
+static int protocol = TFS_PROTOCOL_BINARY_HASHED;
+static uint32_t requestId = 0;
+
+/* Set if mounted on the session socket, which threads of the client share */
+static bool session = false;
+
+/* Memory shared with the server, if mounted on it, and the state of its slots */
+static TfsShm *shm = NULL;
+static int freeSlots[TFS_SHM_SLOTS];
+static int freeSlotCount = 0;
+static bool slotDone[TFS_SHM_SLOTS];
+static bool shmReceiving = false;
+static pthread_mutex_t shmMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shmChanged = PTHREAD_COND_INITIALIZER;
+
 /**
- * Creates a file/directory.
+ * Sends a binary request through the memory shared with the server and
+ * waits for its reply. As on a session, the waiting threads take turns
+ * taking the completions and hand each one to the thread that sent its
+ * request.
  * Inputs:
- *  - name: The new file/directory's name.
- *  - nodeType: Used to choose what to create (file or directory).
+ *  - message, length: the request.
+ *  - reply, size: where to store the reply.
+ *  - caller: the API function, for error messages.
+ * Returns: the length of the reply
  */
-int tfsCreate(char *name, char nodeType) {
+static ssize_t shmExchange(const void *message, size_t length, void *reply, size_t size, const char *caller) {
+  uint32_t slot;
+  char byte;
 
-  char command[MAX_INPUT_SIZE];
-  int opReturn;
-  sprintf(command, "c %s %c", name, nodeType);
-  /* Send command to server */
-  if (sendto(scsocket, command, strlen(command)+1, 0, (struct sockaddr *) &server_addr, ser_addr_len) == -1) {
-    perror("Client: Error sending in tfsCreate");
+  if (length > TFS_MAX_BATCH_MESSAGE) {
+    fprintf(stderr, "Client: Request too long in %s\n", caller);
     exit(EXIT_FAILURE);
   }
-  /* Receive command operation return from server */
-  if (recvfrom(scsocket, &opReturn, sizeof(opReturn), 0, 0, 0) == -1) {
-    perror("Client: Error receiving in tfsCreate");
-    exit(EXIT_FAILURE);
+
+  pthread_mutex_lock(&shmMutex);
+  while (freeSlotCount == 0) {
+    pthread_cond_wait(&shmChanged, &shmMutex);
   }
+  slot = freeSlots[--freeSlotCount];
+  memcpy(shm->slots[slot].request, message, length);
+  shm->slots[slot].length = length;
+  /* the submission ring has one producer at a time */
+  tfs_ring_push(&shm->submissions, slot);
 
-  return opReturn;
+  while (!slotDone[slot]) {
+    if (shmReceiving) {
+      pthread_cond_wait(&shmChanged, &shmMutex);
+      continue;
+    }
+    shmReceiving = true;
+    pthread_mutex_unlock(&shmMutex);
+    uint32_t done;
+    while (!tfs_ring_wait(&shm->completions, &done, TFS_RING_WAIT_MS)) {
+      if (recv(scsocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        fprintf(stderr, "Client: Error receiving in %s: server went away\n", caller);
+        exit(EXIT_FAILURE);
+      }
+    }
+    pthread_mutex_lock(&shmMutex);
+    shmReceiving = false;
+    slotDone[done % TFS_SHM_SLOTS] = true;
+    pthread_cond_broadcast(&shmChanged);
+  }
+
+  TfsShmSlot *done = &shm->slots[slot];
+  ssize_t received = done->replyLength;
+  memcpy(reply, done->reply, (size_t) received < size ? (size_t) received : size);
+  slotDone[slot] = false;
+  freeSlots[freeSlotCount++] = slot;
+  pthread_cond_broadcast(&shmChanged);
+  pthread_mutex_unlock(&shmMutex);
+  return received;
 }
 
+/* Sockets of the server's workers, if it has them, that requests are routed to */
+static struct sockaddr_un workerAddrs[TFS_MAX_WORKER_SOCKETS];
+static socklen_t workerAddrLens[TFS_MAX_WORKER_SOCKETS];
+static int workerSocketCount = 0;
+
 /**
- * Deletes a file/directory.
+ * Picks the server socket for a request.
  * Input:
- *  - path: The file/directory to be deleted's path.
+ *  - path: the path the request is routed by.
+ * Returns: the index of a worker socket, or -1 for the server socket
  */
-int tfsDelete(char *path) {
+static int route(const char *path) {
+  return workerSocketCount ? tfs_route(path, workerSocketCount) : -1;
+}
 
-  char command[MAX_INPUT_SIZE];
-  int opReturn;
-  sprintf(command, "d %s", path);
-  /* Send command to server */
-  if (sendto(scsocket, command, strlen(command)+1, 0, (struct sockaddr *) &server_addr, ser_addr_len) == -1) {
-    perror("Client: Error sending in tfsDelete");
-    exit(EXIT_FAILURE);
+/**
+ * Sends a datagram to the server.
+ * Inputs:
+ *  - message, length: the datagram.
+ *  - to: as route returned.
+ *  - flags: of sendto.
+ */
+static ssize_t sendToServer(const void *message, size_t length, int to, int flags) {
+  if (to < 0) {
+    return sendto(scsocket, message, length, flags, (struct sockaddr *) &server_addr, ser_addr_len);
   }
-  /* Receive command operation return from server */
-  if (recvfrom(scsocket, &opReturn, sizeof(opReturn), 0, 0, 0) == -1) {
-    perror("Client: Error receiving in tfsDelete");
+  return sendto(scsocket, message, length, flags, (struct sockaddr *) &workerAddrs[to], workerAddrLens[to]);
+}
+
+/* A thread waiting for the reply to its request on the session */
+typedef struct sessionWaiter {
+  uint32_t id;
+  void *reply;
+  size_t size;
+  ssize_t length;
+  struct sessionWaiter *next;
+} SessionWaiter;
+
+static SessionWaiter *waiters = NULL;
+static bool receiving = false;
+static pthread_mutex_t sessionMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessionReplied = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Sends a binary request on the session and waits for its reply. Replies
+ * may come back in any order: the waiting threads take turns receiving
+ * them and hand each one to the thread that sent its request.
+ * Inputs:
+ *  - message, length: the request.
+ *  - id: its identifier.
+ *  - reply, size: where to store the reply.
+ *  - caller: the API function, for error messages.
+ * Returns: the length of the reply
+ */
+static ssize_t sessionExchange(const void *message, size_t length, uint32_t id, void *reply, size_t size,
+                               const char *caller) {
+  char received[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+  SessionWaiter self = { .id = id, .reply = reply, .size = size, .length = -1 };
+
+  pthread_mutex_lock(&sessionMutex);
+  self.next = waiters;
+  waiters = &self;
+  pthread_mutex_unlock(&sessionMutex);
+
+  if (send(scsocket, message, length, 0) == -1) {
+    fprintf(stderr, "Client: Error sending in %s: %s\n", caller, strerror(errno));
     exit(EXIT_FAILURE);
   }
-  return opReturn;
+
+  pthread_mutex_lock(&sessionMutex);
+  while (self.length == -1) {
+    if (receiving) {
+      pthread_cond_wait(&sessionReplied, &sessionMutex);
+      continue;
+    }
+    receiving = true;
+    pthread_mutex_unlock(&sessionMutex);
+    ssize_t n = recv(scsocket, received, sizeof(received), 0);
+    if (n <= 0) {
+      fprintf(stderr, "Client: Error receiving in %s: %s\n", caller, n ? strerror(errno) : "session closed");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&sessionMutex);
+    receiving = false;
+
+    /* replies to requests no one waits for are dropped */
+    for (SessionWaiter **w = &waiters; *w && n >= sizeof(TfsReply); w = &(*w)->next) {
+      if ((*w)->id == ((TfsReply *) received)->requestId) {
+        memcpy((*w)->reply, received, (size_t) n < (*w)->size ? (size_t) n : (*w)->size);
+        (*w)->length = n;
+        *w = (*w)->next;
+        break;
+      }
+    }
+    pthread_cond_broadcast(&sessionReplied);
+  }
+  pthread_mutex_unlock(&sessionMutex);
+  return self.length;
 }
 
 /**
- * Moves a file/directory.
+ * Chooses the wire format of the requests: TFS_PROTOCOL_TEXT for servers
+ * that only take text commands, TFS_PROTOCOL_BINARY, or
+ * TFS_PROTOCOL_BINARY_HASHED (the default) to also send the hashes of the
+ * path components, which lookups use instead of hashing them again.
+ * Input:
+ *  - newProtocol: the wire format.
+ */
+int tfsSetProtocol(int newProtocol) {
+  if ((newProtocol != TFS_PROTOCOL_TEXT || session || shm) && newProtocol != TFS_PROTOCOL_BINARY &&
+      newProtocol != TFS_PROTOCOL_BINARY_HASHED) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  protocol = newProtocol;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Sends a request to the server and waits for its result.
  * Inputs:
- *  - from: Original location.
- *  - to: New location.
+ *  - opcode: the operation, one of TFS_OP_*.
+ *  - nodeType: the type of node to create, or 0.
+ *  - path: the path of the request.
+ *  - path2: the second path of a move, or NULL.
+ *  - caller: the API function, for error messages.
  */
-int tfsMove(char *from, char *to) {
+static int tfsRequest(char opcode, char nodeType, char *path, char *path2, const char *caller) {
 
-  char command[MAX_INPUT_SIZE];
+  char command[TFS_MAX_MESSAGE] __attribute__((aligned(8)));
+  uint32_t id = __atomic_add_fetch(&requestId, 1, __ATOMIC_RELAXED);
+  size_t length;
   int opReturn;
-  sprintf(command, "m %s %s", from, to);
+
+  if (protocol == TFS_PROTOCOL_TEXT) {
+    if (nodeType) {
+      length = snprintf(command, sizeof(command), "%c %s %c", opcode, path, nodeType) + 1;
+    } else if (path2) {
+      length = snprintf(command, sizeof(command), "%c %s %s", opcode, path, path2) + 1;
+    } else {
+      length = snprintf(command, sizeof(command), "%c %s", opcode, path) + 1;
+    }
+    if (length > sizeof(command)) {
+      return TECNICOFS_ERROR_OTHER;
+    }
+  } else {
+    int flags = protocol == TFS_PROTOCOL_BINARY_HASHED && opcode == TFS_OP_LOOKUP ? TFS_FLAG_HASHES : 0;
+    length = tfs_encode_request(command, opcode, id, flags, nodeType, path, path2);
+    if (length == 0) {
+      return TECNICOFS_ERROR_OTHER;
+    }
+  }
+
+  TfsReply reply;
+  ssize_t received;
+  if (shm) {
+    received = shmExchange(command, length, &reply, sizeof(reply), caller);
+    return tfs_decode_reply(&reply, received, id, &opReturn) ? opReturn : TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+  if (session) {
+    received = sessionExchange(command, length, id, &reply, sizeof(reply), caller);
+    return tfs_decode_reply(&reply, received, id, &opReturn) ? opReturn : TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+
   /* Send command to server */
-  if (sendto(scsocket, command, strlen(command)+1, 0, (struct sockaddr *) &server_addr, ser_addr_len) < 0 ) {
-    perror("Client: Error sending in tfsMove");
+  if (sendToServer(command, length, route(path), 0) == -1) {
+    fprintf(stderr, "Client: Error sending in %s: %s\n", caller, strerror(errno));
     exit(EXIT_FAILURE);
   }
+
   /* Receive command operation return from server */
-  if (recvfrom(scsocket, &opReturn, sizeof(opReturn), 0, 0, 0) == -1) {
-    perror("Client: Error receiving in tfsMove");
-    exit(EXIT_FAILURE);
+  if (protocol == TFS_PROTOCOL_TEXT) {
+    if (recvfrom(scsocket, &opReturn, sizeof(opReturn), 0, 0, 0) == -1) {
+      fprintf(stderr, "Client: Error receiving in %s: %s\n", caller, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    return opReturn;
   }
 
+  do {
+    /* replies to earlier requests are dropped */
+    if ((received = recvfrom(scsocket, &reply, sizeof(reply), 0, 0, 0)) == -1) {
+      fprintf(stderr, "Client: Error receiving in %s: %s\n", caller, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } while (!tfs_decode_reply(&reply, received, id, &opReturn));
+
   return opReturn;
 }
 
+/* The batch or transaction being built, until it is submitted */
+static char batch[TFS_MAX_BATCH_MESSAGE] __attribute__((aligned(8)));
+static size_t batchSize = 0;
+/* Socket it goes to, picked by its first operation */
+static int batchRoute = -1;
+
 /**
- * Searches for a file/directory.
+ * Starts a batch of operations, which tfsBatchSubmit sends in a single
+ * request, instead of one round trip per operation.
+ */
+int tfsBatchBegin() {
+  batchSize = tfs_batch_begin(batch, TFS_OP_BATCH, __atomic_add_fetch(&requestId, 1, __ATOMIC_RELAXED));
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Starts a transaction: operations added with tfsBatchAdd, which
+ * tfsTransactionSubmit sends in a single request, that the server applies
+ * all or none of. Transactions only hold creations, deletions and moves.
+ */
+int tfsTransactionBegin() {
+  batchSize = tfs_batch_begin(batch, TFS_OP_TRANSACTION, __atomic_add_fetch(&requestId, 1, __ATOMIC_RELAXED));
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Adds an operation to the batch or transaction.
+ * Inputs:
+ *  - op: the operation, as in the text commands: 'c', 'd', 'l' or 'm'.
+ *  - path: its path.
+ *  - arg: the node type ("f" or "d") of a create, the new path of a move,
+ *    NULL otherwise.
+ * Returns: EXIT_SUCCESS, or TECNICOFS_ERROR_OTHER if the operation is
+ *  invalid or the batch is full and must be submitted first
+ */
+int tfsBatchAdd(char op, char *path, char *arg) {
+  char nodeType = 0;
+  char *path2 = NULL;
+
+  if (batchSize == 0) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  switch (op) {
+    case TFS_OP_CREATE:
+      if (!arg || (arg[0] != 'f' && arg[0] != 'd')) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      nodeType = arg[0];
+      break;
+    case TFS_OP_MOVE:
+      if (!arg) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      path2 = arg;
+      break;
+    case TFS_OP_DELETE:
+      break;
+    case TFS_OP_LOOKUP:
+      if (((TfsHeader *) batch)->opcode == TFS_OP_TRANSACTION) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      break;
+    default:
+      return TECNICOFS_ERROR_OTHER;
+  }
+
+  int flags = protocol == TFS_PROTOCOL_BINARY_HASHED && op == TFS_OP_LOOKUP ? TFS_FLAG_HASHES : 0;
+  size_t size = tfs_batch_add(batch, batchSize, op, flags, nodeType, path, path2);
+  if (size == 0) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  if (batchSize == sizeof(TfsHeader) + sizeof(TfsBatch)) {
+    batchRoute = route(path);
+  }
+  batchSize = size;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Sends the batch or transaction being built and waits for its reply.
  * Input:
- *  - path: The file/directory to be searched's path.
+ *  - size: of the request
+ *  - results: set to the result of each operation
+ *  - caller: name of the calling function, for error messages
+ * Returns: the number of operations
  */
-int tfsLookup(char *path) {
+static int batchExchange(size_t size, int *results, char *caller) {
+  static char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+  TfsHeader *header = (TfsHeader *) batch;
+  int count;
 
-  char command[MAX_INPUT_SIZE];
-  int opReturn;
-  sprintf(command, "l %s", path);
-  /* Send command to server */
-  if (sendto(scsocket, command, strlen(command)+1, 0, (struct sockaddr *) &server_addr, ser_addr_len) == -1) {
-    perror("Client: Error sending in tfsLookup");
-    exit(EXIT_FAILURE);
+  if (shm || session) {
+    ssize_t received = shm ? shmExchange(batch, size, reply, sizeof(reply), caller) :
+                             sessionExchange(batch, size, header->requestId, reply, sizeof(reply), caller);
+    count = tfs_decode_batch_reply(reply, received, header->opcode, header->requestId, results);
+    if (count < 0) {
+      fprintf(stderr, "Client: Invalid reply in %s\n", caller);
+      exit(EXIT_FAILURE);
+    }
+    return count;
   }
-  /* Receive command operation return from server */
-  if (recvfrom(scsocket, &opReturn, sizeof(opReturn), 0, 0, 0) == -1) {
-    perror("Client: Error receiving in tfsLookup");
+
+  if (sendToServer(batch, size, batchRoute, 0) == -1) {
+    fprintf(stderr, "Client: Error sending in %s: %s\n", caller, strerror(errno));
     exit(EXIT_FAILURE);
   }
 
-  return opReturn;
+  do {
+    /* replies to earlier requests are dropped */
+    ssize_t received = recvfrom(scsocket, reply, sizeof(reply), 0, 0, 0);
+    if (received == -1) {
+      fprintf(stderr, "Client: Error receiving in %s: %s\n", caller, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    count = tfs_decode_batch_reply(reply, received, header->opcode, header->requestId, results);
+  } while (count < 0);
+
+  return count;
+}
+
+/**
+ * Sends the batch and waits for the results of its operations, which the
+ * server applies in order. In text mode, operations are sent one by one.
+ * Input:
+ *  - results: set to the result of each operation, in the order they were added.
+ * Returns: the number of operations
+ */
+int tfsBatchSubmit(int *results) {
+  TfsRequest requests[TFS_MAX_BATCH];
+  int count;
+
+  if (batchSize == 0 || ((TfsHeader *) batch)->opcode != TFS_OP_BATCH) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  size_t size = batchSize;
+  batchSize = 0;
+
+  if (protocol == TFS_PROTOCOL_TEXT) {
+    count = tfs_decode_batch(batch, size, requests);
+    for (int i = 0; i < count; i++) {
+      results[i] = tfsRequest(requests[i].opcode, requests[i].nodeType, requests[i].paths[0],
+                              requests[i].paths[1], "tfsBatchSubmit");
+    }
+    return count;
+  }
+
+  return batchExchange(size, results, "tfsBatchSubmit");
+}
+
+/**
+ * Sends the transaction and waits for it to commit or abort. Text commands
+ * have no transactions.
+ * Input:
+ *  - results: set to the result of each operation, in the order they were
+ *    added: if the transaction aborted, FAIL for the operation that failed
+ *    and TECNICOFS_ERROR_OTHER for the others, which were not applied.
+ * Returns: EXIT_SUCCESS if every operation was applied, or
+ *  TECNICOFS_ERROR_OTHER if none was
+ */
+int tfsTransactionSubmit(int *results) {
+  if (batchSize == 0 || ((TfsHeader *) batch)->opcode != TFS_OP_TRANSACTION ||
+      protocol == TFS_PROTOCOL_TEXT) {
+    batchSize = 0;
+    return TECNICOFS_ERROR_OTHER;
+  }
+  size_t size = batchSize;
+  batchSize = 0;
+
+  int count = batchExchange(size, results, "tfsTransactionSubmit");
+  for (int i = 0; i < count; i++) {
+    if (results[i] != EXIT_SUCCESS) {
+      return TECNICOFS_ERROR_OTHER;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Creates a file/directory.
+ * Inputs:
+ *  - name: The new file/directory's name.
+ *  - nodeType: Used to choose what to create (file or directory).
+ */
+int tfsCreate(char *name, char nodeType) {
+  return tfsRequest(TFS_OP_CREATE, nodeType, name, NULL, "tfsCreate");
+}
+
+/**
+ * Deletes a file/directory.
+ * Input:
+ *  - path: The file/directory to be deleted's path.
+ */
+int tfsDelete(char *path) {
+  return tfsRequest(TFS_OP_DELETE, 0, path, NULL, "tfsDelete");
+}
+
+/**
+ * Moves a file/directory.
+ * Inputs:
+ *  - from: Original location.
+ *  - to: New location.
+ */
+int tfsMove(char *from, char *to) {
+  return tfsRequest(TFS_OP_MOVE, 0, from, to, "tfsMove");
+}
+
+/**
+ * Searches for a file/directory.
+ * Input:
+ *  - path: The file/directory to be searched's path.
+ */
+int tfsLookup(char *path) {
+  return tfsRequest(TFS_OP_LOOKUP, 0, path, NULL, "tfsLookup");
 }
 
 /**
@@ -115,22 +503,254 @@ int tfsLookup(char *path) {
  *  - path: The file/directory to be deleted's path.
  */
 int tfsPrint(char * path) {
+  return tfsRequest(TFS_OP_PRINT, 0, path, NULL, "tfsPrint");
+}
 
-  char command[MAX_INPUT_SIZE];
-  int opReturn;
-  sprintf(command, "p %s", path);
-  /* Send command to server */
-  if (sendto(scsocket, command, strlen(command)+1, 0, (struct sockaddr *) &server_addr, ser_addr_len) == -1) {
-    perror("Client: Error sending in tfsPrint");
-    exit(EXIT_FAILURE);
+/**
+ * Saves an image of the file system, which the server can be started from.
+ * Input:
+ *  - path: The image file's path.
+ */
+int tfsSave(char * path) {
+  return tfsRequest(TFS_OP_SAVE, 0, path, NULL, "tfsSave");
+}
+
+/* An asynchronous operation in flight, and where to hand its result */
+typedef struct asyncOp {
+  uint32_t id;
+  TfsCallback callback;
+  void *context;
+} AsyncOp;
+
+static AsyncOp inFlight[TFS_ASYNC_WINDOW];
+static int inFlightCount = 0;
+static bool asyncReceiving = false;
+static pthread_mutex_t asyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncChanged = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Receives a reply to an asynchronous operation and calls its callback.
+ * The threads making asynchronous calls take turns receiving: one that
+ * finds another receiving waits for it to be done instead. Called, and
+ * returns, with asyncMutex held, which is released while receiving and
+ * while the callback runs.
+ * Input:
+ *  - wait: whether to wait for a reply, if none has arrived.
+ * Returns: 1 if a callback was called, 0 if the reply was to no operation
+ *  in flight or was received by another thread, or -1 if no reply had
+ *  arrived
+ */
+static int asyncComplete(bool wait) {
+  char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+  ssize_t received;
+  int result;
+  char byte;
+
+  if (asyncReceiving) {
+    if (!wait) {
+      return -1;
+    }
+    pthread_cond_wait(&asyncChanged, &asyncMutex);
+    return 0;
   }
-  /* Receive command operation return from server */
-  if (recvfrom(scsocket, &opReturn, sizeof(opReturn), 0, 0, 0) == -1) {
-    perror("Client: Error receiving in tfsPrint");
+  asyncReceiving = true;
+  pthread_mutex_unlock(&asyncMutex);
+
+  if (shm) {
+    uint32_t done;
+    if (!wait && !tfs_ring_pop(&shm->completions, &done)) {
+      pthread_mutex_lock(&asyncMutex);
+      asyncReceiving = false;
+      return -1;
+    }
+    while (wait && !tfs_ring_wait(&shm->completions, &done, TFS_RING_WAIT_MS)) {
+      if (recv(scsocket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        fprintf(stderr, "Client: Error receiving asynchronous replies: server went away\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    TfsShmSlot *slot = &shm->slots[done % TFS_SHM_SLOTS];
+    received = slot->replyLength < sizeof(reply) ? slot->replyLength : sizeof(reply);
+    memcpy(reply, slot->reply, received);
+    pthread_mutex_lock(&shmMutex);
+    freeSlots[freeSlotCount++] = done % TFS_SHM_SLOTS;
+    pthread_cond_broadcast(&shmChanged);
+    pthread_mutex_unlock(&shmMutex);
+  } else if ((received = recv(scsocket, reply, sizeof(reply), wait ? 0 : MSG_DONTWAIT)) <= 0) {
+    if (received == -1 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      pthread_mutex_lock(&asyncMutex);
+      asyncReceiving = false;
+      return -1;
+    }
+    fprintf(stderr, "Client: Error receiving asynchronous replies: %s\n", received ? strerror(errno) : "session closed");
     exit(EXIT_FAILURE);
   }
 
-  return opReturn;
+  pthread_mutex_lock(&asyncMutex);
+  asyncReceiving = false;
+  pthread_cond_broadcast(&asyncChanged);
+  for (int i = 0; i < inFlightCount; i++) {
+    AsyncOp op = inFlight[i];
+    if (tfs_decode_reply(reply, received, op.id, &result)) {
+      /* out of the window first, as the callback may start other operations */
+      inFlight[i] = inFlight[--inFlightCount];
+      pthread_mutex_unlock(&asyncMutex);
+      op.callback(result, op.context);
+      pthread_mutex_lock(&asyncMutex);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Sends a binary request without waiting for its reply.
+ * Inputs:
+ *  - opcode, nodeType, path, path2: the operation.
+ *  - callback, context: what to call with its result.
+ *  - caller: the API function, for error messages.
+ * Returns: EXIT_SUCCESS, or TECNICOFS_ERROR_OTHER if the operation cannot
+ *  be sent, and its callback will not be called
+ */
+static int asyncRequest(char opcode, char nodeType, char *path, char *path2, TfsCallback callback,
+                        void *context, const char *caller) {
+
+  char command[TFS_MAX_MESSAGE] __attribute__((aligned(8)));
+  uint32_t id = __atomic_add_fetch(&requestId, 1, __ATOMIC_RELAXED);
+
+  /* text commands carry no identifier to match replies by */
+  if (protocol == TFS_PROTOCOL_TEXT || !callback) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  int flags = protocol == TFS_PROTOCOL_BINARY_HASHED && opcode == TFS_OP_LOOKUP ? TFS_FLAG_HASHES : 0;
+  size_t length = tfs_encode_request(command, opcode, id, flags, nodeType, path, path2);
+  if (length == 0) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+
+  /* the spot is taken before sending, as callbacks called meanwhile may start other operations */
+  pthread_mutex_lock(&asyncMutex);
+  while (inFlightCount == (shm ? TFS_SHM_SLOTS : TFS_ASYNC_WINDOW)) {
+    asyncComplete(true);
+  }
+  inFlight[inFlightCount++] = (AsyncOp) { .id = id, .callback = callback, .context = context };
+  pthread_mutex_unlock(&asyncMutex);
+
+  if (shm) {
+    pthread_mutex_lock(&shmMutex);
+    while (freeSlotCount == 0) {
+      pthread_cond_wait(&shmChanged, &shmMutex);
+    }
+    uint32_t slot = freeSlots[--freeSlotCount];
+    memcpy(shm->slots[slot].request, command, length);
+    shm->slots[slot].length = length;
+    tfs_ring_push(&shm->submissions, slot);
+    pthread_mutex_unlock(&shmMutex);
+    return EXIT_SUCCESS;
+  }
+
+  /* while the socket is full, the server may be waiting for room for its
+     replies to us: take them rather than wait for it */
+  int to = route(path);
+  ssize_t sent;
+  do {
+    pthread_mutex_lock(&asyncMutex);
+    int sendFlags = inFlightCount > 1 ? MSG_DONTWAIT : 0;
+    pthread_mutex_unlock(&asyncMutex);
+    sent = session ? send(scsocket, command, length, sendFlags) : sendToServer(command, length, to, sendFlags);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      /* unless the others were done meanwhile, and the next send may wait */
+      pthread_mutex_lock(&asyncMutex);
+      if (inFlightCount > 1) {
+        asyncComplete(true);
+      }
+      pthread_mutex_unlock(&asyncMutex);
+    } else if (sent == -1 && errno != EINTR) {
+      fprintf(stderr, "Client: Error sending in %s: %s\n", caller, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } while (sent == -1);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Starts creating a file/directory, and returns at once: its result is
+ * handed to the callback once the reply arrives, by tfsPoll or tfsWaitAll,
+ * or by a later asynchronous call that finds the window full. Operations
+ * in flight together may be applied in any order. Several threads may make
+ * asynchronous calls: a callback is called by whichever of them receives
+ * the reply, not always the one that started its operation. Asynchronous
+ * operations need a binary protocol, and must all be waited for before
+ * any synchronous call, which would drop their replies.
+ * Inputs:
+ *  - path: The new file/directory's name.
+ *  - nodeType: Used to choose what to create (file or directory).
+ *  - callback, context: called with the result.
+ * Returns: EXIT_SUCCESS once sent, or TECNICOFS_ERROR_OTHER if it cannot
+ *  be, and the callback will not be called
+ */
+int tfsCreateAsync(char *path, char nodeType, TfsCallback callback, void *context) {
+  return asyncRequest(TFS_OP_CREATE, nodeType, path, NULL, callback, context, "tfsCreateAsync");
+}
+
+/**
+ * Starts deleting a file/directory, as tfsCreateAsync.
+ * Inputs:
+ *  - path: The file/directory to be deleted's path.
+ *  - callback, context: called with the result.
+ */
+int tfsDeleteAsync(char *path, TfsCallback callback, void *context) {
+  return asyncRequest(TFS_OP_DELETE, 0, path, NULL, callback, context, "tfsDeleteAsync");
+}
+
+/**
+ * Starts searching for a file/directory, as tfsCreateAsync.
+ * Inputs:
+ *  - path: The file/directory to be searched's path.
+ *  - callback, context: called with the result.
+ */
+int tfsLookupAsync(char *path, TfsCallback callback, void *context) {
+  return asyncRequest(TFS_OP_LOOKUP, 0, path, NULL, callback, context, "tfsLookupAsync");
+}
+
+/**
+ * Starts moving a file/directory, as tfsCreateAsync.
+ * Inputs:
+ *  - from: Original location.
+ *  - to: New location.
+ *  - callback, context: called with the result.
+ */
+int tfsMoveAsync(char *from, char *to, TfsCallback callback, void *context) {
+  return asyncRequest(TFS_OP_MOVE, 0, from, to, callback, context, "tfsMoveAsync");
+}
+
+/**
+ * Calls the callbacks of the asynchronous operations whose replies have
+ * arrived, without waiting for the others.
+ * Returns: the number of callbacks called
+ */
+int tfsPoll() {
+  int called = 0, done;
+  pthread_mutex_lock(&asyncMutex);
+  while (inFlightCount > 0 && (done = asyncComplete(false)) != -1) {
+    called += done;
+  }
+  pthread_mutex_unlock(&asyncMutex);
+  return called;
+}
+
+/**
+ * Waits for every asynchronous operation in flight and calls its callback.
+ * Returns: the number of callbacks called
+ */
+int tfsWaitAll() {
+  int called = 0;
+  pthread_mutex_lock(&asyncMutex);
+  while (inFlightCount > 0) {
+    called += asyncComplete(true) == 1;
+  }
+  pthread_mutex_unlock(&asyncMutex);
+  return called;
 }
 
 /**
@@ -148,7 +768,8 @@ int setSocketAddressUn(char * path, struct sockaddr_un * addr) {
 }
 
 /**
- * Connects to the server socket.
+ * Connects to the server socket, and to the sockets of its workers if it
+ * has them.
  * Input:
  *  - sockPath: the server socket's path.
  */
@@ -179,15 +800,145 @@ int tfsMount(char * sockPath) {
   // No need to chmod because /tmp has read, write and execute rights for every file.
 
   ser_addr_len = setSocketAddressUn(sockPath, &server_addr);
+
+  /* the worker sockets are numbered from 0 with none missing */
+  char workerPath[sizeof(server_addr.sun_path)];
+  struct stat st;
+  for (workerSocketCount = 0; workerSocketCount < TFS_MAX_WORKER_SOCKETS; workerSocketCount++) {
+    if (snprintf(workerPath, sizeof(workerPath), "%s.%d", sockPath, workerSocketCount) >= sizeof(workerPath) ||
+        stat(workerPath, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+      break;
+    }
+    workerAddrLens[workerSocketCount] = setSocketAddressUn(workerPath, &workerAddrs[workerSocketCount]);
+  }
   
   return EXIT_SUCCESS;
 
 }
 
+/**
+ * Opens a session with the server: a connection on which requests of
+ * many threads of the client are in flight at once, and are replied to as
+ * soon as each one is done. Sessions use the binary wire format.
+ * Input:
+ *  - sockPath: the server socket; the session socket is next to it.
+ */
+int tfsMountSession(char * sockPath) {
+
+  char sessionPath[sizeof(server_addr.sun_path)];
+
+  if (snprintf(sessionPath, sizeof(sessionPath), "%s%s", sockPath, TFS_SESSION_SUFFIX) >= sizeof(sessionPath)) {
+    fprintf(stderr, "Client: socket path too long for sessions\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((scsocket = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+    perror("Client: Error opening session socket");
+    return EXIT_FAILURE;
+  }
+
+  ser_addr_len = setSocketAddressUn(sessionPath, &server_addr);
+  if (connect(scsocket, (struct sockaddr *) &server_addr, ser_addr_len) == -1) {
+    perror("Client: Error connecting to session socket");
+    close(scsocket);
+    return EXIT_FAILURE;
+  }
+
+  if (protocol == TFS_PROTOCOL_TEXT) {
+    protocol = TFS_PROTOCOL_BINARY_HASHED;
+  }
+  session = true;
+  return EXIT_SUCCESS;
+
+}
+
+/**
+ * Shares memory with the server, which takes requests from it: the
+ * fastest way to a server on the same host, with no system calls while
+ * both sides are busy. Requests use the binary wire format.
+ * Input:
+ *  - sockPath: the server socket; the shared memory socket is next to it.
+ */
+int tfsMountShm(char * sockPath) {
+
+  char shmPath[sizeof(server_addr.sun_path)];
+  char byte = 0;
+
+  if (snprintf(shmPath, sizeof(shmPath), "%s%s", sockPath, TFS_SHM_SUFFIX) >= sizeof(shmPath)) {
+    fprintf(stderr, "Client: socket path too long for shared memory\n");
+    return EXIT_FAILURE;
+  }
+
+  int memfd = memfd_create("tecnicofs-shm", MFD_CLOEXEC);
+  if (memfd == -1 || ftruncate(memfd, sizeof(TfsShm)) == -1) {
+    perror("Client: Error creating shared memory");
+    return EXIT_FAILURE;
+  }
+  void *memory = mmap(NULL, sizeof(TfsShm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (memory == MAP_FAILED) {
+    perror("Client: Error mapping shared memory");
+    close(memfd);
+    return EXIT_FAILURE;
+  }
+
+  if ((scsocket = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+    perror("Client: Error opening shared memory socket");
+    return EXIT_FAILURE;
+  }
+  ser_addr_len = setSocketAddressUn(shmPath, &server_addr);
+  if (connect(scsocket, (struct sockaddr *) &server_addr, ser_addr_len) == -1) {
+    perror("Client: Error connecting to shared memory socket");
+    close(scsocket);
+    close(memfd);
+    munmap(memory, sizeof(TfsShm));
+    return EXIT_FAILURE;
+  }
+
+  /* the server maps the memory, and says so */
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+  if (sendmsg(scsocket, &msg, 0) == -1 || recv(scsocket, &byte, 1, 0) != 1) {
+    perror("Client: Error sharing memory with the server");
+    close(scsocket);
+    close(memfd);
+    munmap(memory, sizeof(TfsShm));
+    return EXIT_FAILURE;
+  }
+  close(memfd);
+
+  shm = memory;
+  for (freeSlotCount = 0; freeSlotCount < TFS_SHM_SLOTS; freeSlotCount++) {
+    freeSlots[freeSlotCount] = freeSlotCount;
+    slotDone[freeSlotCount] = false;
+  }
+  if (protocol == TFS_PROTOCOL_TEXT) {
+    protocol = TFS_PROTOCOL_BINARY_HASHED;
+  }
+  return EXIT_SUCCESS;
+
+}
+
 /**
  * Closes the client socket.
  */
 int tfsUnmount() {
   close(scsocket);
+  if (shm) {
+    munmap(shm, sizeof(TfsShm));
+    shm = NULL;
+  }
+  session = false;
+  workerSocketCount = 0;
+  /* replies to operations still in flight are lost with the socket */
+  pthread_mutex_lock(&asyncMutex);
+  inFlightCount = 0;
+  pthread_mutex_unlock(&asyncMutex);
   return EXIT_SUCCESS;
 }
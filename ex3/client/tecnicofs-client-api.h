@@ -2,13 +2,35 @@
 #define API_H
 
 #include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+
+/* Asynchronous operations a client keeps in flight at most */
+#define TFS_ASYNC_WINDOW 64
+
+/* Called with the result of an asynchronous operation and the context it was started with */
+typedef void (*TfsCallback)(int result, void *context);
 
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char* path);
+int tfsSave(char* path);
+int tfsCreateAsync(char *path, char nodeType, TfsCallback callback, void *context);
+int tfsDeleteAsync(char *path, TfsCallback callback, void *context);
+int tfsLookupAsync(char *path, TfsCallback callback, void *context);
+int tfsMoveAsync(char *from, char *to, TfsCallback callback, void *context);
+int tfsPoll();
+int tfsWaitAll();
+int tfsSetProtocol(int protocol);
+int tfsBatchBegin();
+int tfsBatchAdd(char op, char *path, char *arg);
+int tfsBatchSubmit(int *results);
+int tfsTransactionBegin();
+int tfsTransactionSubmit(int *results);
 int tfsMount(char* serverName);
+int tfsMountSession(char* serverName);
+int tfsMountShm(char* serverName);
 int tfsUnmount();
 
 #endif /* CLIENT_H */
@@ -1,10 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
 FILE* inputFile;
 char* serverName;
+/* Operations sent per batch request, 1 to send each one on its own */
+int batchSize = 1;
+/* Set to send the requests on a session instead of datagrams */
+int useSession = 0;
+/* Set to send the requests through memory shared with the server */
+int useShm = 0;
+/* Set to keep many operations in flight, printing each result as it arrives */
+int useAsync = 0;
 
 /**
  * Shows how to run the client program.
@@ -13,7 +22,7 @@ char* serverName;
  */
 static void displayUsage (const char* appName) {
 
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s inputfile server_socket_name [text|binary|hashed|session|shm|async] [batch_size]\n", appName);
     exit(EXIT_FAILURE);
 
 }
@@ -24,13 +33,43 @@ static void displayUsage (const char* appName) {
  */ 
 static void parseArgs (long argc, char* const argv[]) {
 
-    if (argc != 3) {
+    if (argc < 3 || argc > 5) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
     serverName = argv[2];
 
+    if (argc >= 4 && strcmp(argv[3], "session") == 0) {
+        useSession = 1;
+    } else if (argc >= 4 && strcmp(argv[3], "shm") == 0) {
+        useShm = 1;
+    } else if (argc >= 4 && strcmp(argv[3], "async") == 0) {
+        useAsync = 1;
+    } else if (argc >= 4) {
+        const char *protocols[] = { "text", "binary", "hashed" };
+        int protocol = TFS_PROTOCOL_TEXT;
+        while (protocol <= TFS_PROTOCOL_BINARY_HASHED && strcmp(argv[3], protocols[protocol])) {
+            protocol++;
+        }
+        if (tfsSetProtocol(protocol) != EXIT_SUCCESS) {
+            fprintf(stderr, "Invalid protocol: %s\n", argv[3]);
+            displayUsage(argv[0]);
+        }
+    }
+
+    if (argc == 5) {
+        batchSize = atoi(argv[4]);
+        if (batchSize < 1 || batchSize > TFS_MAX_BATCH) {
+            fprintf(stderr, "Invalid batch size: %s\n", argv[4]);
+            displayUsage(argv[0]);
+        }
+        if (useAsync && batchSize > 1) {
+            fprintf(stderr, "Asynchronous operations are not batched\n");
+            displayUsage(argv[0]);
+        }
+    }
+
     inputFile = fopen(argv[1], "r");
 
     if (inputFile == NULL) {
@@ -47,9 +86,217 @@ void errorParse(){
 
 }
 
+/**
+ * Prints the result of an operation.
+ * Inputs:
+ *  - op: the operation.
+ *  - arg1, arg2: its arguments, as in the input file.
+ *  - res: its result.
+ */
+static void printResult(char op, char *arg1, char *arg2, int res) {
+    switch (op) {
+        case 'c':
+            if (arg2[0] == 'f') {
+                if (!res)
+                  printf("Created file: %s\n", arg1);
+                else
+                  printf("Unable to create file: %s\n", arg1);
+            } else {
+                if (!res)
+                  printf("Created directory: %s\n", arg1);
+                else
+                  printf("Unable to create directory: %s\n", arg1);
+            }
+            break;
+        case 'l':
+            if (res >= 0)
+                printf("Search: %s found\n", arg1);
+            else
+                printf("Search: %s not found\n", arg1);
+            break;
+        case 'd':
+            if (!res)
+              printf("Deleted: %s\n", arg1);
+            else
+              printf("Unable to delete: %s\n", arg1);
+            break;
+        case 'm':
+            if (!res)
+              printf("Moved: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to move: %s to %s\n", arg1, arg2);
+            break;
+        case 'p':
+            if (!res)
+              printf("Printed: %s\n", arg1);
+            else
+              printf("Unable to print: %s\n", arg1);
+            break;
+        case 's':
+            if (!res)
+              printf("Saved: %s\n", arg1);
+            else
+              printf("Unable to save: %s\n", arg1);
+            break;
+    }
+}
+
+/* Operations queued in the current batch, to print their results */
+typedef struct queuedOp {
+    char op;
+    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+} QueuedOp;
+
+static QueuedOp queued[TFS_MAX_BATCH];
+static int queuedCount = 0;
+
+/**
+ * Submits the current batch, if any, and prints its results.
+ */
+static void flushBatch() {
+    int results[TFS_MAX_BATCH];
+
+    if (queuedCount == 0) {
+        return;
+    }
+    int count = tfsBatchSubmit(results);
+    if (count != queuedCount) {
+        fprintf(stderr, "Error: batch failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        printResult(queued[i].op, queued[i].arg1, queued[i].arg2, results[i]);
+    }
+    queuedCount = 0;
+}
+
+/**
+ * Queues an operation in the current batch, submitting it when full.
+ */
+static void queueOp(char op, char *arg1, char *arg2) {
+    if (queuedCount == 0) {
+        tfsBatchBegin();
+    }
+    if (tfsBatchAdd(op, arg1, op == 'c' || op == 'm' ? arg2 : NULL) != EXIT_SUCCESS) {
+        /* full: the operation starts the next batch */
+        flushBatch();
+        tfsBatchBegin();
+        if (tfsBatchAdd(op, arg1, op == 'c' || op == 'm' ? arg2 : NULL) != EXIT_SUCCESS) {
+            errorParse();
+        }
+    }
+
+    QueuedOp *entry = &queued[queuedCount++];
+    entry->op = op;
+    strcpy(entry->arg1, arg1);
+    strcpy(entry->arg2, op == 'c' || op == 'm' ? arg2 : "");
+    if (queuedCount == batchSize) {
+        flushBatch();
+    }
+}
+
+/**
+ * Prints the result of an asynchronous operation, once it arrives.
+ * Inputs:
+ *  - res: its result.
+ *  - context: the operation, freed once printed.
+ */
+static void printAsyncResult(int res, void *context) {
+    QueuedOp *entry = context;
+    printResult(entry->op, entry->arg1, entry->arg2, res);
+    free(entry);
+}
+
+/**
+ * Starts an operation without waiting for its result. Operations in
+ * flight together may be applied in any order.
+ */
+static void startOp(char op, char *arg1, char *arg2) {
+    QueuedOp *entry = malloc(sizeof(QueuedOp));
+    int res;
+
+    if (!entry) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->op = op;
+    strcpy(entry->arg1, arg1);
+    strcpy(entry->arg2, op == 'c' || op == 'm' ? arg2 : "");
+
+    switch (op) {
+        case 'c':
+            res = tfsCreateAsync(entry->arg1, entry->arg2[0], printAsyncResult, entry);
+            break;
+        case 'd':
+            res = tfsDeleteAsync(entry->arg1, printAsyncResult, entry);
+            break;
+        case 'l':
+            res = tfsLookupAsync(entry->arg1, printAsyncResult, entry);
+            break;
+        default:
+            res = tfsMoveAsync(entry->arg1, entry->arg2, printAsyncResult, entry);
+            break;
+    }
+    /* the callback is only called for an operation that was sent */
+    if (res != EXIT_SUCCESS) {
+        printAsyncResult(res, entry);
+    }
+}
+
+/* Operations of the transaction being built, from consecutive "t" lines */
+static QueuedOp transaction[TFS_MAX_BATCH];
+static int transactionCount = 0;
+
+/**
+ * Submits the current transaction, if any, and prints its outcome.
+ */
+static void commitTransaction() {
+    int results[TFS_MAX_BATCH];
+
+    if (transactionCount == 0) {
+        return;
+    }
+    if (tfsTransactionSubmit(results) == EXIT_SUCCESS) {
+        printf("Transaction committed: %d operations\n", transactionCount);
+    } else {
+        for (int i = 0; i < transactionCount; i++) {
+            if (results[i] != TECNICOFS_ERROR_OTHER) {
+                printf("Transaction aborted: %c %s%s%s failed\n", transaction[i].op, transaction[i].arg1,
+                       transaction[i].arg2[0] ? " " : "", transaction[i].arg2);
+            }
+        }
+    }
+    transactionCount = 0;
+}
+
+/**
+ * Adds an operation, given as "t op arg1 [arg2]", to the current
+ * transaction.
+ */
+static void addTransactionOp(char *line) {
+    QueuedOp *entry = &transaction[transactionCount];
+    entry->arg2[0] = '\0';
+
+    int numTokens = sscanf(line, "t %c %s %s", &entry->op, entry->arg1, entry->arg2);
+    if (numTokens < 2 || (numTokens != 3 && entry->op != 'd')) {
+        errorParse();
+    }
+    if (transactionCount == 0) {
+        tfsTransactionBegin();
+    }
+    if (tfsBatchAdd(entry->op, entry->arg1, entry->op == 'd' ? NULL : entry->arg2) != EXIT_SUCCESS) {
+        fprintf(stderr, "Error: invalid or too many operations in transaction\n");
+        exit(EXIT_FAILURE);
+    }
+    transactionCount++;
+}
+
 /**
  * Reads all lines from the input file and calls functions
  * that send the correct command to the server socket.
+ * Creates, deletes, lookups and moves are sent in batches of batchSize,
+ * or asynchronously, waited for before any other line.
+ * Consecutive "t" lines are sent as one transaction.
  */
 void * processInput() {
 
@@ -63,6 +310,15 @@ void * processInput() {
 
         int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
 
+        if (numTokens >= 1 && op == 't') {
+            flushBatch();
+            tfsWaitAll();
+            addTransactionOp(line);
+            continue;
+        }
+        /* any other line ends the transaction */
+        commitTransaction();
+
         /* Perform minimal validation */
         if (numTokens < 2) {
             continue;
@@ -74,60 +330,59 @@ void * processInput() {
                     errorParse();
                     break;
                 }
-                switch (arg2[0]) {
-                    case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                          printf("Created file: %s\n", arg1);
-                        else
-                          printf("Unable to create file: %s\n", arg1);
-                        break;
-                    case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                          printf("Created directory: %s\n", arg1);
-                        else
-                          printf("Unable to create directory: %s\n", arg1);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
+                if (arg2[0] != 'f' && arg2[0] != 'd') {
+                    fprintf(stderr, "Error: invalid node type\n");
+                    break;
+                }
+                if (useAsync) {
+                    startOp(op, arg1, arg2);
+                    break;
+                }
+                if (batchSize > 1) {
+                    queueOp(op, arg1, arg2);
+                    break;
                 }
+                res = tfsCreate(arg1, arg2[0]);
+                printResult(op, arg1, arg2, res);
                 break;
             case 'l': /* Lookup */
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
-                break;
             case 'd': /* Delete */
                 if(numTokens != 2)
                     errorParse();
-                res = tfsDelete(arg1);
-                if (!res)
-                  printf("Deleted: %s\n", arg1);
-                else
-                  printf("Unable to delete: %s\n", arg1);
+                if (useAsync) {
+                    startOp(op, arg1, NULL);
+                    break;
+                }
+                if (batchSize > 1) {
+                    queueOp(op, arg1, NULL);
+                    break;
+                }
+                res = op == 'l' ? tfsLookup(arg1) : tfsDelete(arg1);
+                printResult(op, arg1, arg2, res);
                 break;
             case 'm': /* Move */
                 if(numTokens != 3)
                     errorParse();
+                if (useAsync) {
+                    startOp(op, arg1, arg2);
+                    break;
+                }
+                if (batchSize > 1) {
+                    queueOp(op, arg1, arg2);
+                    break;
+                }
                 res = tfsMove(arg1, arg2);
-                if (!res)
-                  printf("Moved: %s to %s\n", arg1, arg2);
-                else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
+                printResult(op, arg1, arg2, res);
                 break;
             case 'p': /* Print */
+            case 's': /* Save image */
                 if(numTokens != 2)
                     errorParse();
-                res = tfsPrint(arg1);
-                if (!res)
-                  printf("Printed: %s\n", arg1);
-                else
-                  printf("Unable to print: %s\n", arg1);
+                /* after every operation before it */
+                flushBatch();
+                tfsWaitAll();
+                res = op == 'p' ? tfsPrint(arg1) : tfsSave(arg1);
+                printResult(op, arg1, arg2, res);
                 break;
             case '#':
                 break;
@@ -138,6 +393,9 @@ void * processInput() {
 
     }
 
+    flushBatch();
+    tfsWaitAll();
+    commitTransaction();
     fclose(inputFile);
     return NULL;
 
@@ -147,7 +405,8 @@ int main(int argc, char* argv[]) {
 
     parseArgs(argc, argv);
 
-    if (tfsMount(serverName) == 0)
+    int mounted = useShm ? tfsMountShm(serverName) : useSession ? tfsMountSession(serverName) : tfsMount(serverName);
+    if (mounted == 0)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
@@ -0,0 +1,348 @@
+#include "tecnicofs-client-api.h"
+#include "../server/fs/operations.h"
+#include "../server/fs/wal.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+
+/*
+ * The client API with the filesystem in the calling process: each call is
+ * applied directly, with no socket and no encoding, as the server applies
+ * the requests it receives. Link with libtecnicofs-embedded.a instead of
+ * tecnicofs-client-api.o.
+ */
+
+static bool mounted = false;
+
+/* Batch or transaction being built: its kind and operations, on copies of their paths */
+static char batchKind = 0;
+static int batchCount = 0;
+static txn_op batch[TFS_MAX_BATCH];
+static char batchPaths[TFS_MAX_BATCH][TFS_MAX_PATHS][MAX_FILE_NAME];
+
+/**
+ * Copies a path, as the filesystem alters the paths it is given.
+ * Inputs:
+ *  - path: to copy.
+ *  - copy: where to, MAX_FILE_NAME long.
+ * Returns: the copy, or NULL if the path is too long
+ */
+static char *copyPath(const char *path, char *copy) {
+  size_t length = strlen(path);
+  if (length >= MAX_FILE_NAME) {
+    return NULL;
+  }
+  return memcpy(copy, path, length + 1);
+}
+
+/**
+ * Applies an operation.
+ * Inputs:
+ *  - opcode, nodeType: the operation, and the node type of a creation.
+ *  - path, path2: its paths, which it may alter.
+ * Returns: the result of the operation, as the server would reply it
+ */
+static int apply(char opcode, char nodeType, char *path, char *path2) {
+  int fd, opReturn;
+
+  if (!mounted) {
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  switch (opcode) {
+    case TFS_OP_CREATE:
+      if (nodeType != 'f' && nodeType != 'd') {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      return create_aux(path, nodeType == 'd' ? T_DIRECTORY : T_FILE);
+    case TFS_OP_DELETE:
+      return delete_aux(path);
+    case TFS_OP_LOOKUP:
+      return lookup_aux(path);
+    case TFS_OP_MOVE:
+      return move_aux(path, path2);
+    case TFS_OP_PRINT:
+      if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      opReturn = print_tecnicofs_tree(fd);
+      close(fd);
+      return opReturn;
+    case TFS_OP_SAVE:
+      return save_tecnicofs_image(path);
+    default:
+      return TECNICOFS_ERROR_OTHER;
+  }
+}
+
+/**
+ * Applies an operation on copies of its paths.
+ * Inputs:
+ *  - opcode, nodeType, path, path2: the operation.
+ * Returns: its result, or TECNICOFS_ERROR_OTHER if a path is too long
+ */
+static int request(char opcode, char nodeType, const char *path, const char *path2) {
+  char copy[TFS_MAX_PATHS][MAX_FILE_NAME];
+
+  if (!copyPath(path, copy[0]) || (path2 && !copyPath(path2, copy[1]))) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  return apply(opcode, nodeType, copy[0], path2 ? copy[1] : NULL);
+}
+
+/**
+ * Every wire format is the same in process.
+ */
+int tfsSetProtocol(int newProtocol) {
+  if (newProtocol != TFS_PROTOCOL_TEXT && newProtocol != TFS_PROTOCOL_BINARY &&
+      newProtocol != TFS_PROTOCOL_BINARY_HASHED) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Starts a batch of operations, which tfsBatchSubmit applies in order.
+ */
+int tfsBatchBegin() {
+  batchKind = TFS_OP_BATCH;
+  batchCount = 0;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Starts a transaction, which tfsTransactionSubmit applies all or none of.
+ * Transactions only hold creations, deletions and moves.
+ */
+int tfsTransactionBegin() {
+  batchKind = TFS_OP_TRANSACTION;
+  batchCount = 0;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Adds an operation to the batch or transaction.
+ * Inputs:
+ *  - op: the operation, as in the text commands: 'c', 'd', 'l' or 'm'.
+ *  - path: its path.
+ *  - arg: the node type ("f" or "d") of a create, the new path of a move,
+ *    NULL otherwise.
+ * Returns: EXIT_SUCCESS, or TECNICOFS_ERROR_OTHER if the operation is
+ *  invalid or the batch is full and must be submitted first
+ */
+int tfsBatchAdd(char op, char *path, char *arg) {
+  if (!batchKind || batchCount == TFS_MAX_BATCH) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  txn_op *added = &batch[batchCount];
+  added->op = op;
+  added->nodeType = T_FILE;
+  added->newPath = NULL;
+
+  switch (op) {
+    case TFS_OP_CREATE:
+      if (!arg || (arg[0] != 'f' && arg[0] != 'd')) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      added->nodeType = arg[0] == 'd' ? T_DIRECTORY : T_FILE;
+      break;
+    case TFS_OP_MOVE:
+      if (!arg || !(added->newPath = copyPath(arg, batchPaths[batchCount][1]))) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      break;
+    case TFS_OP_DELETE:
+      break;
+    case TFS_OP_LOOKUP:
+      if (batchKind == TFS_OP_TRANSACTION) {
+        return TECNICOFS_ERROR_OTHER;
+      }
+      break;
+    default:
+      return TECNICOFS_ERROR_OTHER;
+  }
+  if (!(added->path = copyPath(path, batchPaths[batchCount][0]))) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  batchCount++;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Applies the operations of the batch, in order.
+ * Input:
+ *  - results: set to the result of each operation, in the order they were added.
+ * Returns: the number of operations
+ */
+int tfsBatchSubmit(int *results) {
+  if (batchKind != TFS_OP_BATCH) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  batchKind = 0;
+
+  for (int i = 0; i < batchCount; i++) {
+    txn_op *op = &batch[i];
+    results[i] = apply(op->op, op->nodeType == T_DIRECTORY ? 'd' : 'f', op->path, op->newPath);
+  }
+  return batchCount;
+}
+
+/**
+ * Applies the transaction.
+ * Input:
+ *  - results: set to the result of each operation, in the order they were
+ *    added: if the transaction aborted, FAIL for the operation that failed
+ *    and TECNICOFS_ERROR_OTHER for the others, which were not applied.
+ * Returns: EXIT_SUCCESS if every operation was applied, or
+ *  TECNICOFS_ERROR_OTHER if none was
+ */
+int tfsTransactionSubmit(int *results) {
+  if (batchKind != TFS_OP_TRANSACTION || !mounted) {
+    batchKind = 0;
+    return TECNICOFS_ERROR_OTHER;
+  }
+  batchKind = 0;
+
+  return transaction_aux(batch, batchCount, results) == SUCCESS ? EXIT_SUCCESS : TECNICOFS_ERROR_OTHER;
+}
+
+/**
+ * Creates a file/directory.
+ * Inputs:
+ *  - name: The new file/directory's name.
+ *  - nodeType: Used to choose what to create (file or directory).
+ */
+int tfsCreate(char *name, char nodeType) {
+  return request(TFS_OP_CREATE, nodeType, name, NULL);
+}
+
+/**
+ * Deletes a file/directory.
+ * Input:
+ *  - path: The file/directory to be deleted's path.
+ */
+int tfsDelete(char *path) {
+  return request(TFS_OP_DELETE, 0, path, NULL);
+}
+
+/**
+ * Moves a file/directory.
+ * Inputs:
+ *  - from: Original location.
+ *  - to: New location.
+ */
+int tfsMove(char *from, char *to) {
+  return request(TFS_OP_MOVE, 0, from, to);
+}
+
+/**
+ * Searches for a file/directory.
+ * Input:
+ *  - path: The file/directory to be searched's path.
+ */
+int tfsLookup(char *path) {
+  return request(TFS_OP_LOOKUP, 0, path, NULL);
+}
+
+/**
+ * Prints the whole file system's tree to a file.
+ * Input:
+ *  - path: The output file's path.
+ */
+int tfsPrint(char * path) {
+  return request(TFS_OP_PRINT, 0, path, NULL);
+}
+
+/**
+ * Saves an image of the file system, which a server can be started from.
+ * Input:
+ *  - path: The image file's path.
+ */
+int tfsSave(char * path) {
+  return request(TFS_OP_SAVE, 0, path, NULL);
+}
+
+/**
+ * Applies an operation at once, and calls back with its result before
+ * returning: there is no reply to wait for in process.
+ * Inputs:
+ *  - opcode, nodeType, path, path2: the operation.
+ *  - callback, context: called with the result.
+ * Returns: EXIT_SUCCESS, or TECNICOFS_ERROR_OTHER if the callback was not called
+ */
+static int requestAsync(char opcode, char nodeType, const char *path, const char *path2, TfsCallback callback,
+                        void *context) {
+  if (!callback) {
+    return TECNICOFS_ERROR_OTHER;
+  }
+  callback(request(opcode, nodeType, path, path2), context);
+  return EXIT_SUCCESS;
+}
+
+int tfsCreateAsync(char *path, char nodeType, TfsCallback callback, void *context) {
+  return requestAsync(TFS_OP_CREATE, nodeType, path, NULL, callback, context);
+}
+
+int tfsDeleteAsync(char *path, TfsCallback callback, void *context) {
+  return requestAsync(TFS_OP_DELETE, 0, path, NULL, callback, context);
+}
+
+int tfsLookupAsync(char *path, TfsCallback callback, void *context) {
+  return requestAsync(TFS_OP_LOOKUP, 0, path, NULL, callback, context);
+}
+
+int tfsMoveAsync(char *from, char *to, TfsCallback callback, void *context) {
+  return requestAsync(TFS_OP_MOVE, 0, from, to, callback, context);
+}
+
+/**
+ * Nothing is ever left in flight.
+ */
+int tfsPoll() {
+  return 0;
+}
+
+int tfsWaitAll() {
+  return 0;
+}
+
+/**
+ * Starts an empty filesystem in the process, with no log.
+ * Input:
+ *  - sockPath: ignored, as there is no server.
+ */
+int tfsMount(char * sockPath) {
+  if (mounted) {
+    return TECNICOFS_ERROR_OPEN_SESSION;
+  }
+  init_fs(NULL, NULL, WAL_SYNC_ASYNC, 0);
+  mounted = true;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * As tfsMount: every thread of the process shares the filesystem.
+ */
+int tfsMountSession(char * sockPath) {
+  return tfsMount(sockPath);
+}
+
+/**
+ * As tfsMount: the filesystem is already in the process' memory.
+ */
+int tfsMountShm(char * sockPath) {
+  return tfsMount(sockPath);
+}
+
+/**
+ * Destroys the filesystem.
+ */
+int tfsUnmount() {
+  if (!mounted) {
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  }
+  destroy_fs();
+  mounted = false;
+  return EXIT_SUCCESS;
+}
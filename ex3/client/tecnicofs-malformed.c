@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "../tecnicofs-protocol.h"
+
+/*
+ * Sends requests the server must turn down without going down: each one
+ * on a datagram and on a session of its own. The server drops a datagram
+ * it can't apply, with no reply, and closes a session that sends one.
+ * Then checks it still answers a valid request.
+ */
+
+static char *serverName;
+static char clientPath[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/**
+ * Sets a socket address to a path.
+ * Inputs:
+ *  - path: the path.
+ *  - addr: the address.
+ * Returns: its length
+ */
+static socklen_t setAddress(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+    return SUN_LEN(addr);
+}
+
+/**
+ * Sends a message on a new datagram socket and waits a little for a reply.
+ * Inputs:
+ *  - message, length: the message.
+ *  - reply, size: where to receive the reply.
+ * Returns: the length of the reply, 0 if none came, or -1 if the server
+ *  socket is gone
+ */
+static ssize_t sendDatagram(const void *message, size_t length, void *reply, size_t size) {
+    struct sockaddr_un client, server;
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 300000 };
+    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    unlink(clientPath);
+    if (sock == -1 || bind(sock, (struct sockaddr *) &client, setAddress(clientPath, &client)) == -1 ||
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("Malformed: error opening client socket");
+        exit(EXIT_FAILURE);
+    }
+    socklen_t len = setAddress(serverName, &server);
+    ssize_t received = -1;
+    if (sendto(sock, message, length, 0, (struct sockaddr *) &server, len) != -1) {
+        received = recv(sock, reply, size, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            received = 0;
+        }
+    }
+    close(sock);
+    unlink(clientPath);
+    return received;
+}
+
+/**
+ * Sends a message on a new session.
+ * Inputs:
+ *  - message, length: the message.
+ * Returns: true if the server closed the session, false otherwise
+ */
+static bool sendOnSession(const void *message, size_t length) {
+    char path[sizeof(clientPath)], byte;
+    struct sockaddr_un server;
+    struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    snprintf(path, sizeof(path), "%s%s", serverName, TFS_SESSION_SUFFIX);
+    if (sock == -1 || connect(sock, (struct sockaddr *) &server, setAddress(path, &server)) == -1 ||
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        close(sock);
+        return false;
+    }
+    bool closed = send(sock, message, length, MSG_NOSIGNAL) != -1 && recv(sock, &byte, 1, 0) == 0;
+    close(sock);
+    return closed;
+}
+
+/**
+ * Sends a malformed request both ways and checks it is turned down.
+ * Inputs:
+ *  - what: the request, for the messages.
+ *  - message, length: the request.
+ *  - session: whether to also send it on a session, which only takes
+ *    binary requests.
+ * Returns: true if it was, false otherwise
+ */
+static bool check(const char *what, const void *message, size_t length, bool session) {
+    char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)];
+
+    if (sendDatagram(message, length, reply, sizeof(reply)) != 0) {
+        printf("Not dropped on a datagram: %s\n", what);
+        return false;
+    }
+    if (session && !sendOnSession(message, length)) {
+        printf("Not dropped on a session: %s\n", what);
+        return false;
+    }
+    printf("Dropped: %s\n", what);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+
+    char message[TFS_MAX_BATCH_MESSAGE] __attribute__((aligned(8)));
+    char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+    bool passed = true;
+    size_t length;
+    int result;
+
+    if (argc != 2) {
+        printf("Usage: %s server_socket_name\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    serverName = argv[1];
+    snprintf(clientPath, sizeof(clientPath), "/tmp/tecnicofs-malformed-%d", getpid());
+
+    length = tfs_encode_request(message, 'x', 1, 0, 0, "/a", NULL);
+    passed &= check("unknown operation", message, length, true);
+
+    length = tfs_encode_request(message, TFS_OP_CREATE, 2, 0, 'x', "/a", NULL);
+    passed &= check("creation of an unknown node type", message, length, true);
+
+    length = tfs_encode_request(message, TFS_OP_MOVE, 3, 0, 0, "/a", NULL);
+    passed &= check("move without a destination", message, length, true);
+
+    length = tfs_batch_begin(message, TFS_OP_BATCH, 4);
+    length = tfs_batch_add(message, length, TFS_OP_LOOKUP, 0, 0, "/a", NULL);
+    length = tfs_batch_add(message, length, TFS_OP_CREATE, 0, 'x', "/a", NULL);
+    passed &= check("batch with an unknown node type", message, length, true);
+
+    length = tfs_batch_begin(message, TFS_OP_TRANSACTION, 5);
+    length = tfs_batch_add(message, length, TFS_OP_LOOKUP, 0, 0, "/a", NULL);
+    passed &= check("transaction with a lookup", message, length, true);
+
+    /* text commands are shorter than MAX_INPUT_SIZE, only binary batches get more room */
+    length = sprintf(message, "l /");
+    memset(message + length, 'a', 5000);
+    length += 5000;
+    passed &= check("text command longer than MAX_INPUT_SIZE", message, length, false);
+
+    /* the server still answers */
+    length = tfs_encode_request(message, TFS_OP_LOOKUP, 6, 0, 0, "/", NULL);
+    ssize_t received = sendDatagram(message, length, reply, sizeof(reply));
+    if (received <= 0 || !tfs_decode_reply(reply, received, 6, &result) || result < 0) {
+        printf("Server no longer answers\n");
+        passed = false;
+    }
+
+    exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# variables
+inputdir=$1
+outputdir=$2
+shift 2
+socket=/tmp/tecnicofs-tests-$$
+
+# argument validation
+[ ! -d "$inputdir" ] && { echo "Input directory $inputdir doesn't exist. Please try again."; exit 1; }
+[ ! -d "$outputdir" ] && { echo "Output directory $outputdir doesn't exist. Please try again."; exit 1; }
+
+# each input runs on a new server, started with the remaining arguments,
+# and its output must match the .out file next to it
+failed=0
+for file in "$inputdir"/*.txt;
+do
+    name=$(basename $file .txt)
+    echo "InputFile=$file"
+    ./server/tecnicofs "$@" 4 $socket > $outputdir/$name.server 2>&1 &
+    server=$!
+    for i in $(seq 50); do [ -S $socket ] && break; sleep 0.1; done
+    # requests the server must drop, without going down
+    if ! ./client/tecnicofs-malformed $socket > $outputdir/$name.malformed; then
+        echo "Server did not drop malformed requests, see $outputdir/$name.malformed"
+        failed=1
+    fi
+    ./client/tecnicofs-client $file $socket | grep -v "^Mounted!" > $outputdir/$name.out
+    kill $server; wait $server 2>/dev/null
+    rm -f $socket $socket.*
+    if ! cmp -s $outputdir/$name.out "$inputdir/$name.out"; then
+        echo "Output differs from $inputdir/$name.out"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,1170 @@
+/* for recvmmsg and sendmmsg */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "fs/state.h"
+#include "uring.h"
+#include "engine.h"
+
+/*
+ * Event-loop front end. A few I/O threads wait on epoll for the server
+ * socket, the session socket and the sessions, receive and decode the
+ * requests, and hand them to the filesystem workers through one queue per
+ * worker. A worker that finishes a request hands it back to the I/O thread
+ * that received it, which sends the reply. A worker stuck behind an i-node
+ * lock holds up only the requests already in its queue, while the I/O
+ * threads keep taking traffic.
+ *
+ * The I/O threads may instead run on io_uring: each keeps multishot
+ * receives posted on the sockets, with buffers the kernel picks from a
+ * registered ring, and submits its replies along with waiting for the
+ * next completions, in one system call for many messages.
+ *
+ * In partitions, each worker owns the top-level directories tfs_route
+ * gives it, and every request goes to the owner of its first path,
+ * through a lock-free mailbox. No other worker goes below the root of a
+ * partition while its owner applies a job, so the owner skips the locks of
+ * every i-node but the root, which all partitions share (see
+ * lock_partition_owner); only while a snapshot is read, its operations
+ * lock as usual, for the dump reads every partition.
+ * A job whose other paths route elsewhere (the destination of a move, the
+ * later operations of a batch or transaction) is applied whole by the
+ * owner of its first path, after a handshake with the owners of those
+ * partitions: it asks each to park, and waits until each says it has, in
+ * between two jobs, then lets them go once done. Such jobs take turns, so
+ * two of them never reach into the same partition, or wait on each other.
+ */
+
+typedef struct workerQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    Job *head, *tail;
+    int length;
+    int maxLength;
+    unsigned long busy_ns, jobs;
+    /* mailbox of a partition's owner: producers push after last, the owner pops first */
+    Job *last, *first;
+    Job *stub;                   /* stands in for the jobs while there are none */
+    int sleeping;                /* futex the owner waits on while it has nothing to do */
+    int park;                    /* set while a job reaching into the partition waits or runs */
+    int parked;                  /* set while the owner is between two jobs */
+    char *reach;                 /* partitions its owner's job reaches, besides its own */
+} __attribute__((aligned(64))) WorkerQueue;
+
+typedef struct ioThread {
+    int epfd;
+    int wakefd;                  /* eventfd workers signal replies on */
+    pthread_mutex_t mutex;
+    Job *done;                   /* jobs waiting for their replies to be sent */
+    unsigned int next;           /* to spread jobs over the workers */
+    unsigned long busy_ns, messages, wakeups;
+    Uring ring;                  /* on io_uring, */
+    UringBuffers buffers;        /* the datagrams and session requests are received in */
+    struct msghdr recvHdr;       /* how to receive datagrams */
+    uint64_t wakeCount;          /* read from wakefd */
+    Job *retry;                  /* datagram replies waiting for room at their clients */
+    bool retryPosted;            /* whether the timeout that retries them is */
+    struct __kernel_timespec retryDelay;
+} __attribute__((aligned(64))) IoThread;
+
+static WorkerQueue *workers = NULL;
+static int workerCount = 0;
+static IoThread *ioThreads = NULL;
+static int ioCount = 0;
+static unsigned int nextIo = 0;
+static unsigned long start_ns = 0;
+static const char *ioName = "epoll";
+/* Set if each worker owns a partition of the tree */
+static bool partitioned = false;
+static unsigned long crossJobs = 0;      /* with paths outside their owner's partition */
+/* Held by the job reaching across partitions, one at a time */
+static pthread_mutex_t crossMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Tags of the sockets that are not sessions, in epoll events */
+static char dgramTag, listenTag, wakeTag;
+
+/*
+ * Parses an engine name: threads, epoll, mmsg or uring.
+ * Returns: the engine, or FAIL
+ */
+int engine_parse(const char *name) {
+    if (!strcmp(name, "threads")) {
+        return ENGINE_THREADS;
+    } else if (!strcmp(name, "epoll")) {
+        return ENGINE_EPOLL;
+    } else if (!strcmp(name, "mmsg")) {
+        return ENGINE_MMSG;
+    } else if (!strcmp(name, "uring")) {
+        return ENGINE_URING;
+    }
+    return FAIL;
+}
+
+/*
+ * Adds a job to a mailbox. Any thread may.
+ */
+static void mailboxPush(WorkerQueue *queue, Job *job) {
+    job->next = NULL;
+    Job *prev = __atomic_exchange_n(&queue->last, job, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, job, __ATOMIC_RELEASE);
+}
+
+/*
+ * Takes the oldest job of a mailbox. Only its owner may.
+ * Returns: the job, or NULL if there is none, or the next is still being added
+ */
+static Job *mailboxPop(WorkerQueue *queue) {
+    Job *first = queue->first;
+    Job *next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+
+    if (first == queue->stub) {
+        if (!next) {
+            return NULL;
+        }
+        queue->first = first = next;
+        next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE);
+    }
+    if (!next) {
+        /* the last job can't be taken before the stub is put behind it */
+        if (first != __atomic_load_n(&queue->last, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        mailboxPush(queue, queue->stub);
+        if (!(next = __atomic_load_n(&first->next, __ATOMIC_ACQUIRE))) {
+            return NULL;
+        }
+    }
+    queue->first = next;
+    return first;
+}
+
+/*
+ * Gives a job to the owner of its first path, waking it if it sleeps.
+ */
+static void dispatchToOwner(Job *job) {
+    int owner = job->count > 0 ? tfs_route(job->requests[0].paths[0], workerCount) : 0;
+    WorkerQueue *queue = &workers[owner];
+
+    int length = __atomic_add_fetch(&queue->length, 1, __ATOMIC_RELAXED);
+    if (length > __atomic_load_n(&queue->maxLength, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&queue->maxLength, length, __ATOMIC_RELAXED);
+    }
+    mailboxPush(queue, job);
+
+    /* the owner checks its mailbox again after saying it sleeps */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&queue->sleeping, 0, __ATOMIC_RELAXED)) {
+        syscall(SYS_futex, &queue->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Queues a job in the less busy of two workers, taken in turns, or in
+ * partitions, with the owner of its first path.
+ */
+static void dispatch(IoThread *io, Job *job) {
+    if (partitioned) {
+        dispatchToOwner(job);
+        return;
+    }
+
+    WorkerQueue *a = &workers[io->next++ % workerCount];
+    WorkerQueue *b = &workers[io->next % workerCount];
+    WorkerQueue *queue = __atomic_load_n(&b->length, __ATOMIC_RELAXED) <
+                         __atomic_load_n(&a->length, __ATOMIC_RELAXED) ? b : a;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+    queue->tail = job;
+    if (++queue->length > queue->maxLength) {
+        queue->maxLength = queue->length;
+    }
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Makes a job of a received message, decodes it and queues it.
+ * Input:
+ *  - io: the I/O thread that received it
+ *  - message, length: the message, copied into the job
+ *  - session: it came from, or NULL
+ *  - addr, addrLen: the sender of a datagram
+ * Returns: false if the message is invalid, and was dropped
+ */
+static bool receive(IoThread *io, char *message, size_t length, Session *session,
+                    struct sockaddr_un *addr, socklen_t addrLen) {
+    bool binary = tfs_is_binary(message, length);
+    int count = 1;
+
+    if (!validLength(message, length)) {
+        return false;
+    }
+
+    /* a batch can't hold more requests than it says */
+    if (binary && length >= sizeof(TfsHeader) + sizeof(TfsBatch) &&
+        (((TfsHeader *) message)->opcode == TFS_OP_BATCH || ((TfsHeader *) message)->opcode == TFS_OP_TRANSACTION)) {
+        count = ((TfsBatch *) ((TfsHeader *) message + 1))->count;
+        count = count < 1 ? 1 : count > TFS_MAX_BATCH ? TFS_MAX_BATCH : count;
+    }
+
+    Job *job = malloc(sizeof(Job) + count * sizeof(TfsRequest) + length + 1);
+    if (!job) {
+        fprintf(stderr, "Server: error allocating request\n");
+        exit(EXIT_FAILURE);
+    }
+    char *copy = (char *) (job->requests + count);
+    memcpy(copy, message, length);
+    copy[length] = '\0';
+
+    job->next = NULL;
+    job->source = io - ioThreads;
+    job->session = session;
+    job->binary = binary;
+    job->length = length;
+    if (addr) {
+        job->addr = *addr;
+        job->addrLen = addrLen;
+    }
+    if (binary && (job->count = decodeBinary(copy, length, job->requests)) == FAIL) {
+        free(job);
+        return false;
+    }
+    if (!binary) {
+        parseCommand(copy, &job->requests[0], job->name, job->arg);
+        job->count = 1;
+    }
+    if (session) {
+        __atomic_add_fetch(&session->refs, 1, __ATOMIC_RELAXED);
+        countSessionRequest(__atomic_add_fetch(&session->inFlight, 1, __ATOMIC_RELAXED));
+    }
+    io->messages++;
+    dispatch(io, job);
+    return true;
+}
+
+/*
+ * Hands a job whose reply is ready back to its I/O thread.
+ */
+static void complete(Job *job) {
+    IoThread *io = &ioThreads[job->source];
+
+    pthread_mutex_lock(&io->mutex);
+    bool wake = !io->done;
+    job->next = io->done;
+    io->done = job;
+    pthread_mutex_unlock(&io->mutex);
+
+    /* the thread drains every reply once woken */
+    uint64_t one = 1;
+    if (wake && write(io->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("Server: error waking I/O thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Waits for the next job of a worker.
+ * Returns: the job
+ */
+static Job *takeJob(WorkerQueue *queue) {
+    Job *job;
+
+    if (partitioned) {
+        while (!(job = mailboxPop(queue))) {
+            __atomic_store_n(&queue->sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if ((job = mailboxPop(queue))) {
+                __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+                break;
+            }
+            syscall(SYS_futex, &queue->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+        }
+        __atomic_sub_fetch(&queue->length, 1, __ATOMIC_RELAXED);
+        return job;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->head) {
+        pthread_cond_wait(&queue->ready, &queue->mutex);
+    }
+    job = queue->head;
+    if (!(queue->head = job->next)) {
+        queue->tail = NULL;
+    }
+    queue->length--;
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+}
+
+/*
+ * Sleeps while a word holds a value.
+ */
+static void futexWait(int *word, int value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/*
+ * Wakes every thread sleeping on a word.
+ */
+static void futexWake(int *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Marks the partitions a job reaches besides its owner's. The file a dump
+ * is written to is not in the tree.
+ * Returns: how many there are
+ */
+static int reach(WorkerQueue *queue, Job *job) {
+    int owner = queue - workers, count = 0;
+
+    for (int i = 0; i < job->count; i++) {
+        TfsRequest *request = &job->requests[i];
+        if (request->opcode == TFS_OP_PRINT || request->opcode == TFS_OP_SAVE) {
+            continue;
+        }
+        for (int j = 0; j < request->pathCount; j++) {
+            int partition = tfs_route(request->paths[j], workerCount);
+            if (partition != owner && !queue->reach[partition]) {
+                queue->reach[partition] = 1;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * Starts applying a job in a partition, by its owner: parks first while a
+ * job from another partition is asking it to, then, if this job reaches
+ * into other partitions, waits for the owner of each to park.
+ * Returns: whether the job reaches into other partitions
+ */
+static bool enterPartition(WorkerQueue *queue, Job *job) {
+    bool cross = reach(queue, job) > 0;
+
+    /* parked while waiting its turn, so the job before it can go on */
+    if (cross) {
+        __atomic_add_fetch(&crossJobs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&crossMutex);
+    }
+
+    /* a job asking after this sees parked cleared, or this sees it asking */
+    while (true) {
+        __atomic_store_n(&queue->parked, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&queue->park, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        __atomic_store_n(&queue->parked, 1, __ATOMIC_RELEASE);
+        futexWake(&queue->parked);
+        while (__atomic_load_n(&queue->park, __ATOMIC_ACQUIRE)) {
+            futexWait(&queue->park, 1);
+        }
+    }
+
+    if (cross) {
+        for (int i = 0; i < workerCount; i++) {
+            if (queue->reach[i]) {
+                __atomic_store_n(&workers[i].park, 1, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (int i = 0; i < workerCount; i++) {
+            while (queue->reach[i] && !__atomic_load_n(&workers[i].parked, __ATOMIC_ACQUIRE)) {
+                futexWait(&workers[i].parked, 0);
+            }
+        }
+    }
+    return cross;
+}
+
+/*
+ * Finishes applying a job in a partition: lets the owners it parked go,
+ * and says this owner is between two jobs.
+ * Input:
+ *  - cross: what enterPartition returned
+ */
+static void leavePartition(WorkerQueue *queue, bool cross) {
+    if (cross) {
+        for (int i = 0; i < workerCount; i++) {
+            if (queue->reach[i]) {
+                queue->reach[i] = 0;
+                __atomic_store_n(&workers[i].park, 0, __ATOMIC_RELEASE);
+                futexWake(&workers[i].park);
+            }
+        }
+    }
+
+    __atomic_store_n(&queue->parked, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->park, __ATOMIC_RELAXED)) {
+        futexWake(&queue->parked);
+    }
+
+    if (cross) {
+        pthread_mutex_unlock(&crossMutex);
+    }
+}
+
+/*
+ * Applies the requests of one worker's queue.
+ * Input:
+ *  - arg: the queue
+ */
+static void *work(void *arg) {
+    WorkerQueue *queue = arg;
+    bool cross = false;
+
+    if (partitioned) {
+        lock_partition_owner();
+    }
+
+    while (true) {
+        Job *job = takeJob(queue);
+
+        if (partitioned) {
+            cross = enterPartition(queue, job);
+        }
+        unsigned long start = now_ns();
+        char *message = (char *) (job->requests + job->count);
+        if (job->binary) {
+            job->replyLength = applyDecoded(message, job->requests, job->count, job->reply);
+        } else {
+            int opReturn = applyRequest(&job->requests[0]);
+            memcpy(job->reply, &opReturn, sizeof(opReturn));
+            job->replyLength = sizeof(opReturn);
+        }
+        __atomic_add_fetch(&queue->busy_ns, now_ns() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&queue->jobs, 1, __ATOMIC_RELAXED);
+        if (partitioned) {
+            leavePartition(queue, cross);
+        }
+
+        complete(job);
+    }
+    return NULL;
+}
+
+/*
+ * Returns: the jobs the workers handed back to an I/O thread
+ */
+static Job *takeReplies(IoThread *io) {
+    pthread_mutex_lock(&io->mutex);
+    Job *jobs = io->done;
+    io->done = NULL;
+    pthread_mutex_unlock(&io->mutex);
+    return jobs;
+}
+
+/*
+ * Accounts for a reply sent on a session, or that could not be.
+ */
+static void sentOnSession(Job *job) {
+    __atomic_sub_fetch(&job->session->inFlight, 1, __ATOMIC_RELAXED);
+    releaseSession(job->session);
+}
+
+/*
+ * Sends the replies of the jobs the workers handed back.
+ */
+static void sendReplies(IoThread *io) {
+    uint64_t count;
+    if (read(io->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("Server: error reading I/O thread wakeups");
+        exit(EXIT_FAILURE);
+    }
+
+    Job *job = takeReplies(io);
+
+    while (job) {
+        Job *next = job->next;
+        if (job->session) {
+            /* a client that went away no longer needs its replies */
+            if (send(job->session->fd, job->reply, job->replyLength, MSG_NOSIGNAL) == -1 &&
+                errno != EPIPE && errno != ECONNRESET) {
+                perror("Server: error sending reply on a session");
+                exit(EXIT_FAILURE);
+            }
+            sentOnSession(job);
+        } else if (sendto(scsocket, job->reply, job->replyLength, 0, (struct sockaddr *) &job->addr,
+                          job->addrLen) == -1) {
+            perror("Server: error sending operation return to client");
+            exit(EXIT_FAILURE);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+/*
+ * Receives the datagrams waiting on the server socket, up to the budget.
+ */
+static void receiveDatagrams(IoThread *io, char *message) {
+    for (int i = 0; i < ENGINE_RECV_BUDGET; i++) {
+        struct sockaddr_un addr;
+        socklen_t addrLen = sizeof(addr);
+        ssize_t length = recvfrom(scsocket, message, TFS_MAX_BATCH_MESSAGE, MSG_DONTWAIT,
+                                  (struct sockaddr *) &addr, &addrLen);
+        if (length == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            perror("Server: error receiving message from client");
+            exit(EXIT_FAILURE);
+        }
+        receive(io, message, length, NULL, &addr, addrLen);
+    }
+}
+
+/*
+ * Receives the requests waiting on a session, up to the budget, and
+ * closes it when the client does.
+ */
+static void receiveSession(IoThread *io, Session *session, char *message) {
+    for (int i = 0; i < ENGINE_RECV_BUDGET; i++) {
+        ssize_t length = recv(session->fd, message, TFS_MAX_BATCH_MESSAGE + 1, MSG_DONTWAIT);
+        if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (length == -1 && errno != ECONNRESET) {
+            perror("Server: error receiving from a session");
+            exit(EXIT_FAILURE);
+        }
+        if (length > 0 && (length > TFS_MAX_BATCH_MESSAGE || !tfs_is_binary(message, length))) {
+            fprintf(stderr, "Server: sessions only take binary requests\n");
+            length = 0;
+        }
+        /* a client that sends an invalid request is let go */
+        if (length <= 0 || !receive(io, message, length, session, NULL, 0)) {
+            epoll_ctl(io->epfd, EPOLL_CTL_DEL, session->fd, NULL);
+            releaseSession(session);
+            return;
+        }
+    }
+}
+
+/*
+ * Accepts the waiting connections to the session socket, spreading them
+ * over the I/O threads.
+ */
+static void acceptSessions(void) {
+    while (true) {
+        int fd = accept(sessionSocket, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                return;
+            }
+            perror("Server: error accepting a session");
+            exit(EXIT_FAILURE);
+        }
+
+        IoThread *io = &ioThreads[__atomic_fetch_add(&nextIo, 1, __ATOMIC_RELAXED) % ioCount];
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = openSession(fd) };
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("Server: error watching a session");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Event loop of an I/O thread.
+ * Input:
+ *  - arg: the thread
+ */
+static void *ioLoop(void *arg) {
+    IoThread *io = arg;
+    struct epoll_event events[ENGINE_EVENTS];
+    char message[TFS_MAX_BATCH_MESSAGE + 1] __attribute__((aligned(8)));
+
+    while (true) {
+        int n = epoll_wait(io->epfd, events, ENGINE_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Server: error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        unsigned long start = now_ns();
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &wakeTag) {
+                sendReplies(io);
+            } else if (tag == &dgramTag) {
+                receiveDatagrams(io, message);
+            } else if (tag == &listenTag) {
+                acceptSessions();
+            } else {
+                receiveSession(io, tag, message);
+            }
+        }
+        __atomic_add_fetch(&io->busy_ns, now_ns() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&io->wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Watches a file descriptor in an epoll instance.
+ */
+static void watch(int epfd, int fd, uint32_t events, void *tag) {
+    struct epoll_event event = { .events = events, .data.ptr = tag };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("Server: error watching a socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Kinds of io_uring requests, in the low bits of their user data */
+#define URING_SEND 0             /* of the reply of a job */
+#define URING_RECV_DGRAM 1
+#define URING_ACCEPT 2
+#define URING_RECV_SESSION 3     /* of a session */
+#define URING_WAKE 4
+#define URING_RETRY 5
+#define URING_KIND 7
+/* Room for the sender of a datagram, keeping its message 8-byte aligned */
+#define URING_NAME_ROOM ((sizeof(struct sockaddr_un) + 7) & ~7)
+
+/*
+ * Posts a multishot receive of datagrams on the server socket.
+ */
+static void uringRecvDatagrams(IoThread *io) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = scsocket;
+    sqe->addr = (unsigned long) &io->recvHdr;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = io->buffers.group;
+    sqe->user_data = URING_RECV_DGRAM;
+}
+
+/*
+ * Posts a multishot receive of the requests of a session.
+ */
+static void uringRecvSession(IoThread *io, Session *session) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = session->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = io->buffers.group;
+    sqe->user_data = (unsigned long) session | URING_RECV_SESSION;
+}
+
+/*
+ * Posts a multishot accept of sessions.
+ */
+static void uringAccept(IoThread *io) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sessionSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+/*
+ * Posts a read of the workers' next wakeup.
+ */
+static void uringWake(IoThread *io) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = io->wakefd;
+    sqe->addr = (unsigned long) &io->wakeCount;
+    sqe->len = sizeof(io->wakeCount);
+    sqe->off = -1;
+    sqe->user_data = URING_WAKE;
+}
+
+/*
+ * Posts the send of the reply of a job, which lives until it completes.
+ * Datagram replies are sent without waiting: when a client's queue is full,
+ * unix_dgram_sendmsg fails after taking the message, and a send io_uring
+ * retried on its own would go out empty. They are retried by uringRetry.
+ */
+static void uringSend(IoThread *io, Job *job) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    if (job->session) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = job->session->fd;
+        sqe->addr = (unsigned long) job->reply;
+        sqe->len = job->replyLength;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    } else {
+        job->replyVec = (struct iovec) { .iov_base = job->reply, .iov_len = job->replyLength };
+        job->replyHdr = (struct msghdr) {
+            .msg_name = &job->addr, .msg_namelen = job->addrLen, .msg_iov = &job->replyVec, .msg_iovlen = 1
+        };
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = scsocket;
+        sqe->addr = (unsigned long) &job->replyHdr;
+        sqe->msg_flags = MSG_DONTWAIT;
+    }
+    sqe->user_data = (unsigned long) job | URING_SEND;
+}
+
+/*
+ * Sets a datagram reply aside until its client has room for it, and posts
+ * the timeout that retries the replies set aside, unless it is posted.
+ */
+static void uringRetry(IoThread *io, Job *job) {
+    job->next = io->retry;
+    io->retry = job;
+    if (io->retryPosted) {
+        return;
+    }
+    io->retryPosted = true;
+    io->retryDelay = (struct __kernel_timespec) { .tv_nsec = ENGINE_URING_RETRY_US * 1000 };
+    struct io_uring_sqe *sqe = uring_get_sqe(&io->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) &io->retryDelay;
+    sqe->len = 1;
+    sqe->user_data = URING_RETRY;
+}
+
+/*
+ * Handles a completed io_uring request.
+ * Input:
+ *  - data: its user data
+ *  - res, flags: of its completion
+ */
+static void uringComplete(IoThread *io, unsigned long data, int res, unsigned flags) {
+    bool more = flags & IORING_CQE_F_MORE;
+    char *buffer = flags & IORING_CQE_F_BUFFER ? uring_buffer(&io->buffers, flags >> IORING_CQE_BUFFER_SHIFT) : NULL;
+    Job *job;
+    Session *session;
+
+    switch (data & URING_KIND) {
+        case URING_SEND:
+            job = (Job *) data;
+            if (job->session) {
+                /* a client that went away no longer needs its replies */
+                if (res < 0 && res != -EPIPE && res != -ECONNRESET) {
+                    errno = -res;
+                    perror("Server: error sending reply on a session");
+                    exit(EXIT_FAILURE);
+                }
+                sentOnSession(job);
+            } else if (res == -EAGAIN) {
+                uringRetry(io, job);
+                break;
+            } else if (res < 0) {
+                errno = -res;
+                perror("Server: error sending operation return to client");
+                exit(EXIT_FAILURE);
+            }
+            free(job);
+            break;
+        case URING_RECV_DGRAM:
+            if (buffer) {
+                struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buffer;
+                size_t room = io->buffers.size - sizeof(*out) - URING_NAME_ROOM;
+                receive(io, buffer + sizeof(*out) + URING_NAME_ROOM, out->payloadlen < room ? out->payloadlen : room,
+                        NULL, (struct sockaddr_un *) (out + 1),
+                        out->namelen < sizeof(struct sockaddr_un) ? out->namelen : sizeof(struct sockaddr_un));
+                uring_buffer_recycle(&io->buffers, flags >> IORING_CQE_BUFFER_SHIFT);
+            } else if (res < 0 && res != -ENOBUFS && res != -EINTR) {
+                errno = -res;
+                perror("Server: error receiving message from client");
+                exit(EXIT_FAILURE);
+            }
+            /* the kernel stops a multishot receive that ran out of buffers */
+            if (!more) {
+                uringRecvDatagrams(io);
+            }
+            break;
+        case URING_ACCEPT:
+            if (res >= 0) {
+                uringRecvSession(io, openSession(res));
+            } else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+                errno = -res;
+                perror("Server: error accepting a session");
+                exit(EXIT_FAILURE);
+            }
+            if (!more) {
+                uringAccept(io);
+            }
+            break;
+        case URING_RECV_SESSION:
+            session = (Session *) (data & ~(unsigned long) URING_KIND);
+            if (buffer) {
+                /* a client that sends an invalid request is let go: the receive
+                   then ends, and the session with it */
+                if (!tfs_is_binary(buffer, res)) {
+                    fprintf(stderr, "Server: sessions only take binary requests\n");
+                    shutdown(session->fd, SHUT_RDWR);
+                } else if (!receive(io, buffer, res, session, NULL, 0)) {
+                    shutdown(session->fd, SHUT_RDWR);
+                }
+                uring_buffer_recycle(&io->buffers, flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!more) {
+                if (res == -ENOBUFS) {
+                    uringRecvSession(io, session);
+                } else {
+                    releaseSession(session);
+                }
+            }
+            break;
+        case URING_WAKE:
+            if (res < 0 && res != -EINTR) {
+                errno = -res;
+                perror("Server: error reading I/O thread wakeups");
+                exit(EXIT_FAILURE);
+            }
+            /* a job is gone once its send is posted */
+            for (job = takeReplies(io); job;) {
+                Job *next = job->next;
+                uringSend(io, job);
+                job = next;
+            }
+            uringWake(io);
+            break;
+        case URING_RETRY:
+            io->retryPosted = false;
+            job = io->retry;
+            io->retry = NULL;
+            while (job) {
+                Job *next = job->next;
+                uringSend(io, job);
+                job = next;
+            }
+            break;
+    }
+}
+
+/*
+ * Event loop of an I/O thread on io_uring.
+ * Input:
+ *  - arg: the thread
+ */
+static void *uringLoop(void *arg) {
+    IoThread *io = arg;
+    struct io_uring_cqe *cqe;
+
+    uringRecvDatagrams(io);
+    uringAccept(io);
+    uringWake(io);
+
+    while (true) {
+        /* the replies posted since the last call go out with it */
+        if (uring_submit_and_wait(&io->ring, 1) == FAIL) {
+            perror("Server: error waiting for io_uring completions");
+            exit(EXIT_FAILURE);
+        }
+
+        unsigned long start = now_ns();
+        while ((cqe = uring_peek(&io->ring))) {
+            unsigned long data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_seen(&io->ring);
+            uringComplete(io, data, res, flags);
+        }
+        __atomic_add_fetch(&io->busy_ns, now_ns() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&io->wakeups, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Sets up the io_uring of an I/O thread.
+ * Returns: SUCCESS, or FAIL if the kernel lacks what it takes
+ */
+static int uringSetup(IoThread *io) {
+    if (uring_init(&io->ring, ENGINE_URING_ENTRIES) == FAIL) {
+        return FAIL;
+    }
+    if (uring_buffers_init(&io->ring, &io->buffers, 0, ENGINE_URING_BUFFERS,
+                           sizeof(struct io_uring_recvmsg_out) + URING_NAME_ROOM + TFS_MAX_BATCH_MESSAGE) == FAIL) {
+        close(io->ring.fd);
+        return FAIL;
+    }
+    io->recvHdr = (struct msghdr) { .msg_namelen = URING_NAME_ROOM };
+    return SUCCESS;
+}
+
+/* Datagrams received, recvmmsg and sendmmsg calls, and the largest batch, of the mmsg engine */
+static unsigned long mmsgMessages, mmsgReceives, mmsgSends;
+static int mmsgMaxBatch = 1;
+
+/*
+ * Receives datagrams in batches with recvmmsg, applies them and sends all
+ * their replies with one sendmmsg. A batch grows while the socket has more
+ * datagrams waiting than the last one took, and shrinks as it drains, so
+ * an idle server still answers each datagram on its own, at once.
+ * Input:
+ *  - arg: the socket, or NULL for the server socket
+ */
+void *engine_receive_batches(void *arg) {
+    struct mmsghdr messages[ENGINE_MMSG_MAX], replies[ENGINE_MMSG_MAX];
+    struct iovec messageVecs[ENGINE_MMSG_MAX], replyVecs[ENGINE_MMSG_MAX];
+    struct sockaddr_un addrs[ENGINE_MMSG_MAX];
+    TfsRequest requests[TFS_MAX_BATCH];
+    int sock = arg ? *(int *) arg : scsocket;
+    int batch = 1;
+    unsigned long zero = 0;
+
+    __atomic_compare_exchange_n(&start_ns, &zero, now_ns(), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    /* binary requests are decoded in place, and hold 4-byte fields: each buffer keeps 8-byte alignment */
+    char (*buffers)[TFS_MAX_BATCH_MESSAGE + 4] = malloc(ENGINE_MMSG_MAX * sizeof(*buffers));
+    char (*replyBuffers)[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] =
+        malloc(ENGINE_MMSG_MAX * sizeof(*replyBuffers));
+    if (!buffers || !replyBuffers) {
+        fprintf(stderr, "Server: error allocating datagram buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (true) {
+        for (int i = 0; i < batch; i++) {
+            messageVecs[i] = (struct iovec) { .iov_base = buffers[i], .iov_len = TFS_MAX_BATCH_MESSAGE };
+            messages[i].msg_hdr = (struct msghdr) {
+                .msg_name = &addrs[i], .msg_namelen = sizeof(addrs[i]), .msg_iov = &messageVecs[i], .msg_iovlen = 1
+            };
+        }
+
+        /* waits for the first datagram only */
+        int count = recvmmsg(sock, messages, batch, MSG_WAITFORONE, NULL);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Server: error receiving messages from clients");
+            exit(EXIT_FAILURE);
+        }
+
+        /* replies to the valid messages, an invalid one is dropped */
+        int replyCount = 0;
+        for (int i = 0; i < count; i++) {
+            char *message = buffers[i];
+            size_t length = messages[i].msg_len, replyLength;
+
+            if (!validLength(message, length)) {
+                continue;
+            }
+            if (tfs_is_binary(message, length)) {
+                int n = decodeBinary(message, length, requests);
+                if (n == FAIL) {
+                    continue;
+                }
+                replyLength = applyDecoded(message, requests, n, replyBuffers[i]);
+            } else {
+                message[length] = '\0';
+                int opReturn = applyCommand(message);
+                memcpy(replyBuffers[i], &opReturn, sizeof(opReturn));
+                replyLength = sizeof(opReturn);
+            }
+            replyVecs[replyCount] = (struct iovec) { .iov_base = replyBuffers[i], .iov_len = replyLength };
+            replies[replyCount].msg_hdr = (struct msghdr) {
+                .msg_name = &addrs[i], .msg_namelen = messages[i].msg_hdr.msg_namelen,
+                .msg_iov = &replyVecs[replyCount], .msg_iovlen = 1
+            };
+            replyCount++;
+        }
+
+        for (int sent = 0; sent < replyCount;) {
+            int n = sendmmsg(sock, replies + sent, replyCount - sent, 0);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Server: error sending operation returns to clients");
+                exit(EXIT_FAILURE);
+            }
+            sent += n;
+            __atomic_add_fetch(&mmsgSends, 1, __ATOMIC_RELAXED);
+        }
+
+        __atomic_add_fetch(&mmsgMessages, count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mmsgReceives, 1, __ATOMIC_RELAXED);
+        if (count == batch && batch < ENGINE_MMSG_MAX) {
+            batch *= 2;
+            int max = __atomic_load_n(&mmsgMaxBatch, __ATOMIC_RELAXED);
+            while (batch > max &&
+                   !__atomic_compare_exchange_n(&mmsgMaxBatch, &max, batch, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+        } else if (count < batch / 2) {
+            batch /= 2;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Runs the requests through an engine, with numberThreads filesystem
+ * workers. Never returns.
+ * Input:
+ *  - engine: ENGINE_EPOLL, or ENGINE_URING, which falls back to epoll
+ *    if the kernel lacks io_uring
+ *  - count: number of I/O threads
+ *  - partitions: whether each worker owns a partition of the tree
+ */
+void engine_run(int engine, int count, bool partitions) {
+    pthread_t tid;
+
+    start_ns = now_ns();
+    workerCount = numberThreads;
+    ioCount = count;
+    workers = calloc(workerCount, sizeof(WorkerQueue));
+    ioThreads = calloc(ioCount, sizeof(IoThread));
+    if (!workers || !ioThreads) {
+        fprintf(stderr, "Server: error allocating threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* sessions are accepted until none is left waiting */
+    if (fcntl(sessionSocket, F_SETFL, fcntl(sessionSocket, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("Server: error setting up session socket");
+        exit(EXIT_FAILURE);
+    }
+
+    partitioned = partitions;
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&workers[i].mutex, NULL);
+        pthread_cond_init(&workers[i].ready, NULL);
+        if (partitioned && (!(workers[i].stub = calloc(1, sizeof(Job))) ||
+                            !(workers[i].reach = calloc(workerCount, 1)))) {
+            fprintf(stderr, "Server: error allocating mailboxes\n");
+            exit(EXIT_FAILURE);
+        }
+        workers[i].first = workers[i].last = workers[i].stub;
+        workers[i].parked = 1;
+    }
+    /* an owner may reach into any partition as soon as it starts */
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_create(&tid, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "Thread %d failed to create\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; engine == ENGINE_URING && i < ioCount; i++) {
+        if (uringSetup(&ioThreads[i]) == FAIL) {
+            fprintf(stderr, "Server: io_uring unavailable (%s), using epoll\n", strerror(errno));
+            while (--i >= 0) {
+                close(ioThreads[i].ring.fd);
+            }
+            engine = ENGINE_EPOLL;
+        }
+    }
+    if (engine == ENGINE_URING) {
+        ioName = "io_uring";
+    }
+
+    for (int i = 0; i < ioCount; i++) {
+        IoThread *io = &ioThreads[i];
+        pthread_mutex_init(&io->mutex, NULL);
+        io->next = i;
+        /* io_uring waits on the eventfd for itself */
+        if ((io->wakefd = eventfd(0, engine == ENGINE_EPOLL ? EFD_NONBLOCK : 0)) == -1) {
+            perror("Server: error creating event loop");
+            exit(EXIT_FAILURE);
+        }
+        if (engine == ENGINE_URING) {
+            continue;
+        }
+        if ((io->epfd = epoll_create1(0)) == -1) {
+            perror("Server: error creating event loop");
+            exit(EXIT_FAILURE);
+        }
+        /* only one of the I/O threads is woken for each message */
+        watch(io->epfd, scsocket, EPOLLIN | EPOLLEXCLUSIVE, &dgramTag);
+        watch(io->epfd, sessionSocket, EPOLLIN | EPOLLEXCLUSIVE, &listenTag);
+        watch(io->epfd, io->wakefd, EPOLLIN, &wakeTag);
+    }
+    for (int i = 0; i < ioCount; i++) {
+        if (pthread_create(&tid, NULL, engine == ENGINE_URING ? uringLoop : ioLoop, &ioThreads[i]) != 0) {
+            fprintf(stderr, "I/O thread %d failed to create\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pthread_join(tid, NULL) != 0) {
+        fprintf(stderr, "Thread failed to join!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Prints the throughput of the server since it started, and the CPU it
+ * took per message.
+ */
+static void printCpu(FILE *fp, unsigned long messages) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    fprintf(fp, "engine: %.0f messages/s, %.2f us of CPU per message\n", messages / elapsed,
+            messages ? cpu * 1e6 / messages : 0.0);
+}
+
+/*
+ * Prints how busy each tier of the engine was.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void engine_print_stats(FILE *fp) {
+    unsigned long receives = __atomic_load_n(&mmsgReceives, __ATOMIC_RELAXED);
+    if (receives) {
+        unsigned long messages = __atomic_load_n(&mmsgMessages, __ATOMIC_RELAXED);
+        fprintf(fp, "engine: %lu datagrams in %lu receives and %lu sends, %.1f per receive, batches up to %d\n",
+                messages, receives, __atomic_load_n(&mmsgSends, __ATOMIC_RELAXED), (double) messages / receives,
+                __atomic_load_n(&mmsgMaxBatch, __ATOMIC_RELAXED));
+        printCpu(fp, messages);
+    }
+    if (!ioThreads) {
+        return;
+    }
+    double elapsed = now_ns() - start_ns;
+    unsigned long busy = 0, messages = 0, wakeups = 0, jobs = 0;
+    int maxLength = 0;
+
+    for (int i = 0; i < ioCount; i++) {
+        busy += __atomic_load_n(&ioThreads[i].busy_ns, __ATOMIC_RELAXED);
+        messages += __atomic_load_n(&ioThreads[i].messages, __ATOMIC_RELAXED);
+        wakeups += __atomic_load_n(&ioThreads[i].wakeups, __ATOMIC_RELAXED);
+    }
+    fprintf(fp, "engine: %d %s I/O threads, %.1f%% busy, %lu messages, %.1f per wakeup\n",
+            ioCount, ioName, 100.0 * busy / (elapsed * ioCount), messages, wakeups ? (double) messages / wakeups : 0.0);
+
+    busy = 0;
+    unsigned long busiest = 0;
+    for (int i = 0; i < workerCount; i++) {
+        unsigned long n = __atomic_load_n(&workers[i].jobs, __ATOMIC_RELAXED);
+        busy += __atomic_load_n(&workers[i].busy_ns, __ATOMIC_RELAXED);
+        jobs += n;
+        busiest = n > busiest ? n : busiest;
+        if (workers[i].maxLength > maxLength) {
+            maxLength = workers[i].maxLength;
+        }
+    }
+    fprintf(fp, "engine: %d workers, %.1f%% busy, %lu messages, queues up to %d long\n",
+            workerCount, 100.0 * busy / (elapsed * workerCount), jobs, maxLength);
+    if (partitioned) {
+        fprintf(fp, "engine: %d partitions, the busiest with %.1f%% of the messages, %lu reaching across them\n",
+                workerCount, jobs ? 100.0 * busiest / jobs : 0.0, __atomic_load_n(&crossJobs, __ATOMIC_RELAXED));
+    }
+    printCpu(fp, messages);
+}
@@ -0,0 +1,60 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+#include "tecnicofs-server.h"
+
+/* How requests get from the sockets to the filesystem */
+#define ENGINE_THREADS 0   /* each worker receives, applies and replies on its own */
+#define ENGINE_EPOLL 1     /* I/O threads receive and reply, workers only apply */
+#define ENGINE_MMSG 2      /* each worker receives, applies and replies to many datagrams at once */
+#define ENGINE_URING 3     /* as epoll, with the I/O threads on io_uring */
+
+/* I/O threads, unless told otherwise */
+#define ENGINE_IO_THREADS 1
+/* Events an I/O thread takes from epoll at once */
+#define ENGINE_EVENTS 64
+/* Messages an I/O thread reads from one socket per event, so that no socket starves the others */
+#define ENGINE_RECV_BUDGET 32
+/* Most datagrams a worker takes per recvmmsg */
+#define ENGINE_MMSG_MAX 32
+/* Submission queue entries and receive buffers of each io_uring */
+#define ENGINE_URING_ENTRIES 256
+#define ENGINE_URING_BUFFERS 64
+/* Wait before retrying the datagram replies to clients whose queues were full */
+#define ENGINE_URING_RETRY_US 200
+
+/*
+ * A received message on its way from an I/O thread to a worker, and back
+ * with its reply. Its requests are decoded in place, so they point into
+ * the message, which follows them.
+ */
+typedef struct job {
+    struct job *next;
+    int source;                  /* I/O thread that received it, and replies */
+    Session *session;            /* it came from, or NULL for a datagram */
+    struct sockaddr_un addr;     /* of a datagram's sender */
+    socklen_t addrLen;
+    bool binary;
+    int count;                   /* of requests */
+    size_t length;               /* of the message */
+    size_t replyLength;
+    struct msghdr replyHdr;      /* of its reply, while io_uring sends it */
+    struct iovec replyVec;
+    char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+    char name[MAX_INPUT_SIZE], arg[MAX_INPUT_SIZE];   /* tokens of a text command */
+    TfsRequest requests[];
+} Job;
+
+int engine_parse(const char *name);
+void engine_run(int engine, int ioThreads, bool partitions);
+void *engine_receive_batches(void *arg);
+void engine_print_stats(FILE *fp);
+
+#endif /* ENGINE_H */
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "brlock.h"
+
+static int next_slot = 0;
+static __thread int thread_slot = -1;
+
+/*
+ * Returns the reader indicator of the calling thread.
+ */
+static inline int *brlock_slot(brlock *lock) {
+    if (thread_slot == -1) {
+        thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % BRLOCK_SLOTS;
+    }
+    return &lock->slots[thread_slot].readers;
+}
+
+/*
+ * Creates an unlocked big-reader lock.
+ * Returns: the new lock
+ */
+brlock *brlock_create() {
+    brlock *lock;
+    if (posix_memalign((void **) &lock, 64, sizeof(brlock))) {
+        fprintf(stderr, "Error allocating big-reader lock!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < BRLOCK_SLOTS; i++) {
+        lock->slots[i].readers = 0;
+    }
+    lock->writer = 0;
+    lock->owner = (pthread_t) 0;
+    if (pthread_mutex_init(&lock->writerMutex, NULL)) {
+        fprintf(stderr, "Error initializing big-reader lock mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+    return lock;
+}
+
+/*
+ * Releases the memory of an unlocked big-reader lock.
+ */
+void brlock_destroy(brlock *lock) {
+    if (lock) {
+        pthread_mutex_destroy(&lock->writerMutex);
+        free(lock);
+    }
+}
+
+/*
+ * Tries to lock for reading, failing if a writer holds or waits for the lock.
+ * Returns: true if locked
+ */
+bool brlock_try_read_lock(brlock *lock) {
+    int *readers = brlock_slot(lock);
+    __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST)) {
+        return true;
+    }
+    __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+    return false;
+}
+
+/*
+ * Locks for reading.
+ */
+void brlock_read_lock(brlock *lock) {
+    while (!brlock_try_read_lock(lock)) {
+        /* sleep until the writer is done */
+        if (pthread_mutex_lock(&lock->writerMutex) || pthread_mutex_unlock(&lock->writerMutex)) {
+            fprintf(stderr, "Error waiting on big-reader lock!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Waits until no reader indicator is set.
+ */
+static void brlock_drain(brlock *lock) {
+    for (int i = 0; i < BRLOCK_SLOTS; i++) {
+        while (__atomic_load_n(&lock->slots[i].readers, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Locks for writing.
+ */
+void brlock_write_lock(brlock *lock) {
+    if (pthread_mutex_lock(&lock->writerMutex)) {
+        fprintf(stderr, "Error locking big-reader lock!\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&lock->writer, 1, __ATOMIC_SEQ_CST);
+    brlock_drain(lock);
+    __atomic_store_n(&lock->owner, pthread_self(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Tries to lock for writing, failing if any reader or writer holds the lock.
+ * Returns: true if locked
+ */
+bool brlock_try_write_lock(brlock *lock) {
+    if (pthread_mutex_trylock(&lock->writerMutex)) {
+        return false;
+    }
+    __atomic_store_n(&lock->writer, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < BRLOCK_SLOTS; i++) {
+        if (__atomic_load_n(&lock->slots[i].readers, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&lock->writerMutex);
+            return false;
+        }
+    }
+    __atomic_store_n(&lock->owner, pthread_self(), __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ * Unlocks a lock held by the calling thread, for reading or writing.
+ */
+void brlock_unlock(brlock *lock) {
+    /* only the writer itself can see its own id as the owner */
+    if (pthread_equal(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED), pthread_self())) {
+        __atomic_store_n(&lock->owner, (pthread_t) 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+        if (pthread_mutex_unlock(&lock->writerMutex)) {
+            fprintf(stderr, "Error unlocking big-reader lock!\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    __atomic_sub_fetch(brlock_slot(lock), 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,33 @@
+#ifndef BRLOCK_H
+#define BRLOCK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Reader indicators of a big-reader lock; threads beyond this share them */
+#define BRLOCK_SLOTS 64
+
+/*
+ * Big-reader lock: each reader only touches its own thread's indicator,
+ * on its own cache line, so read-mostly locks stop bouncing one counter
+ * between cores. Writers announce themselves and wait for every
+ * indicator to drain.
+ */
+typedef struct brlock {
+	struct {
+		int readers;
+	} __attribute__((aligned(64))) slots[BRLOCK_SLOTS];
+	int writer;                   /* set while a writer holds or waits for the lock */
+	pthread_t owner;              /* the writer, while held for writing */
+	pthread_mutex_t writerMutex;  /* serializes writers, and blocks readers behind them */
+} brlock;
+
+brlock *brlock_create();
+void brlock_destroy(brlock *lock);
+void brlock_read_lock(brlock *lock);
+void brlock_write_lock(brlock *lock);
+bool brlock_try_read_lock(brlock *lock);
+bool brlock_try_write_lock(brlock *lock);
+void brlock_unlock(brlock *lock);
+
+#endif /* BRLOCK_H */
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "checkpoint.h"
+#include "image.h"
+#include "state.h"
+#include "wal.h"
+
+/*
+ * Incremental checkpoints of the image. Every i-node changed since the
+ * latest checkpoint is on the dirty list of the current epoch (see
+ * inode_mark_dirty). A checkpoint takes a snapshot, swapping the list for
+ * an empty one while no operation runs, and writes only those i-nodes to
+ * a new delta of the image, so its cost follows the changes and not the
+ * size of the namespace. Once CHECKPOINT_MERGE_DELTAS deltas pile up,
+ * they are merged into a new image, from the files alone. The log is cut
+ * after every checkpoint.
+ */
+
+static char *image_path = NULL;
+static uint64_t base_id = 0;       /* of the image deltas apply to, 0 if there is none */
+static int deltas = 0;             /* written since the image */
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_stop = PTHREAD_COND_INITIALIZER;
+static bool stopping = false;
+static bool running = false;
+static int interval_ms = 0;
+static pthread_t checkpointer;
+static unsigned long stat_checkpoints = 0, stat_inodes = 0, stat_bytes = 0, stat_merges = 0;
+
+typedef struct dirtyList {
+    int *inumbers;
+    int count;
+} DirtyList;
+
+/*
+ * Takes the dirty list, at the snapshot gate.
+ */
+static void checkpoint_take_dirty(void *arg) {
+    DirtyList *list = arg;
+    list->inumbers = inode_dirty_swap(&list->count);
+}
+
+/*
+ * Writes a full image at the image path, dropping its deltas.
+ * The caller must hold checkpoint_mutex.
+ * Returns: SUCCESS or FAIL
+ */
+static int checkpoint_write_base() {
+    DirtyList list;
+    unsigned int gen = snapshot_begin_with(checkpoint_take_dirty, &list);
+    uint64_t lsn = snapshot_last_lsn(), id;
+    int res = image_write_base(image_path, gen, lsn, &id);
+    snapshot_end();
+    inode_dirty_done();
+    free(list.inumbers);
+    if (res == FAIL) {
+        return FAIL;
+    }
+
+    base_id = id;
+    image_remove_deltas(image_path, 1);
+    deltas = 0;
+    wal_truncate(lsn);
+    return SUCCESS;
+}
+
+/*
+ * Background checkpoints, every interval_ms.
+ */
+static void *checkpoint_loop(void *arg) {
+    pthread_mutex_lock(&checkpoint_mutex);
+    while (!stopping) {
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        long usec = now.tv_usec + (long) interval_ms * 1000;
+        deadline.tv_sec = now.tv_sec + usec / 1000000;
+        deadline.tv_nsec = (usec % 1000000) * 1000;
+
+        while (!stopping) {
+            if (pthread_cond_timedwait(&checkpoint_stop, &checkpoint_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&checkpoint_mutex);
+        if (checkpoint_run() == FAIL) {
+            fprintf(stderr, "Error: checkpoint of %s failed\n", image_path);
+        }
+        pthread_mutex_lock(&checkpoint_mutex);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return NULL;
+}
+
+/*
+ * Starts checkpointing the namespace, once it was loaded from the image
+ * at path, if any, and its log replayed.
+ * Input:
+ *  - path: the image file, or NULL to not checkpoint
+ *  - intervalMs: time between background checkpoints, or 0 for none
+ */
+void checkpoint_init(const char *path, int intervalMs) {
+    if (!path) {
+        return;
+    }
+    image_path = strdup(path);
+    if (!image_path) {
+        fprintf(stderr, "Error allocating checkpoint!\n");
+        exit(EXIT_FAILURE);
+    }
+    base_id = image_id();
+    deltas = image_delta_count();
+    /* left over from an older image */
+    image_remove_deltas(image_path, deltas + 1);
+
+    interval_ms = intervalMs;
+    stopping = false;
+    if (intervalMs > 0) {
+        /* signals are left to the threads of the server */
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        if (pthread_create(&checkpointer, NULL, checkpoint_loop, NULL)) {
+            fprintf(stderr, "Checkpoint thread failed to create\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        running = true;
+    }
+}
+
+/*
+ * Stops the background checkpoints.
+ */
+void checkpoint_destroy() {
+    if (running) {
+        pthread_mutex_lock(&checkpoint_mutex);
+        stopping = true;
+        pthread_cond_signal(&checkpoint_stop);
+        pthread_mutex_unlock(&checkpoint_mutex);
+        pthread_join(checkpointer, NULL);
+        running = false;
+    }
+    free(image_path);
+    image_path = NULL;
+}
+
+/*
+ * Writes the i-nodes changed since the latest checkpoint to a new delta of
+ * the image, or the whole namespace if there is no image yet, and merges
+ * the deltas into the image once there are enough of them.
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_run() {
+    if (!image_path) {
+        return FAIL;
+    }
+    pthread_mutex_lock(&checkpoint_mutex);
+    int res = SUCCESS;
+    if (base_id == 0) {
+        res = checkpoint_write_base();
+        pthread_mutex_unlock(&checkpoint_mutex);
+        return res;
+    }
+
+    DirtyList list;
+    size_t bytes = 0;
+    unsigned int gen = snapshot_begin_with(checkpoint_take_dirty, &list);
+    uint64_t lsn = snapshot_last_lsn();
+    if (list.count > 0) {
+        res = image_write_delta(image_path, deltas + 1, base_id, gen, lsn, list.inumbers, list.count, &bytes);
+    }
+    snapshot_end();
+    inode_dirty_done();
+
+    if (list.count > 0 && res == SUCCESS) {
+        deltas++;
+        stat_checkpoints++;
+        stat_inodes += list.count;
+        stat_bytes += bytes;
+        wal_truncate(lsn);
+
+        if (deltas >= CHECKPOINT_MERGE_DELTAS) {
+            uint64_t id;
+            if ((res = image_merge(image_path, &id)) == SUCCESS) {
+                base_id = id;
+                deltas = 0;
+                stat_merges++;
+            }
+        }
+    }
+    free(list.inumbers);
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return res;
+}
+
+/*
+ * Saves a full image of the namespace. Saving at the image path replaces
+ * the image and its deltas.
+ * Input:
+ *  - path: the image file
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_save(const char *path) {
+    if (!image_path || strcmp(path, image_path)) {
+        return image_write(path);
+    }
+    pthread_mutex_lock(&checkpoint_mutex);
+    int res = checkpoint_write_base();
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return res;
+}
+
+/*
+ * Prints checkpoint statistics.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void checkpoint_print_stats(FILE *fp) {
+    if (!image_path) {
+        return;
+    }
+    pthread_mutex_lock(&checkpoint_mutex);
+    fprintf(fp, "checkpoints: %lu deltas, %lu i-nodes, %lu bytes, %lu merges, %d deltas pending\n",
+            stat_checkpoints, stat_inodes, stat_bytes, stat_merges, deltas);
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
@@ -0,0 +1,15 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+
+/* Deltas an image collects before they are merged into it */
+#define CHECKPOINT_MERGE_DELTAS 8
+
+void checkpoint_init(const char *path, int intervalMs);
+void checkpoint_destroy();
+int checkpoint_run();
+int checkpoint_save(const char *path);
+void checkpoint_print_stats(FILE *fp);
+
+#endif /* CHECKPOINT_H */
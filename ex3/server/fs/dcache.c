@@ -0,0 +1,120 @@
+#include <string.h>
+#include <stdlib.h>
+#include "state.h"
+#include "dcache.h"
+
+/*
+ * A cached (parent, name) -> child mapping. An entry is only valid while
+ * the parent's generation is the one recorded when it was inserted: the
+ * generation changes whenever an entry is removed from the parent, or the
+ * parent itself is deleted.
+ * Each entry is guarded by a sequence counter, odd while it is being written.
+ */
+typedef struct dcache_entry {
+    unsigned int seq;
+    int parent;
+    unsigned int parentGeneration;
+    uint32_t hash;
+    int child;
+    uint8_t length;
+    char name[DCACHE_NAME_MAX];
+} __attribute__((aligned(64))) dcache_entry;
+
+static dcache_entry *dcache;
+
+/*
+ * Returns the cache slot of a (parent, name hash) pair.
+ */
+static inline dcache_entry *dcache_slot(int parent, uint32_t hash) {
+    uint32_t key = hash ^ ((uint32_t) parent * 2654435761u);
+    key ^= key >> 16;
+    return &dcache[key & (DCACHE_SIZE - 1)];
+}
+
+/*
+ * Initializes the (empty) dentry cache.
+ */
+void dcache_init() {
+    if (!dcache) {
+        if (posix_memalign((void **) &dcache, 64, sizeof(dcache_entry) * DCACHE_SIZE)) {
+            fprintf(stderr, "Error allocating dentry cache!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dcache[i].seq = 0;
+        dcache[i].parent = FREE_INODE;
+    }
+}
+
+/*
+ * Looks for a child in the dentry cache. No locks are needed.
+ * Input:
+ *  - parent: inumber of the parent directory
+ *  - name: the child name
+ *  - length: the name length
+ *  - hash: the name hash
+ * Returns:
+ *  - inumber: the child's inumber, valid as of the parent's current generation
+ *  - FAIL: on a miss
+ */
+int dcache_lookup(int parent, const char *name, int length, uint32_t hash) {
+    if (length > DCACHE_NAME_MAX) {
+        return FAIL;
+    }
+    dcache_entry *entry = dcache_slot(parent, hash);
+
+    unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return FAIL;
+    }
+    int cachedParent = __atomic_load_n(&entry->parent, __ATOMIC_RELAXED);
+    unsigned int generation = __atomic_load_n(&entry->parentGeneration, __ATOMIC_RELAXED);
+    int child = __atomic_load_n(&entry->child, __ATOMIC_RELAXED);
+    bool matches = cachedParent == parent && __atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash &&
+                   __atomic_load_n(&entry->length, __ATOMIC_RELAXED) == length &&
+                   memcmp(entry->name, name, length) == 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!matches || __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+        return FAIL;
+    }
+
+    /* removals bump the generation before changing the directory */
+    if (generation != __atomic_load_n(&inode_at(parent)->generation, __ATOMIC_ACQUIRE)) {
+        return FAIL;
+    }
+    return child;
+}
+
+/*
+ * Caches a child of a directory. parentGeneration must have been read before
+ * the parent's directory was searched: if the directory changed since, the
+ * entry is already stale and will never be hit. Concurrent writers of the
+ * same slot skip the insertion.
+ * Input:
+ *  - parent: inumber of the parent directory
+ *  - parentGeneration: the parent's generation
+ *  - name: the child name
+ *  - length: the name length
+ *  - hash: the name hash
+ *  - child: the child's inumber
+ */
+void dcache_insert(int parent, unsigned int parentGeneration, const char *name, int length, uint32_t hash, int child) {
+    if (length > DCACHE_NAME_MAX) {
+        return;
+    }
+    dcache_entry *entry = dcache_slot(parent, hash);
+
+    unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->parent, parent, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->parentGeneration, parentGeneration, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->child, child, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->length, (uint8_t) length, __ATOMIC_RELAXED);
+    memcpy(entry->name, name, length);
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,15 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+
+/* Entries of the dentry cache (power of two) */
+#define DCACHE_SIZE (1 << 16)
+/* Longer names are not cached */
+#define DCACHE_NAME_MAX 39
+
+void dcache_init();
+int dcache_lookup(int parent, const char *name, int length, uint32_t hash);
+void dcache_insert(int parent, unsigned int parentGeneration, const char *name, int length, uint32_t hash, int child);
+
+#endif /* DCACHE_H */
@@ -0,0 +1,448 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "state.h"
+#include "slab.h"
+#include "epoch.h"
+
+/*
+ * Hashes an entry name (32-bit FNV-1a).
+ * Input:
+ *  - name: the entry name
+ * Returns: the name hash
+ */
+uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) name; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Allocates an empty table.
+ * Input:
+ *  - capacity: entry slots
+ *  - arenaSize: bytes of name arena
+ */
+static DirTable *dir_table_create(int capacity, int arenaSize) {
+    DirTable *table = slab_alloc(sizeof(DirTable));
+    table->used = 0;
+    table->capacity = capacity;
+    table->arenaUsed = 0;
+    table->arenaSize = arenaSize;
+    table->entries = slab_alloc(sizeof(DirEntry) * capacity);
+    table->arena = arenaSize ? slab_alloc(arenaSize) : NULL;
+    table->index = NULL;
+    table->indexSize = 0;
+    table->mapped = false;
+
+    if (capacity > DIR_COMPACT_ENTRIES) {
+        table->indexSize = 2 * capacity;
+        table->index = slab_alloc(sizeof(int) * table->indexSize);
+        for (int i = 0; i < table->indexSize; i++) {
+            table->index[i] = DIR_INDEX_EMPTY;
+        }
+    }
+    return table;
+}
+
+/*
+ * Releases the memory of a table.
+ */
+static void dir_table_destroy(DirTable *table) {
+    if (!table->mapped) {
+        slab_free(table->entries, sizeof(DirEntry) * table->capacity);
+        slab_free(table->index, sizeof(int) * table->indexSize);
+        slab_free(table->arena, table->arenaSize);
+    }
+    slab_free(table, sizeof(DirTable));
+}
+
+/*
+ * epoch_defer() callbacks.
+ */
+static void dir_table_free(void *ptr, size_t size) {
+    dir_table_destroy(ptr);
+}
+
+static void dir_free(void *ptr, size_t size) {
+    dir_destroy(ptr);
+}
+
+/*
+ * Creates an empty (compact) directory.
+ * Returns: the new directory
+ */
+Directory *dir_create() {
+    Directory *dir = slab_alloc(sizeof(Directory));
+    dir->count = 0;
+    dir->table = dir_table_create(DIR_INITIAL_ENTRIES, 0);
+    return dir;
+}
+
+/*
+ * Releases the memory of a directory no other thread can reach.
+ * Input:
+ *  - dir: the directory
+ */
+void dir_destroy(Directory *dir) {
+    if (dir) {
+        dir_table_destroy(dir->table);
+        slab_free(dir, sizeof(Directory));
+    }
+}
+
+/*
+ * Releases the memory of a directory once lock-free readers are done with it.
+ * Input:
+ *  - dir: the directory
+ */
+void dir_destroy_deferred(Directory *dir) {
+    epoch_defer(dir_free, dir, sizeof(Directory));
+}
+
+/*
+ * Checks if an entry holds the given name.
+ */
+static inline bool dir_entry_matches(DirTable *table, DirEntry *entry, const char *name, int length, uint32_t hash) {
+    return entry->hash == hash && entry->length == length &&
+           memcmp(dir_entry_name(table, entry), name, length) == 0;
+}
+
+/*
+ * Finds the index slot of a name, or the slot where it should be inserted.
+ * Input:
+ *  - table: an indexed table
+ *  - name: the entry name
+ *  - length: the name length
+ *  - hash: the name hash
+ *  - insert: if true, returns the first reusable slot when name is not found
+ * Returns: the index slot
+ */
+static int dir_index_probe(DirTable *table, const char *name, int length, uint32_t hash, bool insert) {
+    int mask = table->indexSize - 1, reusable = -1;
+    for (int i = hash & mask; ; i = (i + 1) & mask) {
+        int slot = __atomic_load_n(&table->index[i], __ATOMIC_ACQUIRE);
+        if (slot == DIR_INDEX_EMPTY) {
+            return (insert && reusable != -1) ? reusable : i;
+        }
+        if (slot == DIR_INDEX_DELETED) {
+            if (reusable == -1) {
+                reusable = i;
+            }
+        } else if (dir_entry_inumber(&table->entries[slot]) != FREE_INODE &&
+                   dir_entry_matches(table, &table->entries[slot], name, length, hash)) {
+            return i;
+        }
+    }
+}
+
+/*
+ * Finds the entry slot of a name.
+ * Input:
+ *  - table: the table
+ *  - name: the entry name
+ *  - length: the name length
+ *  - hash: the name hash
+ *  - pos: if not NULL, stores the index slot pointing to the entry
+ * Returns: the entry slot, or FAIL if not found
+ */
+static int dir_find(DirTable *table, const char *name, int length, uint32_t hash, int *pos) {
+    if (table->index) {
+        int i = dir_index_probe(table, name, length, hash, false);
+        int slot = __atomic_load_n(&table->index[i], __ATOMIC_ACQUIRE);
+        if (pos) {
+            *pos = i;
+        }
+        return slot >= 0 ? slot : FAIL;
+    }
+    int used = __atomic_load_n(&table->used, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < used; i++) {
+        if (dir_entry_inumber(&table->entries[i]) != FREE_INODE &&
+            dir_entry_matches(table, &table->entries[i], name, length, hash)) {
+            return i;
+        }
+    }
+    return FAIL;
+}
+
+/*
+ * Replaces the table of a directory with a rebuilt one, without freed slots
+ * and their arena names. The old table is freed once readers are done.
+ * Input:
+ *  - dir: the directory
+ *  - capacity: the new number of entry slots
+ *  - arenaNeeded: free arena bytes the new table must have
+ */
+static void dir_rebuild(Directory *dir, int capacity, int arenaNeeded) {
+    DirTable *old = dir->table;
+
+    int arenaLive = 0;
+    for (int i = 0; i < old->used; i++) {
+        if (old->entries[i].inumber != FREE_INODE && old->entries[i].length > DIR_INLINE_NAME) {
+            arenaLive += old->entries[i].length + 1;
+        }
+    }
+    int arenaSize = 0;
+    if (arenaLive + arenaNeeded > 0) {
+        /* leave room to grow, so that long names do not rebuild the table every time */
+        for (arenaSize = DIR_INITIAL_ARENA; arenaSize < 2 * (arenaLive + arenaNeeded); arenaSize *= 2) {}
+    }
+
+    DirTable *table = dir_table_create(capacity, arenaSize);
+    int used = 0;
+    for (int i = 0; i < old->used; i++) {
+        DirEntry *entry = &old->entries[i];
+        if (entry->inumber == FREE_INODE) {
+            continue;
+        }
+        table->entries[used] = *entry;
+        if (entry->length > DIR_INLINE_NAME) {
+            memcpy(table->arena + table->arenaUsed, old->arena + entry->name.offset, entry->length + 1);
+            table->entries[used].name.offset = table->arenaUsed;
+            table->arenaUsed += entry->length + 1;
+        }
+        used++;
+    }
+    table->used = used;
+
+    if (table->index) {
+        /* names are unique, so each entry goes to the first free slot of its probe */
+        int mask = table->indexSize - 1;
+        for (int i = 0; i < used; i++) {
+            int j = table->entries[i].hash & mask;
+            while (table->index[j] != DIR_INDEX_EMPTY) {
+                j = (j + 1) & mask;
+            }
+            table->index[j] = i;
+        }
+    }
+
+    __atomic_store_n(&dir->table, table, __ATOMIC_RELEASE);
+    epoch_defer(dir_table_free, old, sizeof(DirTable));
+}
+
+/*
+ * Looks for an entry in a directory, given the name's length and hash.
+ * Safe without locks inside an epoch read section.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ *  - length: the name length
+ *  - hash: the name hash
+ * Returns:
+ *  - inumber: the entry's inumber
+ *  - FAIL: if not found
+ */
+int dir_lookup_hashed(Directory *dir, const char *name, int length, uint32_t hash) {
+    DirTable *table = dir_table(dir);
+    int slot = dir_find(table, name, length, hash, NULL);
+    if (slot == FAIL) {
+        return FAIL;
+    }
+    int inumber = dir_entry_inumber(&table->entries[slot]);
+    return inumber != FREE_INODE ? inumber : FAIL;
+}
+
+/*
+ * Looks for an entry in a directory.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ * Returns:
+ *  - inumber: the entry's inumber
+ *  - FAIL: if not found
+ */
+int dir_lookup(Directory *dir, const char *name) {
+    return dir_lookup_hashed(dir, name, strlen(name), name_hash(name));
+}
+
+/*
+ * Adds an entry to a directory, growing it if needed.
+ * The caller must hold the directory's write lock and check that the name
+ * is not in the directory.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ *  - inumber: the entry's inumber
+ * Returns: SUCCESS or FAIL
+ */
+int dir_insert(Directory *dir, const char *name, int inumber) {
+    int length = strlen(name);
+    uint32_t hash = name_hash(name);
+    if (length >= MAX_FILE_NAME) {
+        return FAIL;
+    }
+
+    DirTable *table = dir->table;
+    int arenaNeeded = length > DIR_INLINE_NAME ? length + 1 : 0;
+    if (table->used == table->capacity || table->arenaUsed + arenaNeeded > table->arenaSize) {
+        /* double when more than half the slots are live, otherwise just drop freed slots */
+        int capacity = dir->count >= table->capacity / 2 ? 2 * table->capacity : table->capacity;
+        dir_rebuild(dir, capacity, arenaNeeded);
+        table = dir->table;
+    }
+
+    int slot = table->used;
+    DirEntry *entry = &table->entries[slot];
+    entry->hash = hash;
+    entry->inumber = inumber;
+    entry->length = length;
+    if (length > DIR_INLINE_NAME) {
+        entry->name.offset = table->arenaUsed;
+        memcpy(table->arena + table->arenaUsed, name, length + 1);
+        table->arenaUsed += length + 1;
+    } else {
+        memcpy(entry->name.inlined, name, length + 1);
+    }
+
+    /* publish the entry, now that it is fully written */
+    if (table->index) {
+        int pos = dir_index_probe(table, name, length, hash, true);
+        __atomic_store_n(&table->used, slot + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&table->index[pos], slot, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&table->used, slot + 1, __ATOMIC_RELEASE);
+    }
+    dir->count++;
+    return SUCCESS;
+}
+
+/*
+ * Removes an entry from a directory.
+ * The caller must hold the directory's write lock.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ *  - inumber: the entry's expected inumber
+ * Returns: SUCCESS or FAIL
+ */
+int dir_remove(Directory *dir, const char *name, int inumber) {
+    DirTable *table = dir->table;
+    int pos;
+    int slot = dir_find(table, name, strlen(name), name_hash(name), &pos);
+
+    if (slot == FAIL || table->entries[slot].inumber != inumber) {
+        return FAIL;
+    }
+    __atomic_store_n(&table->entries[slot].inumber, FREE_INODE, __ATOMIC_RELEASE);
+    if (table->index) {
+        __atomic_store_n(&table->index[pos], DIR_INDEX_DELETED, __ATOMIC_RELEASE);
+    }
+    dir->count--;
+    return SUCCESS;
+}
+
+/*
+ * Returns the entry slots of a directory's table in an image: a power of
+ * two, like every table grown by dir_insert, so that the index can be probed.
+ * Input:
+ *  - count: live entries of the directory
+ */
+int dir_image_capacity(int count) {
+    int capacity = DIR_INITIAL_ENTRIES;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/*
+ * Returns the bytes a table takes in an image: its entries, then its
+ * index, if it has one, then its arena, each 8-byte aligned.
+ * Input:
+ *  - capacity: entry slots, from dir_image_capacity
+ *  - arenaSize: bytes of long names
+ */
+size_t dir_image_size(int capacity, int arenaSize) {
+    size_t size = (sizeof(DirEntry) * capacity + 7) & ~7;
+    if (capacity > DIR_COMPACT_ENTRIES) {
+        size += (sizeof(int) * 2 * capacity + 7) & ~7;
+    }
+    return size + ((arenaSize + 7) & ~7);
+}
+
+/*
+ * Lays out a table in an image, as described by dir_image_size, holding
+ * the entries of a directory's snapshot.
+ * Input:
+ *  - base: start of the table, zeroed
+ *  - capacity: entry slots, from dir_image_capacity
+ *  - arenaSize: bytes of the snapshot's long names
+ *  - node: the directory's snapshot
+ */
+void dir_image_fill(void *base, int capacity, int arenaSize, SnapNode *node) {
+    DirEntry *entries = base;
+    char *next = (char *) base + ((sizeof(DirEntry) * capacity + 7) & ~7);
+    int *index = NULL;
+    int arenaUsed = 0;
+
+    if (capacity > DIR_COMPACT_ENTRIES) {
+        index = (int *) next;
+        next += (sizeof(int) * 2 * capacity + 7) & ~7;
+        for (int i = 0; i < 2 * capacity; i++) {
+            index[i] = DIR_INDEX_EMPTY;
+        }
+    }
+
+    for (int i = 0; i < node->count; i++) {
+        SnapEntry *snap = &node->entries[i];
+        entries[i].hash = snap->hash;
+        entries[i].inumber = snap->inumber;
+        entries[i].length = snap->length;
+        if (snap->length > DIR_INLINE_NAME) {
+            entries[i].name.offset = arenaUsed;
+            memcpy(next + arenaUsed, snap->name, snap->length + 1);
+            arenaUsed += snap->length + 1;
+        } else {
+            memcpy(entries[i].name.inlined, snap->name, snap->length + 1);
+        }
+        if (index) {
+            int mask = 2 * capacity - 1, j = snap->hash & mask;
+            while (index[j] != DIR_INDEX_EMPTY) {
+                j = (j + 1) & mask;
+            }
+            index[j] = i;
+        }
+    }
+}
+
+/*
+ * Creates a directory whose table is laid out in a mapped image, as
+ * described by dir_image_size. The mapping must be private and writable:
+ * changes to the table copy the pages they touch, and a table that runs out
+ * of room is rebuilt in memory as usual.
+ * Input:
+ *  - base: start of the table in the mapping
+ *  - count: live entries, stored in the first slots
+ *  - capacity: entry slots
+ *  - arenaSize: bytes of long names, all in use
+ * Returns: the new directory
+ */
+Directory *dir_map(void *base, int count, int capacity, int arenaSize) {
+    DirTable *table = slab_alloc(sizeof(DirTable));
+    char *next = base;
+
+    table->used = count;
+    table->capacity = capacity;
+    table->arenaUsed = arenaSize;
+    table->arenaSize = arenaSize;
+    table->mapped = true;
+    table->entries = (DirEntry *) next;
+    next += (sizeof(DirEntry) * capacity + 7) & ~7;
+    table->index = NULL;
+    table->indexSize = 0;
+    if (capacity > DIR_COMPACT_ENTRIES) {
+        table->indexSize = 2 * capacity;
+        table->index = (int *) next;
+        next += (sizeof(int) * table->indexSize + 7) & ~7;
+    }
+    table->arena = arenaSize ? next : NULL;
+
+    Directory *dir = slab_alloc(sizeof(Directory));
+    dir->count = count;
+    dir->table = table;
+    return dir;
+}
@@ -0,0 +1,101 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../../tecnicofs-api-constants.h"
+
+/* Slots of a newly created directory */
+#define DIR_INITIAL_ENTRIES 4
+/* Directories up to this many slots have no index and are scanned linearly */
+#define DIR_COMPACT_ENTRIES 8
+
+/* Index slot states, besides the entry slot it points to */
+#define DIR_INDEX_EMPTY -1
+#define DIR_INDEX_DELETED -2
+
+/* Names up to this length are stored inside the entry, longer ones in the name arena */
+#define DIR_INLINE_NAME 11
+/* Initial size of a directory's name arena */
+#define DIR_INITIAL_ARENA 64
+
+typedef struct dirEntry {
+	uint32_t hash;
+	int inumber;
+	uint8_t length;
+	union {
+		char inlined[DIR_INLINE_NAME + 1];
+		uint32_t offset;
+	} name;
+} DirEntry;
+
+/*
+ * Entries are appended in insertion order and freed slots are only reclaimed
+ * when the table is rebuilt. Bigger tables also keep an open-addressing
+ * (linear probing) index on the name hash, sized to at least twice the entry
+ * slots, so that probes stay short.
+ * Long names are NUL terminated strings in the arena, which is compacted
+ * together with the entries.
+ *
+ * Lock-free readers may use a table at any time: an entry is fully written
+ * before it is published (by incrementing used, or storing its slot in the
+ * index), its name never changes, and removing it only clears its inumber.
+ * A table that runs out of slots or arena is replaced by a rebuilt one, and
+ * the old one is freed once no reader can hold it.
+ */
+typedef struct dirTable {
+	int used;        /* entry slots handed out, live or freed */
+	int capacity;    /* entry slots allocated */
+	int indexSize;   /* index slots (power of two), 0 if compact */
+	int arenaUsed;   /* bytes of the arena handed out */
+	int arenaSize;   /* bytes of the arena allocated */
+	bool mapped;     /* entries, index and arena live in a mapped image */
+	DirEntry *entries;
+	int *index;
+	char *arena;
+} DirTable;
+
+typedef struct directory {
+	int count;       /* live entries, only read by lock holders */
+	DirTable *table;
+} Directory;
+
+/*
+ * Returns the name of a directory entry.
+ */
+static inline const char *dir_entry_name(DirTable *table, DirEntry *entry) {
+	return entry->length > DIR_INLINE_NAME ? table->arena + entry->name.offset : entry->name.inlined;
+}
+
+/*
+ * Returns the current table of a directory, for iterating its entries.
+ * Lock-free readers must be in an epoch read section.
+ */
+static inline DirTable *dir_table(Directory *dir) {
+	return __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the inumber of the entry in a slot, FREE_INODE if it was removed.
+ */
+static inline int dir_entry_inumber(DirEntry *entry) {
+	return __atomic_load_n(&entry->inumber, __ATOMIC_ACQUIRE);
+}
+
+struct snapNode;
+
+uint32_t name_hash(const char *name);
+Directory *dir_create();
+void dir_destroy(Directory *dir);
+void dir_destroy_deferred(Directory *dir);
+int dir_lookup(Directory *dir, const char *name);
+int dir_lookup_hashed(Directory *dir, const char *name, int length, uint32_t hash);
+int dir_insert(Directory *dir, const char *name, int inumber);
+int dir_remove(Directory *dir, const char *name, int inumber);
+int dir_image_capacity(int count);
+size_t dir_image_size(int capacity, int arenaSize);
+void dir_image_fill(void *base, int capacity, int arenaSize, struct snapNode *node);
+Directory *dir_map(void *base, int count, int capacity, int arenaSize);
+
+#endif /* DIRECTORY_H */
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "dump.h"
+#include "state.h"
+
+/*
+ * Parallel tree dump. The snapshot is split, in preorder, into tasks: the
+ * top of the tree is expanded level by level into single lines and
+ * subtrees until there are enough tasks for the workers. Workers take
+ * tasks in order and print each one into their own buffer, extending the
+ * path of the parent in place instead of formatting every line. Once all
+ * tasks are printed, their positions in the file follow from their sizes
+ * and each worker writes its own output there with pwrite, so the file
+ * comes out in the same order as a sequential preorder walk.
+ */
+
+typedef struct dumpTask {
+    int inumber;
+    SnapNode *node;     /* the i-node, if already read while splitting */
+    bool lineOnly;      /* children were split into tasks of their own */
+    char *path;
+    int pathLength;
+    int worker;         /* worker that printed the task */
+    size_t offset;      /* of the output in the worker's buffer */
+    size_t length;
+    off_t position;     /* of the output in the file */
+} DumpTask;
+
+typedef struct dumpBuffer {
+    char *data;
+    size_t used;
+    size_t size;
+} DumpBuffer;
+
+typedef struct dumpContext {
+    int fd;
+    unsigned int gen;
+    DumpTask *tasks;
+    int numTasks;
+    int nextTask;
+    int numWorkers;
+    DumpBuffer *buffers;
+    pthread_barrier_t printed;
+    pthread_barrier_t placed;
+    int result;
+} DumpContext;
+
+typedef struct dumpWorker {
+    DumpContext *ctx;
+    int id;
+} DumpWorker;
+
+/*
+ * Appends a line to a worker's buffer.
+ */
+static void dump_line(DumpBuffer *buffer, const char *path, int length) {
+    if (buffer->used + length + 1 > buffer->size) {
+        while (buffer->used + length + 1 > buffer->size) {
+            buffer->size *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->size);
+        if (!buffer->data) {
+            fprintf(stderr, "Error allocating tree dump buffer!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(buffer->data + buffer->used, path, length);
+    buffer->data[buffer->used + length] = '\n';
+    buffer->used += length + 1;
+}
+
+/*
+ * Extends a path with a child's name.
+ * Returns: the new length, or FAIL if the path would not fit
+ */
+static int dump_path_push(char *path, int length, SnapEntry *entry) {
+    if (length + 1 + entry->length >= MAX_FILE_NAME) {
+        fprintf(stderr, "truncation when building full path\n");
+        return FAIL;
+    }
+    path[length] = '/';
+    memcpy(path + length + 1, entry->name, entry->length);
+    return length + 1 + entry->length;
+}
+
+/*
+ * Reads, and drops, a subtree left out of the dump as its paths don't fit,
+ * so the state preserved for it is released rather than kept with its
+ * i-nodes until they change again.
+ */
+static void dump_skip(DumpContext *ctx, int inumber) {
+    struct skipped {
+        SnapNode *node;
+        int next;
+    } *stack;
+    int size = MAX_PATH_DEPTH + 1, depth = 0;
+
+    if (!(stack = malloc(sizeof(*stack) * size))) {
+        fprintf(stderr, "Error allocating tree dump stack!\n");
+        exit(EXIT_FAILURE);
+    }
+    stack[0].node = inode_snapshot(inumber, ctx->gen);
+    stack[0].next = 0;
+
+    while (depth >= 0) {
+        SnapNode *node = stack[depth].node;
+        if (node->nodeType != T_DIRECTORY || stack[depth].next == node->count) {
+            snap_node_free(node);
+            depth--;
+            continue;
+        }
+        int child = node->entries[stack[depth].next++].inumber;
+        /* moves may have made it deeper than any path that fits */
+        if (++depth == size) {
+            size *= 2;
+            if (!(stack = realloc(stack, sizeof(*stack) * size))) {
+                fprintf(stderr, "Error allocating tree dump stack!\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        stack[depth].node = inode_snapshot(child, ctx->gen);
+        stack[depth].next = 0;
+    }
+    free(stack);
+}
+
+/*
+ * Prints a task: its own line and, unless it was split, its whole subtree.
+ * Returns: SUCCESS or FAIL
+ */
+static int dump_task(DumpContext *ctx, DumpTask *task, DumpBuffer *buffer) {
+    struct {
+        SnapNode *node;
+        int next;
+        int pathLength;
+    } stack[MAX_PATH_DEPTH + 1];
+    char path[MAX_FILE_NAME];
+    int depth = 0, res = SUCCESS;
+
+    dump_line(buffer, task->path, task->pathLength);
+    if (task->lineOnly) {
+        return SUCCESS;
+    }
+
+    memcpy(path, task->path, task->pathLength);
+    stack[0].node = task->node ? task->node : inode_snapshot(task->inumber, ctx->gen);
+    stack[0].next = 0;
+    stack[0].pathLength = task->pathLength;
+    task->node = NULL;
+
+    while (depth >= 0) {
+        SnapNode *node = stack[depth].node;
+        if (node->nodeType != T_DIRECTORY || stack[depth].next == node->count) {
+            snap_node_free(node);
+            depth--;
+            continue;
+        }
+
+        SnapEntry *entry = &node->entries[stack[depth].next++];
+        int length = dump_path_push(path, stack[depth].pathLength, entry);
+        if (length == FAIL) {
+            dump_skip(ctx, entry->inumber);
+            res = FAIL;
+            continue;
+        }
+        dump_line(buffer, path, length);
+
+        /* paths are shorter than MAX_FILE_NAME, so depth stays below MAX_PATH_DEPTH */
+        depth++;
+        stack[depth].node = inode_snapshot(entry->inumber, ctx->gen);
+        stack[depth].next = 0;
+        stack[depth].pathLength = length;
+    }
+    return res;
+}
+
+/*
+ * Replaces every task with its own line and its children, one level down,
+ * until there are enough tasks or no more directories to split.
+ * Returns: SUCCESS or FAIL
+ */
+static int dump_split(DumpContext *ctx, int target) {
+    int res = SUCCESS;
+    bool split = true;
+
+    while (split && ctx->numTasks < target) {
+        int count = 0;
+        split = false;
+        for (int t = 0; t < ctx->numTasks; t++) {
+            DumpTask *task = &ctx->tasks[t];
+            if (!task->lineOnly) {
+                if (!task->node) {
+                    task->node = inode_snapshot(task->inumber, ctx->gen);
+                }
+                if (task->node->nodeType == T_DIRECTORY) {
+                    count += task->node->count;
+                }
+            }
+        }
+        if (count == 0) {
+            break;
+        }
+
+        DumpTask *tasks = malloc(sizeof(DumpTask) * (ctx->numTasks + count));
+        if (!tasks) {
+            fprintf(stderr, "Error allocating tree dump tasks!\n");
+            exit(EXIT_FAILURE);
+        }
+        int n = 0;
+        for (int t = 0; t < ctx->numTasks; t++) {
+            DumpTask *task = &ctx->tasks[t];
+            tasks[n++] = *task;
+            if (task->lineOnly || task->node->nodeType != T_DIRECTORY) {
+                continue;
+            }
+
+            SnapNode *node = task->node;
+            tasks[n - 1].lineOnly = true;
+            tasks[n - 1].node = NULL;
+            for (int i = 0; i < node->count; i++) {
+                DumpTask *child = &tasks[n];
+                char path[MAX_FILE_NAME];
+                memcpy(path, task->path, task->pathLength);
+                int length = dump_path_push(path, task->pathLength, &node->entries[i]);
+                if (length == FAIL) {
+                    dump_skip(ctx, node->entries[i].inumber);
+                    res = FAIL;
+                    continue;
+                }
+                child->inumber = node->entries[i].inumber;
+                child->node = NULL;
+                child->lineOnly = false;
+                child->path = malloc(length);
+                if (length && !child->path) {
+                    fprintf(stderr, "Error allocating tree dump tasks!\n");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(child->path, path, length);
+                child->pathLength = length;
+                n++;
+                split = true;
+            }
+            snap_node_free(node);
+        }
+        free(ctx->tasks);
+        ctx->tasks = tasks;
+        ctx->numTasks = n;
+    }
+    return res;
+}
+
+/*
+ * Writes a buffer at a position of the output file.
+ * Returns: SUCCESS or FAIL
+ */
+static int dump_write(int fd, const char *data, size_t length, off_t position) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, position);
+        if (written == -1) {
+            perror("Error writing tree dump");
+            return FAIL;
+        }
+        data += written;
+        length -= written;
+        position += written;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Prints tasks until there are none left, then writes them to the file,
+ * merging runs of tasks that are adjacent both in the buffer and the file.
+ */
+static void *dump_worker(void *arg) {
+    DumpWorker *worker = arg;
+    DumpContext *ctx = worker->ctx;
+    DumpBuffer *buffer = &ctx->buffers[worker->id];
+    int t;
+
+    while ((t = __atomic_fetch_add(&ctx->nextTask, 1, __ATOMIC_RELAXED)) < ctx->numTasks) {
+        DumpTask *task = &ctx->tasks[t];
+        task->worker = worker->id;
+        task->offset = buffer->used;
+        if (dump_task(ctx, task, buffer) == FAIL) {
+            __atomic_store_n(&ctx->result, FAIL, __ATOMIC_RELAXED);
+        }
+        task->length = buffer->used - task->offset;
+    }
+
+    pthread_barrier_wait(&ctx->printed);
+    if (worker->id == 0) {
+        off_t position = 0;
+        for (t = 0; t < ctx->numTasks; t++) {
+            ctx->tasks[t].position = position;
+            position += ctx->tasks[t].length;
+        }
+    }
+    pthread_barrier_wait(&ctx->placed);
+
+    for (t = 0; t < ctx->numTasks; t++) {
+        DumpTask *task = &ctx->tasks[t];
+        if (task->worker != worker->id) {
+            continue;
+        }
+        size_t length = task->length;
+        while (t + 1 < ctx->numTasks && ctx->tasks[t + 1].worker == worker->id &&
+               ctx->tasks[t + 1].offset == task->offset + length) {
+            length += ctx->tasks[++t].length;
+        }
+        if (dump_write(ctx->fd, buffer->data + task->offset, length, task->position) == FAIL) {
+            __atomic_store_n(&ctx->result, FAIL, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Prints the tree as of a snapshot, one path per line, in preorder.
+ * Every i-node of the snapshot is read, so that the snapshot can end.
+ * Input:
+ *  - fd: output file, empty
+ *  - gen: generation of the snapshot
+ * Returns: SUCCESS or FAIL
+ */
+int dump_tree(int fd, unsigned int gen) {
+    DumpContext ctx;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxWorkers = cpus < 1 ? 1 : cpus > DUMP_MAX_WORKERS ? DUMP_MAX_WORKERS : cpus;
+
+    ctx.fd = fd;
+    ctx.gen = gen;
+    ctx.nextTask = 0;
+    ctx.result = SUCCESS;
+    ctx.numTasks = 1;
+    ctx.tasks = malloc(sizeof(DumpTask));
+    if (!ctx.tasks) {
+        fprintf(stderr, "Error allocating tree dump tasks!\n");
+        exit(EXIT_FAILURE);
+    }
+    ctx.tasks[0].inumber = FS_ROOT;
+    ctx.tasks[0].node = NULL;
+    ctx.tasks[0].lineOnly = false;
+    ctx.tasks[0].path = malloc(1);
+    ctx.tasks[0].pathLength = 0;
+
+    if (maxWorkers > 1 && dump_split(&ctx, maxWorkers * DUMP_TASKS_PER_WORKER) == FAIL) {
+        ctx.result = FAIL;
+    }
+    ctx.numWorkers = ctx.numTasks < DUMP_MIN_PARALLEL_TASKS ? 1 : maxWorkers;
+
+    DumpWorker workers[DUMP_MAX_WORKERS];
+    pthread_t tids[DUMP_MAX_WORKERS];
+    ctx.buffers = malloc(sizeof(DumpBuffer) * ctx.numWorkers);
+    if (!ctx.buffers) {
+        fprintf(stderr, "Error allocating tree dump buffer!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ctx.numWorkers; i++) {
+        ctx.buffers[i].used = 0;
+        ctx.buffers[i].size = DUMP_BUFFER_SIZE;
+        ctx.buffers[i].data = malloc(DUMP_BUFFER_SIZE);
+        if (!ctx.buffers[i].data) {
+            fprintf(stderr, "Error allocating tree dump buffer!\n");
+            exit(EXIT_FAILURE);
+        }
+        workers[i].ctx = &ctx;
+        workers[i].id = i;
+    }
+    if (pthread_barrier_init(&ctx.printed, NULL, ctx.numWorkers) ||
+        pthread_barrier_init(&ctx.placed, NULL, ctx.numWorkers)) {
+        fprintf(stderr, "Error initializing tree dump barriers!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the calling thread is worker 0 */
+    for (int i = 1; i < ctx.numWorkers; i++) {
+        if (pthread_create(&tids[i], NULL, dump_worker, &workers[i])) {
+            fprintf(stderr, "Tree dump thread failed to create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    dump_worker(&workers[0]);
+    for (int i = 1; i < ctx.numWorkers; i++) {
+        if (pthread_join(tids[i], NULL)) {
+            fprintf(stderr, "Tree dump thread failed to join!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_destroy(&ctx.printed);
+    pthread_barrier_destroy(&ctx.placed);
+    for (int i = 0; i < ctx.numWorkers; i++) {
+        free(ctx.buffers[i].data);
+    }
+    free(ctx.buffers);
+    for (int t = 0; t < ctx.numTasks; t++) {
+        free(ctx.tasks[t].path);
+    }
+    free(ctx.tasks);
+    return ctx.result;
+}
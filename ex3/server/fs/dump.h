@@ -0,0 +1,15 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+/* Upper bound of threads printing one tree */
+#define DUMP_MAX_WORKERS 8
+/* Subtrees the tree is split into, per worker */
+#define DUMP_TASKS_PER_WORKER 8
+/* Below this many subtrees, the tree is printed by the calling thread alone */
+#define DUMP_MIN_PARALLEL_TASKS 16
+/* Initial size of each worker's output buffer */
+#define DUMP_BUFFER_SIZE (1 << 16)
+
+int dump_tree(int fd, unsigned int gen);
+
+#endif /* DUMP_H */
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include "epoch.h"
+
+/*
+ * Epoch-based reclamation. Lock-free readers run between epoch_enter() and
+ * epoch_exit(), announcing the global epoch they observed. Memory that
+ * readers may still reach is retired with epoch_defer(), tagged with the
+ * global epoch, and is only freed once the global epoch has advanced twice
+ * since, which requires every active reader to have observed a later epoch.
+ */
+
+typedef struct epoch_retired {
+    epoch_free_fn fn;
+    void *ptr;
+    size_t size;
+    unsigned long epoch;
+    struct epoch_retired *next;
+} epoch_retired;
+
+typedef struct epoch_record {
+    unsigned long epoch;    /* global epoch observed by the active reader */
+    int active;             /* nesting depth of read sections */
+    int numDeferred;
+    epoch_retired *head;    /* oldest retired memory */
+    epoch_retired *tail;
+    struct epoch_record *next;
+} epoch_record;
+
+static unsigned long global_epoch = 0;
+static epoch_record *records = NULL;
+static pthread_mutex_t records_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+
+static __thread epoch_record *thread_record = NULL;
+
+static void epoch_reclaim(epoch_record *record, bool wait);
+
+/*
+ * Frees the retired memory of an exiting thread. Its record stays
+ * registered, inactive, for a later thread to reuse.
+ */
+static void epoch_record_release(void *arg) {
+    epoch_record *record = arg;
+    epoch_reclaim(record, true);
+    __atomic_store_n(&record->active, -1, __ATOMIC_RELEASE);
+    thread_record = NULL;
+}
+
+static void epoch_init() {
+    if (pthread_key_create(&epoch_key, epoch_record_release)) {
+        fprintf(stderr, "Error creating epoch thread key!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the calling thread's record, registering it on first use.
+ */
+static epoch_record *epoch_get_record() {
+    if (thread_record) {
+        return thread_record;
+    }
+    pthread_once(&epoch_once, epoch_init);
+
+    if (pthread_mutex_lock(&records_mutex)) {
+        fprintf(stderr, "Error locking epoch records mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+    epoch_record *record;
+    for (record = records; record; record = record->next) {
+        if (__atomic_load_n(&record->active, __ATOMIC_ACQUIRE) == -1) {
+            break;
+        }
+    }
+    if (!record) {
+        record = calloc(1, sizeof(epoch_record));
+        if (!record) {
+            fprintf(stderr, "Error allocating epoch record!\n");
+            exit(EXIT_FAILURE);
+        }
+        record->next = records;
+        __atomic_store_n(&records, record, __ATOMIC_RELEASE);
+    }
+    record->active = 0;
+    pthread_mutex_unlock(&records_mutex);
+
+    pthread_setspecific(epoch_key, record);
+    thread_record = record;
+    return record;
+}
+
+/*
+ * Starts a read section: memory reachable from shared pointers is not freed
+ * until the matching epoch_exit(). Sections may nest.
+ */
+void epoch_enter() {
+    epoch_record *record = epoch_get_record();
+    if (record->active++ == 0) {
+        __atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        /* the announcement must be visible before any shared pointer is read */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/*
+ * Ends a read section.
+ */
+void epoch_exit() {
+    epoch_record *record = thread_record;
+    if (record->active == 1) {
+        __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+    } else {
+        record->active--;
+    }
+}
+
+/*
+ * Advances the global epoch if every active reader has observed it.
+ * Returns: the (possibly new) global epoch
+ */
+static unsigned long epoch_try_advance() {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (epoch_record *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record; record = record->next) {
+        if (__atomic_load_n(&record->active, __ATOMIC_ACQUIRE) > 0 &&
+            __atomic_load_n(&record->epoch, __ATOMIC_RELAXED) != epoch) {
+            return epoch;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Frees the retired memory of a record that no reader can reach anymore.
+ * Input:
+ *  - record: the calling thread's record
+ *  - wait: if true, waits until every retired object is freed
+ */
+static void epoch_reclaim(epoch_record *record, bool wait) {
+    while (record->head) {
+        unsigned long epoch = epoch_try_advance();
+        while (record->head && record->head->epoch + 2 <= epoch) {
+            epoch_retired *retired = record->head;
+            record->head = retired->next;
+            retired->fn(retired->ptr, retired->size);
+            free(retired);
+            record->numDeferred--;
+        }
+        if (!wait) {
+            break;
+        }
+        if (record->head) {
+            sched_yield();
+        }
+    }
+    if (!record->head) {
+        record->tail = NULL;
+    }
+}
+
+/*
+ * Retires memory that lock-free readers may still be using.
+ * Input:
+ *  - fn: function that frees the memory
+ *  - ptr: the memory
+ *  - size: size passed to fn
+ */
+void epoch_defer(epoch_free_fn fn, void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    epoch_record *record = epoch_get_record();
+    epoch_retired *retired = malloc(sizeof(epoch_retired));
+    if (!retired) {
+        fprintf(stderr, "Error allocating epoch retired list!\n");
+        exit(EXIT_FAILURE);
+    }
+    retired->fn = fn;
+    retired->ptr = ptr;
+    retired->size = size;
+    retired->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    retired->next = NULL;
+    if (record->tail) {
+        record->tail->next = retired;
+    } else {
+        record->head = retired;
+    }
+    record->tail = retired;
+
+    if (++record->numDeferred % EPOCH_RECLAIM_INTERVAL == 0) {
+        epoch_reclaim(record, false);
+    }
+}
+
+/*
+ * Waits until all memory retired by the calling thread is freed.
+ * Must not be called inside a read section.
+ */
+void epoch_synchronize() {
+    epoch_reclaim(epoch_get_record(), true);
+}
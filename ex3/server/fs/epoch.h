@@ -0,0 +1,16 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stddef.h>
+
+/* Deferred frees a thread queues before it tries to reclaim memory */
+#define EPOCH_RECLAIM_INTERVAL 64
+
+typedef void (*epoch_free_fn)(void *ptr, size_t size);
+
+void epoch_enter();
+void epoch_exit();
+void epoch_defer(epoch_free_fn fn, void *ptr, size_t size);
+void epoch_synchronize();
+
+#endif /* EPOCH_H */
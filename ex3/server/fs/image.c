@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "state.h"
+
+/*
+ * Namespace images. A starting server maps its image privately and only
+ * checks the header, so startup does not depend on the size of the tree:
+ * segments of the i-node table are loaded from their records on first use
+ * (see inode_segment_fault), and directories keep their tables in the
+ * mapping, which the kernel pages in as they are read. Changes copy the
+ * pages they touch and never reach the file.
+ *
+ * Deltas of the image are mapped the same way, and only their records are
+ * read at startup: each points the inumbers it changed at its own tables,
+ * so the cost of applying them follows the changes they hold.
+ *
+ * Images are written from a snapshot while other operations keep running,
+ * to a temporary file that then replaces the image, so a crash while
+ * writing leaves the previous image in place.
+ */
+
+typedef struct imageMap {
+    char *data;
+    size_t size;
+    ImageHeader *header;
+} ImageMap;
+
+/* Record of an inumber in a delta; map 0 (the image) means no delta has it */
+typedef struct imageSource {
+    int map;
+    ImageInode *record;
+} ImageSource;
+
+/* An image and the deltas that apply to it, in order */
+typedef struct imageSet {
+    ImageMap *maps;
+    int mapCount;
+    ImageSource *sources;
+    int inodeCount;
+    uint64_t lsn;
+} ImageSet;
+
+typedef struct imageWriter {
+    FILE *fp;
+    uint64_t offset;
+    char *table;
+    size_t tableSize;
+} ImageWriter;
+
+static ImageSet mapped = { NULL, 0, NULL, 0, 0 };
+
+/*
+ * Builds the path of a delta of an image.
+ * Input:
+ *  - buffer, size: where to build it
+ *  - path: the image file
+ *  - sequence: number of the delta, from 1
+ * Returns: SUCCESS, or FAIL if the path does not fit
+ */
+int image_delta_path(char *buffer, size_t size, const char *path, int sequence) {
+    return snprintf(buffer, size, "%s.delta%d", path, sequence) < size ? SUCCESS : FAIL;
+}
+
+/*
+ * Maps an image or delta file.
+ * Input:
+ *  - path: the file
+ *  - map: set to the mapping
+ * Returns: SUCCESS, or FAIL if there is no such file
+ */
+static int image_map(const char *path, ImageMap *map) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return FAIL;
+        }
+        perror("Error opening image");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading image");
+        exit(EXIT_FAILURE);
+    }
+
+    if (st.st_size < sizeof(ImageHeader)) {
+        fprintf(stderr, "Error: %s is not a valid image\n", path);
+        exit(EXIT_FAILURE);
+    }
+    map->size = st.st_size;
+    map->data = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map->data == MAP_FAILED) {
+        perror("Error mapping image");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    map->header = (ImageHeader *) map->data;
+    ImageHeader *header = map->header;
+    size_t recordSize = memcmp(header->magic, IMAGE_DELTA_MAGIC, sizeof(header->magic)) ?
+        sizeof(ImageInode) : sizeof(ImageDelta);
+    if ((memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) &&
+         memcmp(header->magic, IMAGE_DELTA_MAGIC, sizeof(header->magic))) ||
+        header->version != IMAGE_VERSION || header->size != map->size ||
+        header->inodes > map->size || header->inodes % 8 ||
+        (map->size - header->inodes) / recordSize < header->inodeCount) {
+        fprintf(stderr, "Error: %s is not a valid image\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Maps an image and every delta that applies to it, in order. Deltas left
+ * from an older image, or after a missing one, are ignored.
+ * Input:
+ *  - set: set to the image and its deltas
+ *  - path: the image file
+ * Returns: SUCCESS, or FAIL if there is no image at path
+ */
+static int image_set_open(ImageSet *set, const char *path) {
+    ImageMap base;
+    if (image_map(path, &base) == FAIL) {
+        return FAIL;
+    }
+    ImageInode *records = (ImageInode *) (base.data + base.header->inodes);
+    if (memcmp(base.header->magic, IMAGE_MAGIC, sizeof(base.header->magic)) ||
+        base.header->inodeCount == 0 ||
+        base.header->inodeCount > MAX_INODE_SEGMENTS * INODE_SEGMENT_SIZE ||
+        records[FS_ROOT].nodeType != T_DIRECTORY) {
+        fprintf(stderr, "Error: %s is not a valid image\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    set->maps = malloc(sizeof(ImageMap));
+    if (!set->maps) {
+        fprintf(stderr, "Error allocating image!\n");
+        exit(EXIT_FAILURE);
+    }
+    set->maps[0] = base;
+    set->mapCount = 1;
+    set->inodeCount = base.header->inodeCount;
+    set->lsn = base.header->lsn;
+
+    char deltaPath[PATH_MAX];
+    ImageMap delta;
+    while (image_delta_path(deltaPath, sizeof(deltaPath), path, set->mapCount) == SUCCESS &&
+           image_map(deltaPath, &delta) == SUCCESS) {
+        if (memcmp(delta.header->magic, IMAGE_DELTA_MAGIC, sizeof(delta.header->magic)) ||
+            delta.header->id != base.header->id || delta.header->lsn < set->lsn) {
+            munmap(delta.data, delta.size);
+            break;
+        }
+        ImageDelta *deltas = (ImageDelta *) (delta.data + delta.header->inodes);
+        for (int i = 0; i < delta.header->inodeCount; i++) {
+            if (deltas[i].inumber < 0 || deltas[i].inumber >= MAX_INODE_SEGMENTS * INODE_SEGMENT_SIZE) {
+                fprintf(stderr, "Error: %s is not a valid image delta\n", deltaPath);
+                exit(EXIT_FAILURE);
+            }
+            if (deltas[i].inumber >= set->inodeCount) {
+                set->inodeCount = deltas[i].inumber + 1;
+            }
+        }
+        set->maps = realloc(set->maps, sizeof(ImageMap) * (set->mapCount + 1));
+        if (!set->maps) {
+            fprintf(stderr, "Error allocating image!\n");
+            exit(EXIT_FAILURE);
+        }
+        set->maps[set->mapCount++] = delta;
+        set->lsn = delta.header->lsn;
+    }
+
+    /* zeroed pages are only touched where deltas have records */
+    set->sources = NULL;
+    if (set->mapCount > 1) {
+        set->sources = calloc(set->inodeCount, sizeof(ImageSource));
+        if (!set->sources) {
+            fprintf(stderr, "Error allocating image!\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int m = 1; m < set->mapCount; m++) {
+            ImageMap *map = &set->maps[m];
+            ImageDelta *deltas = (ImageDelta *) (map->data + map->header->inodes);
+            for (int i = 0; i < map->header->inodeCount; i++) {
+                set->sources[deltas[i].inumber].map = m;
+                set->sources[deltas[i].inumber].record = &deltas[i].inode;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Unmaps an image and its deltas.
+ */
+static void image_set_close(ImageSet *set) {
+    for (int m = 0; m < set->mapCount; m++) {
+        munmap(set->maps[m].data, set->maps[m].size);
+    }
+    free(set->maps);
+    free(set->sources);
+    memset(set, 0, sizeof(ImageSet));
+}
+
+/*
+ * Finds the latest record of an inumber.
+ * Input:
+ *  - set: the image and its deltas
+ *  - inumber: below set->inodeCount
+ *  - map: set to the mapping holding the record
+ * Returns: the record, or NULL if the i-node is free
+ */
+static ImageInode *image_set_record(ImageSet *set, int inumber, ImageMap **map) {
+    if (set->sources && set->sources[inumber].record) {
+        *map = &set->maps[set->sources[inumber].map];
+        return set->sources[inumber].record;
+    }
+    *map = &set->maps[0];
+    if (inumber >= set->maps[0].header->inodeCount) {
+        return NULL;
+    }
+    return &((ImageInode *) (set->maps[0].data + set->maps[0].header->inodes))[inumber];
+}
+
+/*
+ * Checks that a record lies within its mapping.
+ * Returns: SUCCESS or FAIL
+ */
+static int image_record_check(ImageMap *map, ImageInode *record) {
+    if (record->nodeType == T_DIRECTORY) {
+        int capacity = record->capacity;
+        if (capacity < DIR_INITIAL_ENTRIES || (capacity & (capacity - 1)) ||
+            record->count < 0 || record->count > capacity || record->arenaSize < 0 ||
+            record->table > map->size || record->table % 8 ||
+            map->size - record->table < dir_image_size(capacity, record->arenaSize)) {
+            return FAIL;
+        }
+    } else if (record->nodeType != T_FILE && record->nodeType != T_NONE) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Maps an image and the deltas that apply to it.
+ * Input:
+ *  - path: the image file
+ * Returns: SUCCESS, or FAIL if there is no image at path
+ */
+int image_open(const char *path) {
+    return image_set_open(&mapped, path);
+}
+
+/*
+ * Unmaps the image, once no directory uses its tables.
+ */
+void image_close() {
+    if (mapped.maps) {
+        image_set_close(&mapped);
+    }
+}
+
+/*
+ * Returns the number of i-node records of the mapped image, 0 if none.
+ */
+int image_inode_count() {
+    return mapped.inodeCount;
+}
+
+/*
+ * Returns the lsn of the latest log record in the mapped image, 0 if none.
+ */
+uint64_t image_lsn() {
+    return mapped.lsn;
+}
+
+/*
+ * Returns the id of the mapped image, 0 if none.
+ */
+uint64_t image_id() {
+    return mapped.maps ? mapped.maps[0].header->id : 0;
+}
+
+/*
+ * Returns the number of deltas applied to the mapped image.
+ */
+int image_delta_count() {
+    return mapped.maps ? mapped.mapCount - 1 : 0;
+}
+
+/*
+ * Loads an i-node from its latest record.
+ * Input:
+ *  - inumber: identifier of the i-node, below image_inode_count()
+ *  - nType: set to the i-node's type
+ *  - dir: set to its directory, served from the mapping, or NULL
+ */
+void image_load_inode(int inumber, type *nType, Directory **dir) {
+    ImageMap *map;
+    ImageInode *record = image_set_record(&mapped, inumber, &map);
+    *nType = T_NONE;
+    *dir = NULL;
+    if (!record) {
+        return;
+    }
+
+    if (image_record_check(map, record) == FAIL) {
+        fprintf(stderr, "Error: invalid image record of i-node %d\n", inumber);
+        exit(EXIT_FAILURE);
+    }
+    *nType = record->nodeType;
+    if (record->nodeType == T_DIRECTORY) {
+        *dir = dir_map(map->data + record->table, record->count, record->capacity, record->arenaSize);
+    }
+}
+
+/*
+ * Writes a stream of bytes, exiting on errors.
+ */
+static void image_put(ImageWriter *writer, const void *data, size_t size) {
+    if (size && fwrite(data, size, 1, writer->fp) != 1) {
+        perror("Error writing image");
+        exit(EXIT_FAILURE);
+    }
+    writer->offset += size;
+}
+
+/*
+ * Starts writing an image or delta to a temporary file, leaving room for its header.
+ * Input:
+ *  - writer: set to the writer
+ *  - path: the file it will replace
+ *  - tmp: set to the temporary file, PATH_MAX bytes
+ * Returns: SUCCESS or FAIL
+ */
+static int image_writer_open(ImageWriter *writer, const char *path, char *tmp) {
+    if (snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        fprintf(stderr, "Image path too long\n");
+        return FAIL;
+    }
+    writer->fp = fopen(tmp, "w");
+    if (!writer->fp) {
+        perror("Error creating image");
+        return FAIL;
+    }
+    writer->offset = 0;
+    writer->table = NULL;
+    writer->tableSize = 0;
+
+    ImageHeader head;
+    memset(&head, 0, sizeof(head));
+    image_put(writer, &head, sizeof(head));
+    return SUCCESS;
+}
+
+/*
+ * Writes the header, syncs the temporary file and replaces the file with it.
+ * Input:
+ *  - writer: the writer
+ *  - head: the header
+ *  - tmp: the temporary file
+ *  - path: the file it replaces
+ * Returns: SUCCESS or FAIL
+ */
+static int image_writer_close(ImageWriter *writer, ImageHeader *head, const char *tmp, const char *path) {
+    free(writer->table);
+    if (fseek(writer->fp, 0, SEEK_SET) == -1) {
+        perror("Error writing image");
+        exit(EXIT_FAILURE);
+    }
+    image_put(writer, head, sizeof(*head));
+    if (fflush(writer->fp) || fsync(fileno(writer->fp)) || fclose(writer->fp)) {
+        perror("Error writing image");
+        return FAIL;
+    }
+    if (rename(tmp, path) == -1) {
+        perror("Error replacing image");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Makes room for a table in the writer's buffer.
+ */
+static char *image_table_buffer(ImageWriter *writer, size_t size) {
+    if (size > writer->tableSize) {
+        writer->tableSize = size;
+        writer->table = realloc(writer->table, size);
+        if (!writer->table) {
+            fprintf(stderr, "Error allocating image!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return writer->table;
+}
+
+/*
+ * Writes the table of an i-node as of a snapshot and fills its record.
+ * Input:
+ *  - writer: the writer
+ *  - node: the i-node as of the snapshot
+ *  - record: set to its record
+ */
+static void image_put_node(ImageWriter *writer, SnapNode *node, ImageInode *record) {
+    memset(record, 0, sizeof(ImageInode));
+    record->nodeType = node->nodeType;
+    if (node->nodeType != T_DIRECTORY) {
+        return;
+    }
+
+    int arenaSize = 0;
+    for (int i = 0; i < node->count; i++) {
+        if (node->entries[i].length > DIR_INLINE_NAME) {
+            arenaSize += node->entries[i].length + 1;
+        }
+    }
+    record->count = node->count;
+    record->capacity = dir_image_capacity(node->count);
+    record->arenaSize = arenaSize;
+    record->table = writer->offset;
+
+    size_t size = dir_image_size(record->capacity, arenaSize);
+    char *table = image_table_buffer(writer, size);
+    memset(table, 0, size);
+    dir_image_fill(table, record->capacity, arenaSize, node);
+    image_put(writer, table, size);
+}
+
+/*
+ * Returns a new image id, never 0.
+ */
+static uint64_t image_new_id() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t id = ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec) ^ ((uint64_t) getpid() << 40);
+    return id ? id : 1;
+}
+
+/*
+ * Writes an image of the namespace as of a running snapshot, replacing the
+ * file at path. Every i-node of the snapshot is read, each exactly once.
+ * Input:
+ *  - path: the image file
+ *  - gen: generation of the snapshot
+ *  - lsn: lsn of the latest log record in the snapshot
+ *  - id: set to the id of the new image
+ * Returns: SUCCESS or FAIL
+ */
+int image_write_base(const char *path, unsigned int gen, uint64_t lsn, uint64_t *id) {
+    char tmp[PATH_MAX];
+    ImageWriter writer;
+    if (image_writer_open(&writer, path, tmp) == FAIL) {
+        return FAIL;
+    }
+
+    int count = __atomic_load_n(&inode_count, __ATOMIC_ACQUIRE), maxInumber = FS_ROOT;
+    ImageInode *inodes = malloc(sizeof(ImageInode) * count);
+    int *stack = malloc(sizeof(int) * count);
+    if (!inodes || !stack) {
+        fprintf(stderr, "Error allocating image!\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(inodes, 0, sizeof(ImageInode) * count);
+    for (int i = 0; i < count; i++) {
+        inodes[i].nodeType = T_NONE;
+    }
+
+    int depth = 0;
+    stack[depth++] = FS_ROOT;
+    while (depth > 0) {
+        int inumber = stack[--depth];
+        SnapNode *node = inode_snapshot(inumber, gen);
+
+        if (inumber > maxInumber) {
+            maxInumber = inumber;
+        }
+        image_put_node(&writer, node, &inodes[inumber]);
+        for (int i = 0; i < node->count; i++) {
+            stack[depth++] = node->entries[i].inumber;
+        }
+        snap_node_free(node);
+    }
+
+    ImageHeader head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_MAGIC, sizeof(head.magic));
+    head.version = IMAGE_VERSION;
+    head.inodeCount = maxInumber + 1;
+    head.inodes = writer.offset;
+    head.size = writer.offset + sizeof(ImageInode) * head.inodeCount;
+    head.lsn = lsn;
+    head.id = image_new_id();
+    image_put(&writer, inodes, sizeof(ImageInode) * head.inodeCount);
+    free(inodes);
+    free(stack);
+
+    if (id) {
+        *id = head.id;
+    }
+    return image_writer_close(&writer, &head, tmp, path);
+}
+
+/*
+ * Writes a delta of an image with the given i-nodes, as of a running snapshot.
+ * Input:
+ *  - path: the image file
+ *  - sequence: number of the delta, one past the latest delta of the image
+ *  - baseId: id of the image
+ *  - gen: generation of the snapshot
+ *  - lsn: lsn of the latest log record in the snapshot
+ *  - inumbers, count: the i-nodes changed since the latest delta, each once
+ *  - bytes: set to the size of the delta
+ * Returns: SUCCESS or FAIL
+ */
+int image_write_delta(const char *path, int sequence, uint64_t baseId, unsigned int gen,
+                      uint64_t lsn, int *inumbers, int count, size_t *bytes) {
+    char deltaPath[PATH_MAX], tmp[PATH_MAX];
+    ImageWriter writer;
+    if (image_delta_path(deltaPath, sizeof(deltaPath), path, sequence) == FAIL) {
+        fprintf(stderr, "Image path too long\n");
+        return FAIL;
+    }
+    if (image_writer_open(&writer, deltaPath, tmp) == FAIL) {
+        return FAIL;
+    }
+
+    ImageDelta *deltas = malloc(sizeof(ImageDelta) * (count ? count : 1));
+    if (!deltas) {
+        fprintf(stderr, "Error allocating image!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        SnapNode *node = inode_snapshot(inumbers[i], gen);
+        deltas[i].inumber = inumbers[i];
+        deltas[i].reserved = 0;
+        image_put_node(&writer, node, &deltas[i].inode);
+        snap_node_free(node);
+    }
+
+    ImageHeader head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_DELTA_MAGIC, sizeof(head.magic));
+    head.version = IMAGE_VERSION;
+    head.inodeCount = count;
+    head.inodes = writer.offset;
+    head.size = writer.offset + sizeof(ImageDelta) * count;
+    head.lsn = lsn;
+    head.id = baseId;
+    image_put(&writer, deltas, sizeof(ImageDelta) * count);
+    free(deltas);
+
+    *bytes = head.size;
+    return image_writer_close(&writer, &head, tmp, deltaPath);
+}
+
+/*
+ * Writes an image of the namespace, as of a snapshot taken when the call
+ * starts, replacing the file at path.
+ * Input:
+ *  - path: the image file
+ * Returns: SUCCESS or FAIL
+ */
+int image_write(const char *path) {
+    unsigned int gen = snapshot_begin();
+    int res = image_write_base(path, gen, snapshot_last_lsn(), NULL);
+    snapshot_end();
+    return res;
+}
+
+/*
+ * Merges the deltas of an image into a new image that replaces it, and
+ * removes them. Only the files are read, not the namespace.
+ * Input:
+ *  - path: the image file
+ *  - id: set to the id of the new image
+ * Returns: SUCCESS or FAIL
+ */
+int image_merge(const char *path, uint64_t *id) {
+    ImageSet set;
+    char tmp[PATH_MAX];
+    ImageWriter writer;
+    if (image_set_open(&set, path) == FAIL) {
+        return FAIL;
+    }
+    if (image_writer_open(&writer, path, tmp) == FAIL) {
+        image_set_close(&set);
+        return FAIL;
+    }
+
+    ImageInode *inodes = malloc(sizeof(ImageInode) * set.inodeCount);
+    if (!inodes) {
+        fprintf(stderr, "Error allocating image!\n");
+        exit(EXIT_FAILURE);
+    }
+    /* tables do not depend on where they are, so they are copied as they are */
+    for (int i = 0; i < set.inodeCount; i++) {
+        ImageMap *map;
+        ImageInode *record = image_set_record(&set, i, &map);
+        memset(&inodes[i], 0, sizeof(ImageInode));
+        inodes[i].nodeType = T_NONE;
+        if (!record) {
+            continue;
+        }
+        if (image_record_check(map, record) == FAIL) {
+            fprintf(stderr, "Error: invalid image record of i-node %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+        inodes[i] = *record;
+        if (record->nodeType == T_DIRECTORY) {
+            inodes[i].table = writer.offset;
+            image_put(&writer, map->data + record->table, dir_image_size(record->capacity, record->arenaSize));
+        }
+    }
+
+    ImageHeader head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, IMAGE_MAGIC, sizeof(head.magic));
+    head.version = IMAGE_VERSION;
+    head.inodeCount = set.inodeCount;
+    head.inodes = writer.offset;
+    head.size = writer.offset + sizeof(ImageInode) * head.inodeCount;
+    head.lsn = set.lsn;
+    head.id = image_new_id();
+    image_put(&writer, inodes, sizeof(ImageInode) * head.inodeCount);
+    free(inodes);
+    image_set_close(&set);
+
+    if (image_writer_close(&writer, &head, tmp, path) == FAIL) {
+        return FAIL;
+    }
+    *id = head.id;
+    image_remove_deltas(path, 1);
+    return SUCCESS;
+}
+
+/*
+ * Removes the deltas of an image from a given one on, the latest first, so
+ * that an interrupted removal never leaves a gap.
+ * Input:
+ *  - path: the image file
+ *  - from: number of the first delta to remove
+ */
+void image_remove_deltas(const char *path, int from) {
+    char deltaPath[PATH_MAX];
+    int last = from - 1;
+    while (image_delta_path(deltaPath, sizeof(deltaPath), path, last + 1) == SUCCESS &&
+           access(deltaPath, F_OK) == 0) {
+        last++;
+    }
+    for (int i = last; i >= from; i--) {
+        image_delta_path(deltaPath, sizeof(deltaPath), path, i);
+        if (unlink(deltaPath) == -1) {
+            perror("Error removing image delta");
+        }
+    }
+}
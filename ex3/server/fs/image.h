@@ -0,0 +1,62 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include "../../tecnicofs-api-constants.h"
+#include "directory.h"
+
+#define IMAGE_MAGIC "TFSIMAGE"
+#define IMAGE_DELTA_MAGIC "TFSDELTA"
+#define IMAGE_VERSION 3
+
+/*
+ * On-disk image of the namespace, mapped as is by a starting server.
+ * Every position is an offset from the start of the image, so it can be
+ * mapped anywhere. The header is followed by the directory tables, laid
+ * out as dir_image_size describes, and then by one record per inumber.
+ *
+ * A delta has the same layout, with its own magic, the id of the image it
+ * applies to and one ImageDelta record per i-node changed since the
+ * previous checkpoint. Deltas of an image live next to it, numbered from 1
+ * in the order they apply (see image_delta_path).
+ */
+typedef struct imageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t inodeCount;   /* records, one per inumber from 0 */
+	uint64_t inodes;       /* offset of the records */
+	uint64_t size;         /* of the whole image */
+	uint64_t lsn;          /* latest log record the image includes */
+	uint64_t id;           /* of the image, or of the image a delta applies to */
+} ImageHeader;
+
+typedef struct imageInode {
+	int32_t nodeType;
+	int32_t count;         /* live entries of a directory */
+	int32_t capacity;      /* entry slots of its table */
+	int32_t arenaSize;     /* bytes of long names of its table */
+	uint64_t table;        /* offset of its table */
+} ImageInode;
+
+typedef struct imageDelta {
+	int32_t inumber;
+	int32_t reserved;
+	ImageInode inode;
+} ImageDelta;
+
+int image_open(const char *path);
+void image_close();
+int image_inode_count();
+uint64_t image_lsn();
+uint64_t image_id();
+int image_delta_count();
+void image_load_inode(int inumber, type *nType, Directory **dir);
+int image_delta_path(char *buffer, size_t size, const char *path, int sequence);
+int image_write_base(const char *path, unsigned int gen, uint64_t lsn, uint64_t *id);
+int image_write_delta(const char *path, int sequence, uint64_t baseId, unsigned int gen,
+                      uint64_t lsn, int *inumbers, int count, size_t *bytes);
+int image_write(const char *path);
+int image_merge(const char *path, uint64_t *id);
+void image_remove_deltas(const char *path, int from);
+
+#endif /* IMAGE_H */
@@ -1,7 +1,15 @@
 #include "operations.h"
+#include "slab.h"
+#include "dcache.h"
+#include "epoch.h"
+#include "dump.h"
+#include "image.h"
+#include "wal.h"
+#include "checkpoint.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 /* Given a path, fills pointers with strings for the parent path and child
  * file name
@@ -41,46 +49,97 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 
 
 /*
- * Initializes tecnicofs and creates root node.
+ * Initializes tecnicofs from its image, or else creates the root node,
+ * and then replays the log over it.
+ * Input:
+ *  - imagePath: the image file, or NULL
+ *  - logPath: the log file, or NULL to not log operations
+ *  - syncPolicy: when operations wait for their records to be durable
+ *  - checkpointMs: time between checkpoints to the image, or 0 for none
  */
-void init_fs() {
+void init_fs(const char *imagePath, const char *logPath, int syncPolicy, int checkpointMs) {
 
+	bool mapped = imagePath && image_open(imagePath) == SUCCESS;
 	inode_table_init();
+	dcache_init();
+	snapshot_init();
 	
-	/* create root inode */
-	int root = inode_create(T_DIRECTORY);
-	unlock(root);
+	if (!mapped) {
+		/* create root inode */
+		int root = inode_create(T_DIRECTORY);
+		unlock(root);
+
+		if (root != FS_ROOT) {
+			printf("failed to create node for tecnicofs root\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	if (root != FS_ROOT) {
-		printf("failed to create node for tecnicofs root\n");
-		exit(EXIT_FAILURE);
+	if (logPath) {
+		uint64_t lsn = wal_replay(logPath, image_lsn());
+		wal_open(logPath, syncPolicy, lsn);
 	}
+	checkpoint_init(imagePath, checkpointMs);
+
+	/* every operation goes through the root */
+	inode_make_hot(FS_ROOT);
 }
 
 /*
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	/* the directories and tables this thread retired, which no one else frees */
+	epoch_synchronize();
+	checkpoint_destroy();
+	wal_close();
 	inode_table_destroy();
+	snapshot_destroy();
+	image_close();
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: the directory
  * Returns: SUCCESS or FAIL
  */
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL || dir->count != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
+	return SUCCESS;
+}
+
+/*
+ * Looks for a child of a directory, through the dentry cache.
+ * The caller must hold a lock on the parent.
+ * Input:
+ *  - parent_inumber: inumber of the parent
+ *  - pType: type of the parent
+ *  - pdata: data of the parent
+ *  - name: name of the child
+ * Returns:
+ *  inumber: identifier of the child, if found
+ *     FAIL: otherwise
+ */
+int lookup_child(int parent_inumber, type pType, union Data pdata, char *name) {
+	if (pType != T_DIRECTORY) {
+		return FAIL;
+	}
+
+	int length = strlen(name);
+	uint32_t hash = name_hash(name);
+	int child_inumber = dcache_lookup(parent_inumber, name, length, hash);
+
+	if (child_inumber == FAIL) {
+		child_inumber = dir_lookup_hashed(pdata.dir, name, length, hash);
+		if (child_inumber != FAIL) {
+			dcache_insert(parent_inumber, inode_at(parent_inumber)->generation, name, length, hash, child_inumber);
 		}
 	}
-	return SUCCESS;
+	return child_inumber;
 }
 
 /**
@@ -91,9 +150,13 @@ int is_dir_empty(DirEntry *dirEntries) {
  * Returns: SUCCESS or FAIL
  */
 int create_aux(char *name, type nodeType) {
-	int activeLocks[INODE_TABLE_SIZE], numActiveLocks = 0;
-	int retVal = create(name, nodeType, activeLocks, &numActiveLocks);
-	unlockAll(activeLocks, numActiveLocks);
+	lock_set locks;
+	lock_set_init(&locks);
+	snapshot_enter();
+	int retVal = create(name, nodeType, &locks);
+	lock_set_release_all(&locks);
+	snapshot_exit();
+	wal_commit();
 	return retVal;
 }
 
@@ -102,11 +165,10 @@ int create_aux(char *name, type nodeType) {
  * Input:
  *  - name: path of node
  *  - nodeType: type of node
- *  - activeLocks: array containing active locks
- *  - numActiveLocks: activeLocks's length
+ *  - locks: locks held by the operation
  * Returns: SUCCESS or FAIL
  */
-int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks) {
+int create(char *name, type nodeType, lock_set *locks) {
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
 	/* use for copy */
@@ -118,7 +180,7 @@ int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks) {
 	/* idem to file */
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name, activeLocks, numActiveLocks, true);
+	parent_inumber = lookup(parent_name, locks, true);
 
 	if (parent_inumber == FAIL) {
 		printf("failed to create %s, invalid parent dir %s\n",
@@ -137,7 +199,7 @@ int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks) {
 	}
 
 	/* if file already exists, can't create it */
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
+	if (lookup_child(parent_inumber, pType, pdata, child_name) != FAIL) {
 		printf("failed to create %s, already exists in dir %s\n",
 		       child_name, parent_name);
 		return FAIL;
@@ -153,7 +215,7 @@ int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks) {
 		return FAIL;
 	}
 
-	activeLocks[(*numActiveLocks)++] = child_inumber;
+	lock_set_add(locks, child_inumber);
 
 	/* add entry to parent directory */
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
@@ -162,6 +224,7 @@ int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks) {
 		return FAIL;
 	}
 
+	wal_log_create(parent_inumber, child_inumber, child_name, nodeType);
 	return SUCCESS;
 }
 
@@ -172,9 +235,13 @@ int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks) {
  * Returns: SUCCESS or FAIL
  */
 int delete_aux(char *name) {
-	int activeLocks[INODE_TABLE_SIZE], numActiveLocks = 0;
-	int retVal = delete(name, activeLocks, &numActiveLocks);
-	unlockAll(activeLocks, numActiveLocks);
+	lock_set locks;
+	lock_set_init(&locks);
+	snapshot_enter();
+	int retVal = delete(name, &locks);
+	lock_set_release_all(&locks);
+	snapshot_exit();
+	wal_commit();
 	return retVal;
 }
 
@@ -182,11 +249,10 @@ int delete_aux(char *name) {
  * Deletes a node given a path.
  * Input:
  *  - name: path of node
- *  - activeLocks: array containing active locks
- *  - numActiveLocks: activeLocks's length
+ *  - locks: locks held by the operation
  * Returns: SUCCESS or FAIL
  */
-int delete(char * name, int * activeLocks, int * numActiveLocks) {
+int delete(char * name, lock_set * locks) {
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
 
@@ -197,7 +263,7 @@ int delete(char * name, int * activeLocks, int * numActiveLocks) {
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-	parent_inumber = lookup(parent_name, activeLocks, numActiveLocks, true);
+	parent_inumber = lookup(parent_name, locks, true);
 
 	if (parent_inumber == FAIL) {
 		printf("failed to delete %s, invalid parent dir %s\n",
@@ -213,7 +279,7 @@ int delete(char * name, int * activeLocks, int * numActiveLocks) {
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_child(parent_inumber, pType, pdata, child_name);
 
 	if (child_inumber == FAIL) {
 		printf("could not delete %s, does not exist in dir %s\n",
@@ -221,19 +287,18 @@ int delete(char * name, int * activeLocks, int * numActiveLocks) {
 		return FAIL;
 	}
 
-	lock(child_inumber, WRITE);
-	activeLocks[(*numActiveLocks)++] = child_inumber;
+	lock_set_acquire(locks, child_inumber, WRITE);
 
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
 		printf("could not delete %s: is a directory and not empty\n",
 		       name);
 		return FAIL;
 	}
 
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
 		printf("failed to delete %s from dir %s\n",
 		       child_name, parent_name);
 		return FAIL;
@@ -245,24 +310,18 @@ int delete(char * name, int * activeLocks, int * numActiveLocks) {
 		return FAIL;
 	}
 
+	wal_log_delete(parent_inumber, child_inumber, child_name);
 	return SUCCESS;
 }
 
-/**
- * Checks if inumber is currently locked.
- * Input:
- *  - inumber: number being checked
- *  - activeLocks: array containing active locks
- *  - numActiveLocks: activeLocks's length
+/* Lock-free lookups retried before falling back to locks */
+#define LOOKUP_RCU_ATTEMPTS 3
+
+/*
+ * Transactions being applied, and applied so far. A lock-free lookup that
+ * overlaps a transaction may see part of it, so it is retried.
  */
-int isLocked(int inumber, int * activeLocks, int numActiveLocks) {
-	for (int i = 0; i < numActiveLocks; ++i) {
-		if (activeLocks[i] == inumber) {
-			return 1;
-		}
-	}
-	return 0;
-}
+static unsigned long txn_active = 0, txn_done = 0;
 
 /*
  * Calls lookup function with local variables.
@@ -273,67 +332,202 @@ int isLocked(int inumber, int * activeLocks, int numActiveLocks) {
  *     FAIL: otherwise
  */
 int lookup_aux(char * name) {
-	int activeLocks[INODE_TABLE_SIZE], numActiveLocks = 0;
-	int search = lookup(name, activeLocks, &numActiveLocks, false);
-	unlockAll(activeLocks, numActiveLocks);
+	return lookup_hashed_aux(name, NULL, 0);
+}
+
+/*
+ * Calls lookup function with local variables, given the hashes of the
+ * path components, as sent by the client.
+ * Input:
+ *  - name: path of node
+ *  - hashes: hashes of its first components, or NULL
+ *  - hashCount: number of hashes
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup_hashed_aux(char *name, const uint32_t *hashes, int hashCount) {
+	for (int attempt = 0; attempt < LOOKUP_RCU_ATTEMPTS; attempt++) {
+		bool valid;
+		int search = lookup_rcu(name, hashes, hashCount, &valid);
+		if (valid) {
+			return search;
+		}
+	}
+
+	/* the path keeps changing under the lock-free walk */
+	lock_set locks;
+	lock_set_init(&locks);
+	int search = lookup(name, &locks, false);
+	lock_set_release_all(&locks);
 	return search;
 }
 
 /*
- * Lookup for a given path.
+ * Lookup for a given path without taking locks.
+ * Directories are read inside an epoch read section, through the dentry
+ * cache first. The walk is validated by checking that no directory on the
+ * path changed its generation since it was probed, so the result held at
+ * the end of the walk, and that no transaction was applied meanwhile.
  * Input:
  *  - name: path of node
- *  - activeLocks: array containing active locks
- *  - numActiveLocks: activeLocks's length
- *  - write: if true, the last node on lock will be locked on WRITE
+ *  - hashes: hashes of its first components, or NULL to compute them;
+ *    a wrong hash only makes the walk miss
+ *  - hashCount: number of hashes
+ *  - valid: set to false if a concurrent change invalidated the walk
  * Returns:
  *  inumber: identifier of the i-node, if found
  *     FAIL: otherwise
  */
-int lookup(char *name, int * activeLocks, int * numActiveLocks, bool write) {
+int lookup_rcu(char *name, const uint32_t *hashes, int hashCount, bool *valid) {
 	char full_path[MAX_FILE_NAME];
 	char delim[] = "/";
 	char * saveptr;
-	
+	int parents[MAX_PATH_DEPTH], numParents = 0;
+	unsigned int generations[MAX_PATH_DEPTH];
+
 	strcpy(full_path, name);
+	unsigned long done = __atomic_load_n(&txn_done, __ATOMIC_SEQ_CST);
+	*valid = __atomic_load_n(&txn_active, __ATOMIC_SEQ_CST) == 0;
 
-	/* start at root node */
+	epoch_enter();
 	int current_inumber = FS_ROOT;
-	/* use for copy */
+	for (char *path = strtok_r(full_path, delim, &saveptr); path && current_inumber != FAIL;
+	     path = strtok_r(NULL, delim, &saveptr)) {
+		if (numParents == MAX_PATH_DEPTH) {
+			current_inumber = FAIL;
+			break;
+		}
+		inode_t *inode = inode_at(current_inumber);
+		unsigned int generation = __atomic_load_n(&inode->generation, __ATOMIC_ACQUIRE);
+		parents[numParents] = current_inumber;
+		generations[numParents++] = generation;
+
+		int length = strlen(path);
+		uint32_t hash = numParents <= hashCount ? hashes[numParents - 1] : name_hash(path);
+		int child_inumber = dcache_lookup(current_inumber, path, length, hash);
+		if (child_inumber == FAIL) {
+			Directory *dir = __atomic_load_n(&inode->data.dir, __ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&inode->nodeType, __ATOMIC_ACQUIRE) == T_DIRECTORY && dir) {
+				child_inumber = dir_lookup_hashed(dir, path, length, hash);
+			}
+			/* stale if the directory changed since generation was read */
+			if (child_inumber != FAIL) {
+				dcache_insert(current_inumber, generation, path, length, hash, child_inumber);
+			}
+		}
+		current_inumber = child_inumber;
+	}
+
+	/* every entry was valid at the end of the walk */
+	for (int i = 0; i < numParents; i++) {
+		if (__atomic_load_n(&inode_at(parents[i])->generation, __ATOMIC_ACQUIRE) != generations[i]) {
+			*valid = false;
+		}
+	}
+	if (__atomic_load_n(&txn_active, __ATOMIC_SEQ_CST) || __atomic_load_n(&txn_done, __ATOMIC_SEQ_CST) != done) {
+		*valid = false;
+	}
+	epoch_exit();
+	return current_inumber;
+}
+
+/*
+ * Splits a path into its components.
+ * Input:
+ *  - path: the path to split. ATTENTION: the function alters this parameter
+ *  - components: array to store the components
+ * Returns: number of components, or FAIL if the path is too deep
+ */
+int split_path(char *path, char **components) {
+	char delim[] = "/";
+	char * saveptr;
+	int n = 0;
+
+	for (char *c = strtok_r(path, delim, &saveptr); c; c = strtok_r(NULL, delim, &saveptr)) {
+		if (n == MAX_PATH_DEPTH) {
+			return FAIL;
+		}
+		components[n++] = c;
+	}
+	return n;
+}
+
+/*
+ * Walks down from a locked directory with hand-over-hand locking: each
+ * i-node is locked before its parent is released, so that the walk never
+ * holds more than two locks of its own. I-nodes that were already in the
+ * lock set when reached are left locked, as an earlier step of the
+ * operation needs them.
+ * Input:
+ *  - start: inumber of the first i-node, locked or to be locked
+ *  - components: names to follow from start
+ *  - n: number of components
+ *  - locks: locks held by the operation
+ *  - write: if true, the last node will be locked on WRITE
+ * Returns:
+ *  inumber: identifier of the last i-node, left locked, if found
+ *     FAIL: otherwise
+ */
+int lookup_from(int start, char **components, int n, lock_set *locks, bool write) {
+	int current_inumber = start;
+	bool acquired = false;
 	type nType;
 	union Data data;
-	char *path = strtok_r(full_path, delim, &saveptr);
 
 	/* Avoid double locks and validate current_inumber's ~lock status */
-	if (!isLocked(current_inumber, activeLocks, *numActiveLocks)) {
-		if (!path && write) {
-			lock(current_inumber, WRITE);
-		} else {
-			lock(current_inumber, READ);
-		}
-		activeLocks[(*numActiveLocks)++] = current_inumber;
+	if (!lock_set_contains(locks, current_inumber)) {
+		lock_set_acquire(locks, current_inumber, (n == 0 && write) ? WRITE : READ);
+		acquired = true;
 	}
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
+	for (int i = 0; i < n; i++) {
+		inode_get(current_inumber, &nType, &data);
+		int child_inumber = lookup_child(current_inumber, nType, data, components[i]);
+		if (child_inumber == FAIL) {
+			return FAIL;
+		}
 
-	/* search for all sub nodes */
-	while (path && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		path = strtok_r(NULL, delim, &saveptr);
-		if (!isLocked(current_inumber, activeLocks, *numActiveLocks)) {
-			if (!path && write) {
-				lock(current_inumber, WRITE);
-			} else {
-				lock(current_inumber, READ);
-			}
-			activeLocks[(*numActiveLocks)++] = current_inumber;
+		bool child_acquired = false;
+		if (!lock_set_contains(locks, child_inumber)) {
+			lock_set_acquire(locks, child_inumber, (i == n - 1 && write) ? WRITE : READ);
+			child_acquired = true;
 		}
-		inode_get(current_inumber, &nType, &data);
+		/* the child is locked, so its parent is no longer needed */
+		if (acquired) {
+			lock_set_release(locks, current_inumber);
+		}
+		current_inumber = child_inumber;
+		acquired = child_acquired;
 	}
 
 	return current_inumber;
 }
 
+/*
+ * Lookup for a given path.
+ * Input:
+ *  - name: path of node
+ *  - locks: locks held by the operation
+ *  - write: if true, the last node on lock will be locked on WRITE
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup(char *name, lock_set *locks, bool write) {
+	char full_path[MAX_FILE_NAME];
+	char *components[MAX_PATH_DEPTH];
+
+	strcpy(full_path, name);
+	int n = split_path(full_path, components);
+	if (n == FAIL) {
+		return FAIL;
+	}
+
+	/* start at root node */
+	return lookup_from(FS_ROOT, components, n, locks, write);
+}
+
 /**
  * Calls move function with local variables
  * Input:
@@ -342,41 +536,117 @@ int lookup(char *name, int * activeLocks, int * numActiveLocks, bool write) {
  * Returns: SUCCESS or FAIL
  */
 int move_aux(char * oldPath, char * newPath) {
-	int activeLocks[INODE_TABLE_SIZE], numActiveLocks = 0;
-	int search = move(oldPath, newPath, activeLocks, &numActiveLocks);
-	unlockAll(activeLocks, numActiveLocks);
+	lock_set locks;
+	bool renaming;
+	lock_set_init(&locks);
+	snapshot_enter();
+	int search = move(oldPath, newPath, &locks, &renaming);
+	lock_set_release_all(&locks);
+	if (renaming) {
+		rename_unlock();
+	}
+	snapshot_exit();
+	wal_commit();
 	return search;
 }
 
+/*
+ * Serializes moves between different directories, so that the path checks
+ * that keep a directory from being moved into itself cannot be invalidated
+ * by another move. The owner of a partition moves alone below the root,
+ * which it still locks, so it skips this too.
+ */
+static pthread_mutex_t rename_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void rename_lock() {
+	if (lock_partition_alone()) {
+		return;
+	}
+	if (pthread_mutex_lock(&rename_mutex)) {
+		fprintf(stderr, "Error locking rename mutex!\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void rename_unlock() {
+	if (lock_partition_alone()) {
+		return;
+	}
+	if (pthread_mutex_unlock(&rename_mutex)) {
+		fprintf(stderr, "Error unlocking rename mutex!\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
 /*
  * Moves a node from a given path to another given path.
+ * Both parents are reached from their deepest common ancestor, which stays
+ * read locked (or write locked, if it is one of the parents) so that the
+ * entries leading to each parent cannot change. Every other ancestor is
+ * released on the way down.
  * Input:
  *  - oldPath: path of node to be moved. 
  *  - newPath: path where i-node will be moved to
- *  - activeLocks: array containing active locks
- *  - numActiveLocks: activeLocks's length
+ *  - locks: locks held by the operation
+ *  - renaming: set to true if the rename mutex is held and must be unlocked
  * Returns: SUCCESS or FAIL
  */
-int move(char * oldPath, char * newPath, int * activeLocks, int * numActiveLocks) {
+int move(char * oldPath, char * newPath, lock_set * locks, bool * renaming) {
 	char *old_parent_name, *old_child_name, oldPath_copy[MAX_FILE_NAME];
 	char *new_parent_name, *new_child_name, newPath_copy[MAX_FILE_NAME];
-	int old_parent_inumber, new_parent_inumber, moving_inumber;
+	char old_parent_copy[MAX_FILE_NAME], new_parent_copy[MAX_FILE_NAME];
+	char *old_components[MAX_PATH_DEPTH], *new_components[MAX_PATH_DEPTH];
+	int old_parent_inumber, new_parent_inumber, moving_inumber, common_inumber;
+	int old_depth, new_depth, common_depth = 0;
 	union Data old_pdata, new_pdata;
 	type old_pType, new_pType;
 
+	*renaming = false;
+
 	strcpy(oldPath_copy, oldPath);
 	split_parent_child_from_path(oldPath_copy, &old_parent_name, &old_child_name);
 
 	strcpy(newPath_copy, newPath);
 	split_parent_child_from_path(newPath_copy, &new_parent_name, &new_child_name);
 
-	/* Alphabetical way to order locks */
-	if (strcmp(old_parent_name, new_parent_name) < 0) {
-		old_parent_inumber = lookup(old_parent_name, activeLocks, numActiveLocks, true);
-		new_parent_inumber = lookup(new_parent_name, activeLocks, numActiveLocks, true);		 
+	strcpy(old_parent_copy, old_parent_name);
+	strcpy(new_parent_copy, new_parent_name);
+	old_depth = split_path(old_parent_copy, old_components);
+	new_depth = split_path(new_parent_copy, new_components);
+	if (old_depth == FAIL || new_depth == FAIL) {
+		printf("failed to move, invalid input paths\n");
+		return FAIL;
+	}
+
+	while (common_depth < old_depth && common_depth < new_depth &&
+	       strcmp(old_components[common_depth], new_components[common_depth]) == 0) {
+		common_depth++;
+	}
+
+	/* oldPath & newPath -> a directory can't be moved into itself */
+	if (common_depth == old_depth && new_depth > old_depth &&
+	    strcmp(new_components[old_depth], old_child_name) == 0) {
+		printf("failed to move, can't move directory to itself\n");
+		return FAIL;
+	}
+
+	if (common_depth == old_depth && common_depth == new_depth) {
+		/* same parent: a rename can't change any i-node's ancestors */
+		old_parent_inumber = new_parent_inumber = lookup_from(FS_ROOT, old_components, old_depth, locks, true);
 	} else {
-		new_parent_inumber = lookup(new_parent_name, activeLocks, numActiveLocks, true);
-		old_parent_inumber = lookup(old_parent_name, activeLocks, numActiveLocks, true);
+		rename_lock();
+		*renaming = true;
+
+		bool common_is_parent = common_depth == old_depth || common_depth == new_depth;
+		common_inumber = lookup_from(FS_ROOT, old_components, common_depth, locks, common_is_parent);
+		if (common_inumber == FAIL) {
+			printf("failed to move, invalid input paths\n");
+			return FAIL;
+		}
+		old_parent_inumber = lookup_from(common_inumber, old_components + common_depth,
+		                                 old_depth - common_depth, locks, true);
+		new_parent_inumber = lookup_from(common_inumber, new_components + common_depth,
+		                                 new_depth - common_depth, locks, true);
 	}
 
 	/* Invalid paths */
@@ -395,13 +665,13 @@ int move(char * oldPath, char * newPath, int * activeLocks, int * numActiveLocks
 	}
 
 	/* newPath -> parent directory contains an entry with same name as the moving i-node */
-	if (lookup_sub_node(new_child_name, new_pdata.dirEntries) != FAIL) {
+	if (lookup_child(new_parent_inumber, new_pType, new_pdata, new_child_name) != FAIL) {
 		printf("failed to move, new parent directory already contains an entry named %s\n", old_child_name);
 		return FAIL;
 	}
 
 	/* oldPath -> check if moving i-node exists */
-	if ((moving_inumber = lookup_sub_node(old_child_name, old_pdata.dirEntries)) == FAIL) {
+	if ((moving_inumber = lookup_child(old_parent_inumber, old_pType, old_pdata, old_child_name)) == FAIL) {
 		printf("failed to move, old parent directory doesn't contain an entry named %s\n", old_child_name);
 		return FAIL;
 	}
@@ -413,7 +683,7 @@ int move(char * oldPath, char * newPath, int * activeLocks, int * numActiveLocks
 	}
 
 	/* reset oldPath entry and add new entry to newPath */
-	if (dir_reset_entry(old_parent_inumber, moving_inumber) == FAIL) {
+	if (dir_reset_entry(old_parent_inumber, moving_inumber, old_child_name) == FAIL) {
 		printf("failed to move, couldn't reset %s from dir %s\n", old_child_name, old_parent_name);
 		return FAIL;
 	}
@@ -423,19 +693,532 @@ int move(char * oldPath, char * newPath, int * activeLocks, int * numActiveLocks
 		return FAIL;
 	}
 
+	wal_log_move(old_parent_inumber, new_parent_inumber, moving_inumber, old_child_name, new_child_name);
 	return SUCCESS;
 
 }
 
+/* Wait before retrying a transaction that found one of its locks taken, in microseconds */
+#define TXN_BACKOFF_US 20
+#define TXN_MAX_BACKOFF_US 2000
+
+/* Entry created by the transaction, in its view of the namespace */
+#define TXN_CREATED -2
+
+static unsigned long txn_commits = 0, txn_aborts = 0, txn_retries = 0;
+
+/* An operation of a transaction, with its paths split and resolved */
+typedef struct txn_step {
+	char paths[2][MAX_FILE_NAME];      /* parent of each path */
+	char buffers[2][MAX_FILE_NAME];    /* each path, split into components and name */
+	char *components[2][MAX_PATH_DEPTH];
+	int depth[2];                      /* FAIL if the path is invalid */
+	char *name[2];
+	int parent[2];                     /* inumber of each parent, FAIL if missing */
+	int child;                         /* inumber of a deleted or moved entry */
+	int inumber;                       /* i-node created, deleted or moved */
+} txn_step;
+
+/* An entry changed by the operations of a transaction validated so far */
+typedef struct txn_entry {
+	int parent;
+	const char *name;
+	int inumber;                       /* FAIL if removed, TXN_CREATED if created */
+	type nType;
+} txn_entry;
+
+/* Change to the entries of a directory by a transaction */
+typedef struct txn_count {
+	int inumber;
+	int delta;
+} txn_count;
+
 /*
- * Prints tecnicofs tree.
+ * Splits one of the paths of a transaction's operation.
+ * Returns: SUCCESS or FAIL
+ */
+static int txn_split(txn_step *step, int which, char *path) {
+	char *parent_name;
+
+	step->depth[which] = FAIL;
+	if (path == NULL || path[0] == '\0' || strlen(path) >= MAX_FILE_NAME) {
+		return FAIL;
+	}
+	strcpy(step->buffers[which], path);
+	split_parent_child_from_path(step->buffers[which], &parent_name, &step->name[which]);
+	if (step->name[which][0] == '\0') {
+		return FAIL;
+	}
+	strcpy(step->paths[which], parent_name);
+	step->depth[which] = split_path(parent_name, step->components[which]);
+	return step->depth[which] == FAIL ? FAIL : SUCCESS;
+}
+
+/*
+ * Checks if the parent of a path is the entry removed by an earlier
+ * operation, or lies below it.
  * Input:
- *  - fp: pointer to output file
+ *  - step, which: the operation and its path
+ *  - removed: the earlier operation, that deleted or moved its first path
+ */
+static bool txn_below(txn_step *step, int which, txn_step *removed) {
+	int depth = removed->depth[0];
+	if (step->depth[which] <= depth) {
+		return false;
+	}
+	for (int i = 0; i < depth; i++) {
+		if (strcmp(step->components[which][i], removed->components[0][i]) != 0) {
+			return false;
+		}
+	}
+	return strcmp(step->components[which][depth], removed->name[0]) == 0;
+}
+
+/*
+ * Resolves the parents of a transaction's operations, and the entries they
+ * delete or move, without taking locks.
  */
-int print_tecnicofs_tree(FILE *fp) {
-	lock(FS_ROOT, WRITE);
-	int res = inode_print_tree(fp, FS_ROOT, "");
-	unlock(FS_ROOT);
+static void txn_resolve(txn_op *ops, txn_step *steps, int count) {
+	for (int i = 0; i < count; i++) {
+		txn_step *step = &steps[i];
+		step->parent[0] = step->parent[1] = step->child = FAIL;
+		for (int w = 0; w < (ops[i].op == 'm' ? 2 : 1); w++) {
+			if (step->depth[w] != FAIL) {
+				step->parent[w] = lookup_aux(step->paths[w]);
+			}
+		}
+		if (ops[i].op != 'c' && step->depth[0] != FAIL) {
+			step->child = lookup_aux(ops[i].path);
+		}
+	}
+}
+
+/*
+ * Checks, once the transaction holds its locks, that every path it
+ * resolved still leads to the same i-node.
+ * Returns: true if the resolution still holds
+ */
+static bool txn_verify(txn_op *ops, txn_step *steps, int count) {
+	for (int i = 0; i < count; i++) {
+		txn_step *step = &steps[i];
+		for (int w = 0; w < (ops[i].op == 'm' ? 2 : 1); w++) {
+			if (step->depth[w] == FAIL) {
+				continue;
+			}
+			for (int attempt = 0; ; attempt++) {
+				bool valid;
+				int search = lookup_rcu(step->paths[w], NULL, 0, &valid);
+				if (valid && search != step->parent[w]) {
+					return false;
+				}
+				if (valid) {
+					break;
+				}
+				if (attempt == LOOKUP_RCU_ATTEMPTS) {
+					return false;
+				}
+			}
+		}
+		if (ops[i].op != 'c' && step->depth[0] != FAIL) {
+			bool valid;
+			if (lookup_rcu(ops[i].path, NULL, 0, &valid) != step->child || !valid) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static int txn_compare(const void *a, const void *b) {
+	return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * Lists the i-nodes a transaction locks: the parents of its operations and
+ * the entries they delete or move, in inumber order and without repeats.
+ * Returns: the number of i-nodes
+ */
+static int txn_lock_list(txn_op *ops, txn_step *steps, int count, int *inumbers) {
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		for (int w = 0; w < (ops[i].op == 'm' ? 2 : 1); w++) {
+			if (steps[i].parent[w] != FAIL) {
+				inumbers[n++] = steps[i].parent[w];
+			}
+		}
+		if (steps[i].child != FAIL) {
+			inumbers[n++] = steps[i].child;
+		}
+	}
+
+	qsort(inumbers, n, sizeof(int), txn_compare);
+	int unique = 0;
+	for (int i = 0; i < n; i++) {
+		if (unique == 0 || inumbers[unique - 1] != inumbers[i]) {
+			inumbers[unique++] = inumbers[i];
+		}
+	}
+	return unique;
+}
+
+/*
+ * Locks a transaction's i-nodes for writing, in inumber order. Other
+ * operations lock from the root down, so rather than wait for a lock while
+ * holding others, the transaction gives up every lock it took.
+ * Returns: true if every i-node was locked
+ */
+static bool txn_lock(int *inumbers, int n) {
+	for (int i = 0; i < n; i++) {
+		if (i == 0) {
+			lock(inumbers[i], WRITE);
+		} else if (!try_lock(inumbers[i], WRITE)) {
+			unlockAll(inumbers, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Finds an entry as the operations validated so far left it.
+ * The parent is locked by the transaction.
+ * Returns: the inumber of the entry, TXN_CREATED or FAIL
+ */
+static int txn_child(txn_entry *entries, int n, int parent, char *name, type *nType) {
+	for (int i = n - 1; i >= 0; i--) {
+		if (entries[i].parent == parent && strcmp(entries[i].name, name) == 0) {
+			*nType = entries[i].nType;
+			return entries[i].inumber;
+		}
+	}
+
+	type pType;
+	union Data pdata;
+	inode_get(parent, &pType, &pdata);
+	int child = lookup_child(parent, pType, pdata, name);
+	if (child != FAIL) {
+		union Data data;
+		inode_get(child, nType, &data);
+	}
+	return child;
+}
+
+/*
+ * Adds to the change in the entries of a directory.
+ * Returns: the change so far
+ */
+static int txn_delta(txn_count *counts, int *n, int inumber, int delta) {
+	for (int i = 0; i < *n; i++) {
+		if (counts[i].inumber == inumber) {
+			return counts[i].delta += delta;
+		}
+	}
+	counts[*n].inumber = inumber;
+	counts[*n].delta = delta;
+	return counts[(*n)++].delta;
+}
+
+/*
+ * Checks every operation of a transaction, in order, against the namespace
+ * as the operations before it would leave it. A parent must exist before
+ * the transaction, and not be below an entry an earlier operation deleted
+ * or moved.
+ * Returns: the index of the first operation that fails, or count
+ */
+static int txn_validate(txn_op *ops, txn_step *steps, int count) {
+	txn_entry *entries = malloc(sizeof(txn_entry) * 2 * count);
+	txn_count *counts = malloc(sizeof(txn_count) * 3 * count);
+	int nEntries = 0, nCounts = 0, i;
+
+	if (!entries || !counts) {
+		fprintf(stderr, "Error allocating transaction!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) {
+		txn_step *step = &steps[i];
+		bool valid = true;
+		int child, moved;
+		type nType, pType;
+		union Data data;
+
+		for (int w = 0; w < (ops[i].op == 'm' ? 2 : 1) && valid; w++) {
+			if (step->parent[w] == FAIL) {
+				valid = false;
+				break;
+			}
+			inode_get(step->parent[w], &pType, &data);
+			valid = pType == T_DIRECTORY;
+			for (int j = 0; j < i && valid; j++) {
+				valid = ops[j].op == 'c' || !txn_below(step, w, &steps[j]);
+			}
+		}
+		if (!valid) {
+			break;
+		}
+
+		if (ops[i].op == 'c') {
+			if (txn_child(entries, nEntries, step->parent[0], step->name[0], &nType) != FAIL) {
+				break;
+			}
+			entries[nEntries++] = (txn_entry) { step->parent[0], step->name[0], TXN_CREATED, ops[i].nodeType };
+			txn_delta(counts, &nCounts, step->parent[0], 1);
+		} else if (ops[i].op == 'd') {
+			if ((child = txn_child(entries, nEntries, step->parent[0], step->name[0], &nType)) == FAIL) {
+				break;
+			}
+			/* only directories without entries can be deleted */
+			if (nType == T_DIRECTORY) {
+				int entryCount = txn_delta(counts, &nCounts, child, 0);
+				if (child != TXN_CREATED) {
+					inode_get(child, &nType, &data);
+					entryCount += data.dir->count;
+				}
+				if (entryCount != 0) {
+					break;
+				}
+			}
+			entries[nEntries++] = (txn_entry) { step->parent[0], step->name[0], FAIL, T_NONE };
+			txn_delta(counts, &nCounts, step->parent[0], -1);
+		} else {
+			/* a directory can't be moved into itself */
+			if (txn_below(step, 1, step)) {
+				break;
+			}
+			if ((moved = txn_child(entries, nEntries, step->parent[0], step->name[0], &nType)) == FAIL ||
+			    moved == step->parent[1] ||
+			    txn_child(entries, nEntries, step->parent[1], step->name[1], &pType) != FAIL) {
+				break;
+			}
+			entries[nEntries++] = (txn_entry) { step->parent[0], step->name[0], FAIL, T_NONE };
+			entries[nEntries++] = (txn_entry) { step->parent[1], step->name[1], moved, nType };
+			txn_delta(counts, &nCounts, step->parent[0], -1);
+			txn_delta(counts, &nCounts, step->parent[1], 1);
+		}
+	}
+
+	free(entries);
+	free(counts);
+	return i;
+}
+
+/*
+ * Allocates the i-nodes a transaction creates, before it changes anything.
+ * Input:
+ *  - locked, n: i-nodes locked by the transaction, which the new ones join
+ * Returns: the index of the creation that failed, or count
+ */
+static int txn_prepare(txn_op *ops, txn_step *steps, int count, int *locked, int *n) {
+	for (int i = 0; i < count; i++) {
+		if (ops[i].op != 'c') {
+			continue;
+		}
+		if ((steps[i].inumber = inode_create(ops[i].nodeType)) == FAIL) {
+			for (int j = 0; j < i; j++) {
+				if (ops[j].op == 'c') {
+					inode_delete(steps[j].inumber);
+				}
+			}
+			return i;
+		}
+		locked[(*n)++] = steps[i].inumber;
+	}
+	return count;
+}
+
+/*
+ * Applies the operations of a validated transaction and logs them as one
+ * group.
+ */
+static void txn_apply(txn_op *ops, txn_step *steps, int count) {
+	int res = SUCCESS;
+
+	__atomic_add_fetch(&txn_active, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < count && res == SUCCESS; i++) {
+		txn_step *step = &steps[i];
+		type pType;
+		union Data pdata;
+
+		if (ops[i].op == 'c') {
+			res = dir_add_entry(step->parent[0], step->inumber, step->name[0]);
+			continue;
+		}
+		inode_get(step->parent[0], &pType, &pdata);
+		step->inumber = lookup_child(step->parent[0], pType, pdata, step->name[0]);
+		res = dir_reset_entry(step->parent[0], step->inumber, step->name[0]);
+		if (res == SUCCESS) {
+			res = ops[i].op == 'd' ? inode_delete(step->inumber) :
+			                         dir_add_entry(step->parent[1], step->inumber, step->name[1]);
+		}
+	}
+	__atomic_add_fetch(&txn_done, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&txn_active, 1, __ATOMIC_SEQ_CST);
+
+	/* validation left nothing that can fail */
+	if (res == FAIL) {
+		fprintf(stderr, "Error applying transaction!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	wal_group_begin();
+	for (int i = 0; i < count; i++) {
+		txn_step *step = &steps[i];
+		if (ops[i].op == 'c') {
+			wal_log_create(step->parent[0], step->inumber, step->name[0], ops[i].nodeType);
+		} else if (ops[i].op == 'd') {
+			wal_log_delete(step->parent[0], step->inumber, step->name[0]);
+		} else {
+			wal_log_move(step->parent[0], step->parent[1], step->inumber, step->name[0], step->name[1]);
+		}
+	}
+	wal_group_end();
+}
+
+/*
+ * Applies a sequence of creations, deletions and moves atomically: either
+ * every operation succeeds, or none is applied. The parents of the
+ * operations are resolved without locks, locked in inumber order and
+ * checked again; then every operation is validated before any is applied.
+ * Input:
+ *  - ops: the operations, in order
+ *  - count: number of operations, up to MAX_TXN_OPS
+ *  - results: set to the result of each operation: SUCCESS if the
+ *    transaction commits; otherwise FAIL for the operation that failed and
+ *    TECNICOFS_ERROR_OTHER for the others
+ * Returns: SUCCESS if the transaction committed, FAIL if it aborted
+ */
+int transaction_aux(txn_op *ops, int count, int *results) {
+	txn_step *steps = malloc(sizeof(txn_step) * count);
+	int *locked = malloc(sizeof(int) * 4 * count);
+	int n, failed, backoff = TXN_BACKOFF_US;
+	bool renaming = false;
+
+	if (count == 0) {
+		free(steps);
+		free(locked);
+		return SUCCESS;
+	}
+	if (!steps || !locked) {
+		fprintf(stderr, "Error allocating transaction!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (txn_split(&steps[i], 0, ops[i].path) == SUCCESS && ops[i].op == 'm' &&
+		    txn_split(&steps[i], 1, ops[i].newPath) == SUCCESS &&
+		    strcmp(steps[i].paths[0], steps[i].paths[1]) != 0) {
+			/* as in move, so that no other move invalidates the path checks */
+			renaming = true;
+		}
+	}
+
+	while (true) {
+		snapshot_enter();
+		if (renaming) {
+			rename_lock();
+		}
+		txn_resolve(ops, steps, count);
+		n = txn_lock_list(ops, steps, count, locked);
+		if (txn_lock(locked, n)) {
+			if (txn_verify(ops, steps, count)) {
+				break;
+			}
+			unlockAll(locked, n);
+		}
+		if (renaming) {
+			rename_unlock();
+		}
+		snapshot_exit();
+
+		__atomic_add_fetch(&txn_retries, 1, __ATOMIC_RELAXED);
+		usleep(backoff);
+		backoff = backoff * 2 > TXN_MAX_BACKOFF_US ? TXN_MAX_BACKOFF_US : backoff * 2;
+	}
+
+	failed = txn_validate(ops, steps, count);
+	if (failed == count) {
+		failed = txn_prepare(ops, steps, count, locked, &n);
+	}
+	if (failed == count) {
+		txn_apply(ops, steps, count);
+	}
+
+	unlockAll(locked, n);
+	if (renaming) {
+		rename_unlock();
+	}
+	snapshot_exit();
+	wal_commit();
+
+	for (int i = 0; i < count; i++) {
+		results[i] = failed == count ? SUCCESS : i == failed ? FAIL : TECNICOFS_ERROR_OTHER;
+	}
+	if (failed == count) {
+		__atomic_add_fetch(&txn_commits, 1, __ATOMIC_RELAXED);
+	} else {
+		printf("transaction aborted, operation %d (%c %s) failed\n", failed, ops[failed].op, ops[failed].path);
+		__atomic_add_fetch(&txn_aborts, 1, __ATOMIC_RELAXED);
+	}
+
+	free(steps);
+	free(locked);
+	return failed == count ? SUCCESS : FAIL;
+}
+
+/*
+ * Prints tecnicofs tree, as of a snapshot taken when the call starts.
+ * Other operations keep running while the tree is printed.
+ * Input:
+ *  - fd: output file, empty
+ */
+int print_tecnicofs_tree(int fd) {
+	unsigned int gen = snapshot_begin();
+	int res = dump_tree(fd, gen);
+	snapshot_end();
 	return res;
 }
 
+
+
+/*
+ * Saves an image of tecnicofs, as of a snapshot taken when the call starts.
+ * Input:
+ *  - path: the image file
+ * Returns: SUCCESS or FAIL
+ */
+int save_tecnicofs_image(const char *path) {
+	return checkpoint_save(path);
+}
+
+/*
+ * Checkpoints the changes since the latest checkpoint to the image.
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_fs() {
+	return checkpoint_run();
+}
+
+/*
+ * Waits for every logged operation to be durable.
+ */
+void sync_fs() {
+	wal_flush();
+}
+
+/*
+ * Prints tecnicofs internal statistics.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void print_fs_stats(FILE *fp) {
+	slab_print_stats(fp);
+	fprintf(fp, "locks: %d i-nodes using big-reader locks\n", inode_hot_count());
+	wal_print_stats(fp);
+	checkpoint_print_stats(fp);
+
+	unsigned long commits = __atomic_load_n(&txn_commits, __ATOMIC_RELAXED);
+	unsigned long aborts = __atomic_load_n(&txn_aborts, __ATOMIC_RELAXED);
+	fprintf(fp, "transactions: %lu committed, %lu aborted (%.1f%%), %lu retried for locks\n",
+	        commits, aborts, commits + aborts ? 100.0 * aborts / (commits + aborts) : 0.0,
+	        __atomic_load_n(&txn_retries, __ATOMIC_RELAXED));
+}
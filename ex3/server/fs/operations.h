@@ -2,18 +2,40 @@
 #define FS_H
 #include "state.h"
 
-void init_fs();
+/* Operations of one transaction */
+#define MAX_TXN_OPS 256
+
+/* An operation of a transaction: 'c'reate, 'd'elete or 'm'ove */
+typedef struct txn_op {
+	char op;
+	type nodeType;   /* of a created node */
+	char *path;
+	char *newPath;   /* of a moved node */
+} txn_op;
+
+void init_fs(const char *imagePath, const char *logPath, int syncPolicy, int checkpointMs);
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(Directory *dir);
 int create_aux(char *name, type nodeType);
-int create(char *name, type nodeType, int *activeLocks, int *numActiveLocks);
+int create(char *name, type nodeType, lock_set *locks);
 int delete_aux(char *name);
-int delete(char * name, int * activeLocks, int * numActiveLocks);
+int delete(char * name, lock_set * locks);
 int lookup_aux(char * name);
-int lookup(char *name, int * activeLocks, int * numActiveLocks, bool write);
-int lookup_move(char *name, int * activeLocks, int * numActiveLocks, int * flag);
+int lookup_hashed_aux(char *name, const uint32_t *hashes, int hashCount);
+int lookup_rcu(char *name, const uint32_t *hashes, int hashCount, bool *valid);
+int lookup_child(int parent_inumber, type pType, union Data pdata, char *name);
+int split_path(char *path, char **components);
+int lookup_from(int start, char **components, int n, lock_set *locks, bool write);
+int lookup(char *name, lock_set *locks, bool write);
 int move_aux(char* oldPath, char* newPath);
-int move(char* oldPath, char* newPath, int* activeLocks, int* numActiveLocks);
-int print_tecnicofs_tree(FILE *fp);
+void rename_lock();
+void rename_unlock();
+int move(char* oldPath, char* newPath, lock_set* locks, bool* renaming);
+int transaction_aux(txn_op *ops, int count, int *results);
+int print_tecnicofs_tree(int fd);
+int save_tecnicofs_image(const char *path);
+int checkpoint_fs();
+void sync_fs();
+void print_fs_stats(FILE *fp);
 
 #endif /* FS_H */
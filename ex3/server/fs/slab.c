@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "slab.h"
+
+/* Free objects are linked through their first word */
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object;
+
+/* Shared pool of free objects of one size class */
+typedef struct slab_depot {
+    pthread_mutex_t mutex;
+    slab_object *free;
+    long numFree;
+    long numObjects;
+    long numChunks;
+} slab_depot;
+
+/* Free objects kept by each thread, and its allocation counters */
+typedef struct slab_cache {
+    slab_object *free[SLAB_CLASSES];
+    int numFree[SLAB_CLASSES];
+    long allocs[SLAB_CLASSES];
+    long frees[SLAB_CLASSES];
+    struct slab_cache *next;
+} slab_cache;
+
+static slab_depot depots[SLAB_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+
+/* Registered thread caches, for the statistics */
+static pthread_mutex_t caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static slab_cache *caches = NULL;
+/* Counters of threads that already exited */
+static long retiredAllocs[SLAB_CLASSES], retiredFrees[SLAB_CLASSES];
+/* Allocations bigger than SLAB_MAX_SIZE */
+static long largeAllocs = 0, largeFrees = 0;
+
+static __thread slab_cache *thread_cache = NULL;
+
+/*
+ * Returns the size class of an allocation.
+ */
+static int slab_class(size_t size) {
+    if (size <= SLAB_MIN_SIZE) {
+        return 0;
+    }
+    /* smallest power of two that holds size, and the 3/4 class below it */
+    int shift = 64 - __builtin_clzl(size - 1);
+    int cls = 2 * (shift - SLAB_MIN_SHIFT);
+    if (size <= (3UL << (shift - 2))) {
+        cls--;
+    }
+    return cls;
+}
+
+/*
+ * Returns the object size of a size class.
+ */
+static size_t slab_class_size(int cls) {
+    return (size_t) ((cls % 2) ? 3 * SLAB_MIN_SIZE / 2 : SLAB_MIN_SIZE) << (cls / 2);
+}
+
+static void slab_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex)) {
+        fprintf(stderr, "Error locking slab mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void slab_unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex)) {
+        fprintf(stderr, "Error unlocking slab mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Moves up to count objects of a thread cache back to the depot.
+ */
+static void slab_flush(slab_cache *cache, int cls, int count) {
+    slab_depot *depot = &depots[cls];
+    slab_lock(&depot->mutex);
+    while (count-- > 0 && cache->free[cls]) {
+        slab_object *object = cache->free[cls];
+        cache->free[cls] = object->next;
+        cache->numFree[cls]--;
+        object->next = depot->free;
+        depot->free = object;
+        depot->numFree++;
+    }
+    slab_unlock(&depot->mutex);
+}
+
+/*
+ * Returns every cached object of an exiting thread and retires its counters.
+ */
+static void slab_cache_destroy(void *arg) {
+    slab_cache *cache = arg;
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        slab_flush(cache, cls, cache->numFree[cls]);
+    }
+
+    slab_lock(&caches_mutex);
+    for (slab_cache **c = &caches; *c; c = &(*c)->next) {
+        if (*c == cache) {
+            *c = cache->next;
+            break;
+        }
+    }
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        retiredAllocs[cls] += cache->allocs[cls];
+        retiredFrees[cls] += cache->frees[cls];
+    }
+    slab_unlock(&caches_mutex);
+    free(cache);
+    thread_cache = NULL;
+}
+
+static void slab_init() {
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        if (pthread_mutex_init(&depots[cls].mutex, NULL)) {
+            fprintf(stderr, "Error initializing slab mutex!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pthread_key_create(&slab_key, slab_cache_destroy)) {
+        fprintf(stderr, "Error creating slab thread key!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the calling thread's cache, creating it on first use.
+ */
+static slab_cache *slab_get_cache() {
+    if (thread_cache) {
+        return thread_cache;
+    }
+    pthread_once(&slab_once, slab_init);
+
+    slab_cache *cache = calloc(1, sizeof(slab_cache));
+    if (!cache) {
+        fprintf(stderr, "Error allocating slab cache!\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_setspecific(slab_key, cache);
+
+    slab_lock(&caches_mutex);
+    cache->next = caches;
+    caches = cache;
+    slab_unlock(&caches_mutex);
+
+    thread_cache = cache;
+    return cache;
+}
+
+/*
+ * Refills a thread cache with a batch of objects from the depot,
+ * carving a new chunk if the depot is empty.
+ */
+static void slab_refill(slab_cache *cache, int cls) {
+    slab_depot *depot = &depots[cls];
+    size_t size = slab_class_size(cls);
+
+    slab_lock(&depot->mutex);
+    if (!depot->free) {
+        char *chunk = malloc(SLAB_CHUNK_SIZE);
+        if (!chunk) {
+            fprintf(stderr, "Error allocating slab chunk!\n");
+            exit(EXIT_FAILURE);
+        }
+        /* chunks are never returned to the system */
+        for (size_t offset = 0; offset + size <= SLAB_CHUNK_SIZE; offset += size) {
+            slab_object *object = (slab_object *) (chunk + offset);
+            object->next = depot->free;
+            depot->free = object;
+            depot->numFree++;
+            depot->numObjects++;
+        }
+        depot->numChunks++;
+    }
+    for (int i = 0; i < SLAB_BATCH && depot->free; i++) {
+        slab_object *object = depot->free;
+        depot->free = object->next;
+        depot->numFree--;
+        object->next = cache->free[cls];
+        cache->free[cls] = object;
+        cache->numFree[cls]++;
+    }
+    slab_unlock(&depot->mutex);
+}
+
+/*
+ * Allocates memory from the slab of the size's class.
+ * Input:
+ *  - size: bytes to allocate
+ * Returns: pointer to the memory
+ */
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        void *ptr = malloc(size);
+        if (!ptr) {
+            fprintf(stderr, "Error allocating memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_add_fetch(&largeAllocs, 1, __ATOMIC_RELAXED);
+        return ptr;
+    }
+
+    int cls = slab_class(size);
+    slab_cache *cache = slab_get_cache();
+    if (!cache->free[cls]) {
+        slab_refill(cache, cls);
+    }
+    slab_object *object = cache->free[cls];
+    cache->free[cls] = object->next;
+    cache->numFree[cls]--;
+    cache->allocs[cls]++;
+    return object;
+}
+
+/*
+ * Returns memory to the slab of the size's class.
+ * Input:
+ *  - ptr: memory returned by slab_alloc, or NULL
+ *  - size: the size passed to slab_alloc
+ */
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    if (size > SLAB_MAX_SIZE) {
+        __atomic_add_fetch(&largeFrees, 1, __ATOMIC_RELAXED);
+        free(ptr);
+        return;
+    }
+
+    int cls = slab_class(size);
+    slab_cache *cache = slab_get_cache();
+    slab_object *object = ptr;
+    object->next = cache->free[cls];
+    cache->free[cls] = object;
+    cache->numFree[cls]++;
+    cache->frees[cls]++;
+    if (cache->numFree[cls] > SLAB_CACHE_MAX) {
+        slab_flush(cache, cls, SLAB_BATCH);
+    }
+}
+
+/*
+ * Prints the slab utilisation of every size class in use.
+ * Counters of running threads are read without synchronization,
+ * so the figures are approximate.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void slab_print_stats(FILE *fp) {
+    pthread_once(&slab_once, slab_init);
+    fprintf(fp, "slab: %8s %8s %10s %10s %10s %6s\n", "size", "chunks", "objects", "in use", "cached", "util");
+
+    slab_lock(&caches_mutex);
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        long allocs = retiredAllocs[cls], frees = retiredFrees[cls], cached = 0;
+        for (slab_cache *cache = caches; cache; cache = cache->next) {
+            allocs += cache->allocs[cls];
+            frees += cache->frees[cls];
+            cached += cache->numFree[cls];
+        }
+
+        slab_depot *depot = &depots[cls];
+        slab_lock(&depot->mutex);
+        long chunks = depot->numChunks, objects = depot->numObjects;
+        slab_unlock(&depot->mutex);
+
+        if (chunks == 0) {
+            continue;
+        }
+        long inUse = allocs - frees;
+        fprintf(fp, "slab: %8zu %8ld %10ld %10ld %10ld %5.1f%%\n", slab_class_size(cls), chunks, objects,
+                inUse, cached, 100.0 * inUse / objects);
+    }
+    slab_unlock(&caches_mutex);
+
+    fprintf(fp, "slab: large allocations in use: %ld\n",
+            __atomic_load_n(&largeAllocs, __ATOMIC_RELAXED) - __atomic_load_n(&largeFrees, __ATOMIC_RELAXED));
+}
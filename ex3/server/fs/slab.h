@@ -0,0 +1,28 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Size classes are 16, 24, 32, 48, 64, 96, ... bytes, up to 64KB, so that
+ * directory entry arrays (24 bytes per slot, power of two slots), indexes
+ * and arenas fit exactly. Bigger requests go straight to malloc.
+ */
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MIN_SIZE (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE (1 << 16)
+#define SLAB_CLASSES 25
+
+/* Memory carved into objects of one class at a time */
+#define SLAB_CHUNK_SIZE (256 * 1024)
+/* Objects moved between a thread cache and the shared depot at once */
+#define SLAB_BATCH 32
+/* Objects a thread cache keeps per class before returning a batch */
+#define SLAB_CACHE_MAX (2 * SLAB_BATCH)
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+void slab_print_stats(FILE *fp);
+
+#endif /* SLAB_H */
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "snapshot.h"
+#include "state.h"
+#include "wal.h"
+
+/*
+ * Copy-on-write snapshots of the namespace. Operations that change the
+ * namespace run inside the snapshot gate, read locked, so taking a snapshot
+ * only waits for the operations already running. Starting a snapshot bumps
+ * the snapshot generation; from then on, the first change to an i-node
+ * that the dump has not read yet preserves its previous state first (see
+ * inode_preserve), and the dump reads either that copy or the untouched
+ * live i-node.
+ */
+
+static brlock *gate;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int generation = 0;
+/* Set from snapshot_begin to snapshot_end */
+static bool running = false;
+static uint64_t snapshot_lsn = 0;
+
+/*
+ * Initializes the snapshot gate.
+ */
+void snapshot_init() {
+    gate = brlock_create();
+    generation = 0;
+}
+
+/*
+ * Releases the snapshot gate.
+ */
+void snapshot_destroy() {
+    brlock_destroy(gate);
+    gate = NULL;
+}
+
+/*
+ * Enters the gate, before an operation that changes the namespace.
+ * The owner of a partition locks its i-nodes while a snapshot is read.
+ */
+void snapshot_enter() {
+    brlock_read_lock(gate);
+    lock_partition_share(__atomic_load_n(&running, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Leaves the gate, once the operation released its locks.
+ */
+void snapshot_exit() {
+    lock_partition_share(false);
+    brlock_unlock(gate);
+}
+
+/*
+ * Starts a snapshot, after every running operation has finished.
+ * Only one snapshot is taken at a time, until snapshot_end().
+ * Returns: the generation of the new snapshot
+ */
+unsigned int snapshot_begin() {
+    return snapshot_begin_with(NULL, NULL);
+}
+
+/*
+ * Starts a snapshot, like snapshot_begin, running a function while no
+ * operation is changing the namespace.
+ * Input:
+ *  - atGate: the function, or NULL
+ *  - arg: its argument
+ * Returns: the generation of the new snapshot
+ */
+unsigned int snapshot_begin_with(void (*atGate)(void *), void *arg) {
+    if (pthread_mutex_lock(&snapshot_mutex)) {
+        fprintf(stderr, "Error locking snapshot mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+    brlock_write_lock(gate);
+    unsigned int gen = __atomic_add_fetch(&generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&running, true, __ATOMIC_RELAXED);
+    /* operations log their records inside the gate, so none is half in */
+    snapshot_lsn = wal_last_lsn();
+    if (atGate) {
+        atGate(arg);
+    }
+    brlock_unlock(gate);
+    return gen;
+}
+
+/*
+ * Ends the current snapshot, once every i-node in it was read.
+ */
+void snapshot_end() {
+    /* after the dump read its last i-node */
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    if (pthread_mutex_unlock(&snapshot_mutex)) {
+        fprintf(stderr, "Error unlocking snapshot mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the generation of the latest snapshot.
+ * Stable for operations inside the gate.
+ */
+unsigned int snapshot_generation() {
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the lsn of the latest log record in the current snapshot.
+ */
+uint64_t snapshot_last_lsn() {
+    return snapshot_lsn;
+}
+
+/*
+ * Copies the state of an i-node. The caller must hold a lock on it.
+ * Input:
+ *  - nType: type of the i-node
+ *  - dir: its directory, NULL unless nType is T_DIRECTORY
+ * Returns: the copy
+ */
+SnapNode *snap_node_create(type nType, Directory *dir) {
+    DirTable *table = dir ? dir_table(dir) : NULL;
+    int count = 0;
+    size_t names = 0;
+
+    if (table) {
+        for (int i = 0; i < table->used; i++) {
+            if (table->entries[i].inumber != FREE_INODE) {
+                count++;
+                names += table->entries[i].length + 1;
+            }
+        }
+    }
+
+    SnapNode *node = malloc(sizeof(SnapNode) + count * sizeof(SnapEntry) + names);
+    if (!node) {
+        fprintf(stderr, "Error allocating snapshot of i-node!\n");
+        exit(EXIT_FAILURE);
+    }
+    node->nodeType = nType;
+    node->count = count;
+    node->entries = (SnapEntry *) (node + 1);
+
+    char *name = (char *) (node->entries + count);
+    int n = 0;
+    for (int i = 0; table && i < table->used; i++) {
+        DirEntry *entry = &table->entries[i];
+        if (entry->inumber != FREE_INODE) {
+            memcpy(name, dir_entry_name(table, entry), entry->length + 1);
+            node->entries[n].inumber = entry->inumber;
+            node->entries[n].length = entry->length;
+            node->entries[n].hash = entry->hash;
+            node->entries[n].name = name;
+            name += entry->length + 1;
+            n++;
+        }
+    }
+    return node;
+}
+
+/*
+ * Releases a copy made by snap_node_create.
+ */
+void snap_node_free(SnapNode *node) {
+    free(node);
+}
@@ -0,0 +1,38 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "../../tecnicofs-api-constants.h"
+#include "directory.h"
+
+typedef struct snapEntry {
+	int inumber;
+	int length;
+	uint32_t hash;
+	const char *name;
+} SnapEntry;
+
+/*
+ * State of an i-node as of a snapshot: its type and, for directories,
+ * a copy of the live entries in insertion order.
+ * Allocated as one block, entries and names following the header.
+ */
+typedef struct snapNode {
+	type nodeType;
+	int count;
+	SnapEntry *entries;
+} SnapNode;
+
+void snapshot_init();
+void snapshot_destroy();
+void snapshot_enter();
+void snapshot_exit();
+unsigned int snapshot_begin();
+unsigned int snapshot_begin_with(void (*atGate)(void *), void *arg);
+void snapshot_end();
+unsigned int snapshot_generation();
+uint64_t snapshot_last_lsn();
+SnapNode *snap_node_create(type nType, Directory *dir);
+void snap_node_free(SnapNode *node);
+
+#endif /* SNAPSHOT_H */
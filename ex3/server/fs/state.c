@@ -1,331 +1,907 @@
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include "state.h"
-
-/*
- * Sleeps for synchronization testing.
- */
-void insert_delay(int cycles) {
-    for (int i = 0; i < cycles; i++) {}
-}
-
-/*
- * Initializes the i-nodes table.
- */
-void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        if (pthread_rwlock_init(&inode_table[i].rwl, NULL)) {
-            fprintf(stderr, "Error initializing inode %d rwlock!\n", i);
-            exit(EXIT_FAILURE);
-        }
-    }
-}
-
-/*
- * Releases the allocated memory for the i-nodes tables.
- */
-void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	        if (inode_table[i].data.dirEntries) {
-                free(inode_table[i].data.dirEntries);
-            }
-        }
-        if (pthread_rwlock_destroy(&inode_table[i].rwl)) {
-            fprintf(stderr, "Error destroying inode %d rwlock!\n", i);
-            exit(EXIT_FAILURE);
-        }
-    } 
-}
-
-/*
- * Creates a new i-node in the table with the given information.
- * Input:
- *  - nType: the type of the node (file or directory)
- * Returns:
- *  inumber: identifier of the new i-node, if successfully created
- *     FAIL: if an error occurs
- */
-
-int inode_create(type nType) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        int lockReturn = pthread_rwlock_trywrlock(&(inode_table[inumber].rwl));
-        /* Sucessful try write lock */
-        if (!lockReturn) {
-            if (inode_table[inumber].nodeType == T_NONE) {
-                inode_table[inumber].nodeType = nType;
-                if (nType == T_DIRECTORY) {
-                    /* Initializes entry table */
-                    inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                        inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                    }
-                } else {
-                    inode_table[inumber].data.fileContents = NULL;
-                }
-                return inumber;
-            }
-            unlock(inumber);
-        } /* Cases where try write lock MAY fail */
-        else if (lockReturn != EBUSY) {
-            fprintf(stderr, "Error locking inode %d\n", inumber);
-            exit(EXIT_FAILURE);
-        }
-    }
-    return FAIL;
-}
-
-/*
- * Deletes the i-node.
- * Input:
- *  - inumber: identifier of the i-node
- * Returns: SUCCESS or FAIL
- */
-int inode_delete(int inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_delete: invalid inumber\n");
-        return FAIL;
-    }
-    
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    /* ^^ -> it frees the dirEntries and fileContents (union) */
-    if (inode_table[inumber].data.dirEntries) {
-        free(inode_table[inumber].data.dirEntries);
-    }
-
-    return SUCCESS;
-}
-
-/*
- * Copies the contents of the i-node into the arguments.
- * Only the fields referenced by non-null arguments are copied.
- * Input:
- *  - inumber: identifier of the i-node
- *  - nType: pointer to type
- *  - data: pointer to data
- * Returns: SUCCESS or FAIL
- */
-int inode_get(int inumber, type *nType, union Data *data) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_get: invalid inumber %d\n", inumber);
- 
-        return FAIL;
-    }
-
-    if (nType)
-        *nType = inode_table[inumber].nodeType;
-
-    if (data)
-        *data = inode_table[inumber].data;
-
-    return SUCCESS;
-}
-
-
-/*
- * Looks for node in directory entry from name.
- * Input:
- *  - name: path of node
- *  - entries: entries of directory
- * Returns:
- *  - inumber: found node's inumber
- *  - FAIL: if not found
- */
-int lookup_sub_node(char *name, DirEntry *entries) {
- 
-	if (entries == NULL) {
-		return FAIL;
-	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	
-	return FAIL;
-}
-
-
-/*
- * Resets an entry for a directory.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- * Returns: SUCCESS or FAIL
- */
-int dir_reset_entry(int inumber, int sub_inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-
-
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid inumber\n");
-        return FAIL;
-    }
-
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_reset_entry: can only reset entry to directories\n");
-        return FAIL;
-    }
-
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_reset_entry: invalid entry inumber\n");
-        return FAIL;
-    }
-
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
-    }
-
-    return FAIL;
-}
-
-
-/*
- * Adds an entry to the i-node directory data.
- * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry 
- * Returns: SUCCESS or FAIL
- */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
-    
-    /* invalid parent inumber */
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid inumber\n");
-        return FAIL;
-    }
-
-    /* parent is not a directory */
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
-        printf("inode_add_entry: can only add entry to directories\n");
-        return FAIL;
-    }
-
-    /* invalid child inumber */
-    /* at this point, nodeType is already set at nType */
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
-        printf("inode_add_entry: invalid entry inumber\n");
-        return FAIL;
-    }
-
-    /* invalid sub_name */
-    if (strlen(sub_name) == 0 ) {
-        printf("inode_add_entry: \
-               entry name must be non-empty\n");
-        return FAIL;
-    }
-
-    /* iterate through table */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        /* find first entry which is free */
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            /* update its data */
-            /* dirEntry is composed of name and i-number */
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
-        }
-    }
-    
-    return FAIL;
-}
-
-/**
- * Locks i-node rwlock.
- * Input:
- *  - inumber: number of the i-node being locked
- *  - lockType: READ or WRITE 
- * Returns: SUCCESS or FAIL
- */
-void lock(int inumber, int lockType) {
-    if (lockType == READ) {
-        if (pthread_rwlock_rdlock(&(inode_table[inumber].rwl))) {
-            fprintf(stderr, "Error locking on read inode %d's rwlock!\n\n", inumber);
-            exit(EXIT_FAILURE);
-        }
-    }
-    else if (lockType == WRITE) {
-        if (pthread_rwlock_wrlock(&(inode_table[inumber].rwl))) {
-            fprintf(stderr, "Error locking on write inode %d's rwlock!\n\n", inumber);
-            exit(EXIT_FAILURE);
-        }
-    }
-}
-
-/**
- * Unlocks i-node rwlock.
- * Input:
- *  - inumber: number of the i-node being unlocked.
- */
-void unlock(int inumber) {
-    if (pthread_rwlock_unlock(&inode_table[inumber].rwl)) { 
-        fprintf(stderr, "Error unlocking inode %d's rwlock!\n", inumber);
-        exit(EXIT_FAILURE);
-    }
-}
-
-/**
- * Unlocks array of inumbers.
- * Input:
- *  - inumbers: array containing locked i-nodes
- *  - size: length of inumbers' array
- */
-void unlockAll(int inumbers[], int size) {
-    for (int i = size-1; i >= 0; --i) {
-        unlock(inumbers[i]);
-    }
-}
-
-/*
- * Prints the i-nodes table.
- * Input:
- *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
- */
-int inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return SUCCESS;
-    }
-
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                    return FAIL;
-                }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
-            }
-        }
-    }
-    return SUCCESS;
-}
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "state.h"
+#include "epoch.h"
+#include "image.h"
+
+/*
+ * Sleeps for synchronization testing.
+ */
+void insert_delay(int cycles) {
+    for (int i = 0; i < cycles; i++) {}
+}
+
+inode_t *inode_segments[MAX_INODE_SEGMENTS];
+int inode_count = 0;
+
+/* Head of the free i-node list: ABA tag on the high half, inumber on the low half */
+static uint64_t free_list_head;
+static pthread_mutex_t grow_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define FREE_LIST_EMPTY ((uint32_t) FREE_INODE)
+
+/* Segments of the table in the mapped image, loaded on first use */
+static int image_segments = 0;
+/* Next image segment inode_table_grow() checks for free i-nodes */
+static int next_image_segment = 0;
+
+/* I-nodes changed since the last checkpoint, linked through nextDirty */
+static unsigned int dirty_epoch = 1;
+static int dirty_head = FREE_INODE;
+static int dirty_count = 0;
+/* Epoch whose i-nodes a running checkpoint is reading, 0 if none */
+static unsigned int checkpoint_epoch = 0;
+
+/*
+ * Pushes a chain of free i-nodes, already linked through nextFree, onto the free list.
+ * Input:
+ *  - first: first inumber of the chain
+ *  - last: last inumber of the chain
+ */
+static void free_list_push(int first, int last) {
+    uint64_t old = __atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE), new;
+    do {
+        __atomic_store_n(&inode_at(last)->nextFree, (int) (uint32_t) old, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | (uint32_t) first;
+    } while (!__atomic_compare_exchange_n(&free_list_head, &old, new, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Pops a free i-node from the free list.
+ * Returns:
+ *  inumber: identifier of the free i-node
+ *  FREE_INODE: if the list is empty
+ */
+static int free_list_pop() {
+    uint64_t old = __atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE), new;
+    int inumber;
+    do {
+        if ((uint32_t) old == FREE_LIST_EMPTY) {
+            return FREE_INODE;
+        }
+        inumber = (int) (uint32_t) old;
+        /* the tag makes the exchange fail if inumber was popped and pushed meanwhile */
+        int next = __atomic_load_n(&inode_at(inumber)->nextFree, __ATOMIC_RELAXED);
+        new = (((old >> 32) + 1) << 32) | (uint32_t) next;
+    } while (!__atomic_compare_exchange_n(&free_list_head, &old, new, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return inumber;
+}
+
+/*
+ * Allocates a segment of the i-node table, with every i-node free.
+ * Input:
+ *  - base: inumber of the first i-node of the segment
+ * Returns: the segment
+ */
+static inode_t *inode_segment_create(int base) {
+    inode_t *segment = malloc(sizeof(inode_t) * INODE_SEGMENT_SIZE);
+    if (!segment) {
+        fprintf(stderr, "Error allocating i-node table segment!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < INODE_SEGMENT_SIZE; i++) {
+        segment[i].nodeType = T_NONE;
+        segment[i].data.dir = NULL;
+        segment[i].nextFree = base + i + 1;
+        segment[i].generation = 0;
+        segment[i].br = NULL;
+        segment[i].readSamples = 0;
+        segment[i].promote = false;
+        segment[i].snapGen = 0;
+        segment[i].snap = NULL;
+        segment[i].dirtyEpoch = 0;
+        segment[i].nextDirty = FREE_INODE;
+        if (pthread_rwlock_init(&segment[i].rwl, NULL)) {
+            fprintf(stderr, "Error initializing inode %d rwlock!\n", base + i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return segment;
+}
+
+/*
+ * Loads a segment from the mapped image and adds its free i-nodes to the
+ * free list. The caller must hold grow_mutex.
+ * Input:
+ *  - s: index of the segment
+ * Returns: the segment
+ */
+static inode_t *inode_segment_load(int s) {
+    int base = s << INODE_SEGMENT_BITS, records = image_inode_count();
+    inode_t *segment = inode_segment_create(base);
+    int first = FREE_INODE, last = FREE_INODE;
+
+    for (int i = INODE_SEGMENT_SIZE - 1; i >= 0; i--) {
+        if (base + i < records) {
+            image_load_inode(base + i, &segment[i].nodeType, &segment[i].data.dir);
+        }
+        if (segment[i].nodeType == T_NONE) {
+            segment[i].nextFree = first;
+            if (first == FREE_INODE) {
+                last = base + i;
+            }
+            first = base + i;
+        }
+    }
+
+    __atomic_store_n(&inode_segments[s], segment, __ATOMIC_RELEASE);
+    if (first != FREE_INODE) {
+        free_list_push(first, last);
+    }
+    return segment;
+}
+
+/*
+ * Loads a segment of the mapped image the first time one of its i-nodes is used.
+ * Input:
+ *  - s: index of the segment
+ * Returns: the segment
+ */
+inode_t *inode_segment_fault(int s) {
+    if (pthread_mutex_lock(&grow_mutex)) {
+        fprintf(stderr, "Error locking i-node table grow mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+    inode_t *segment = __atomic_load_n(&inode_segments[s], __ATOMIC_ACQUIRE);
+    if (!segment) {
+        segment = inode_segment_load(s);
+    }
+    if (pthread_mutex_unlock(&grow_mutex)) {
+        fprintf(stderr, "Error unlocking i-node table grow mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+    return segment;
+}
+
+/*
+ * Adds free i-nodes to the free list: those of image segments not loaded
+ * yet, and then those of a new segment of the i-node table.
+ * Other threads keep using the table while it grows.
+ * Returns: SUCCESS or FAIL (table is at its maximum size)
+ */
+static int inode_table_grow() {
+    if (pthread_mutex_lock(&grow_mutex)) {
+        fprintf(stderr, "Error locking i-node table grow mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* another thread may have grown the table while we waited */
+    while ((uint32_t) __atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE) == FREE_LIST_EMPTY &&
+           next_image_segment < image_segments) {
+        int s = next_image_segment++;
+        if (!__atomic_load_n(&inode_segments[s], __ATOMIC_ACQUIRE)) {
+            inode_segment_load(s);
+        }
+    }
+    if ((uint32_t) __atomic_load_n(&free_list_head, __ATOMIC_ACQUIRE) != FREE_LIST_EMPTY) {
+        pthread_mutex_unlock(&grow_mutex);
+        return SUCCESS;
+    }
+
+    int base = inode_count;
+    if ((base >> INODE_SEGMENT_BITS) >= MAX_INODE_SEGMENTS) {
+        pthread_mutex_unlock(&grow_mutex);
+        return FAIL;
+    }
+
+    inode_t *segment = inode_segment_create(base);
+
+    /* publish the segment before any of its inumbers can be popped */
+    __atomic_store_n(&inode_segments[base >> INODE_SEGMENT_BITS], segment, __ATOMIC_RELEASE);
+    __atomic_store_n(&inode_count, base + INODE_SEGMENT_SIZE, __ATOMIC_RELEASE);
+    free_list_push(base, base + INODE_SEGMENT_SIZE - 1);
+
+    if (pthread_mutex_unlock(&grow_mutex)) {
+        fprintf(stderr, "Error unlocking i-node table grow mutex!\n");
+        exit(EXIT_FAILURE);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Initializes the i-nodes table.
+ */
+void inode_table_init() {
+    inode_count = 0;
+    free_list_head = FREE_LIST_EMPTY;
+    next_image_segment = 0;
+    image_segments = (image_inode_count() + INODE_SEGMENT_SIZE - 1) >> INODE_SEGMENT_BITS;
+    if (image_segments > 0) {
+        /* the segments of a mapped image are loaded as they are used */
+        inode_count = image_segments << INODE_SEGMENT_BITS;
+        return;
+    }
+
+    /* the first segment is allocated up front, so that the root gets inumber 0 */
+    if (inode_table_grow() == FAIL) {
+        fprintf(stderr, "Error initializing the i-node table!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Releases the allocated memory for the i-nodes tables.
+ */
+void inode_table_destroy() {
+    for (int i = 0; i < inode_count; i++) {
+        if (!inode_segments[i >> INODE_SEGMENT_BITS]) {
+            /* never loaded from the image */
+            continue;
+        }
+        inode_t *inode = inode_at(i);
+        if (inode->nodeType == T_DIRECTORY) {
+            dir_destroy(inode->data.dir);
+        } else if (inode->nodeType == T_FILE) {
+            free(inode->data.fileContents);
+        }
+        brlock_destroy(inode->br);
+        snap_node_free(inode->snap);
+        if (pthread_rwlock_destroy(&inode->rwl)) {
+            fprintf(stderr, "Error destroying inode %d rwlock!\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int s = 0; s < (inode_count >> INODE_SEGMENT_BITS); s++) {
+        free(inode_segments[s]);
+        inode_segments[s] = NULL;
+    }
+    inode_count = 0;
+    image_segments = 0;
+    dirty_head = FREE_INODE;
+    dirty_count = 0;
+}
+
+/*
+ * Preserves the state of an i-node about to change, if it belongs to the
+ * current snapshot and the dump has not read it yet.
+ * The caller must hold the i-node's write lock, inside the snapshot gate.
+ * Input:
+ *  - inode: the i-node
+ */
+static void inode_preserve(inode_t *inode) {
+    unsigned int gen = snapshot_generation();
+    if (inode->snapGen != gen) {
+        /* a copy the previous dump did not reach */
+        snap_node_free(inode->snap);
+        inode->snap = snap_node_create(inode->nodeType,
+            inode->nodeType == T_DIRECTORY ? inode->data.dir : NULL);
+        inode->snapGen = gen;
+    }
+}
+
+/*
+ * Adds an i-node to the dirty list of the current checkpoint epoch, once.
+ * The caller must hold the i-node's write lock, inside the snapshot gate.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+static void inode_mark_dirty(int inumber) {
+    inode_t *inode = inode_at(inumber);
+    if (inode->dirtyEpoch == dirty_epoch) {
+        return;
+    }
+    inode->dirtyEpoch = dirty_epoch;
+    int old = __atomic_load_n(&dirty_head, __ATOMIC_RELAXED);
+    do {
+        inode->nextDirty = old;
+    } while (!__atomic_compare_exchange_n(&dirty_head, &old, inumber, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&dirty_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Starts a new checkpoint epoch and takes the i-nodes changed in the last one.
+ * Must be called inside the snapshot gate's write lock, so no operation is
+ * changing i-nodes; an i-node changed from then on joins the new epoch.
+ * Input:
+ *  - count: set to the number of i-nodes taken
+ * Returns: their inumbers, to be freed by the caller
+ */
+int *inode_dirty_swap(int *count) {
+    int *inumbers = malloc(sizeof(int) * (dirty_count ? dirty_count : 1));
+    if (!inumbers) {
+        fprintf(stderr, "Error allocating dirty list!\n");
+        exit(EXIT_FAILURE);
+    }
+    *count = 0;
+    for (int i = dirty_head; i != FREE_INODE; i = inode_at(i)->nextDirty) {
+        inumbers[(*count)++] = i;
+    }
+    dirty_head = FREE_INODE;
+    dirty_count = 0;
+    __atomic_store_n(&checkpoint_epoch, dirty_epoch, __ATOMIC_RELAXED);
+    dirty_epoch++;
+    return inumbers;
+}
+
+/*
+ * Tells that the checkpoint has read every i-node inode_dirty_swap gave it.
+ */
+void inode_dirty_done() {
+    __atomic_store_n(&checkpoint_epoch, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Creates a new i-node in the table with the given information.
+ * The i-node is taken from the free list, growing the table when it is empty,
+ * and is returned locked for writing.
+ * Input:
+ *  - nType: the type of the node (file or directory)
+ * Returns:
+ *  inumber: identifier of the new i-node, if successfully created
+ *     FAIL: if an error occurs
+ */
+
+int inode_create(type nType) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    int inumber;
+    while ((inumber = free_list_pop()) == FREE_INODE) {
+        if (inode_table_grow() == FAIL) {
+            return FAIL;
+        }
+    }
+
+    /* a deleting thread may still hold the lock of a just freed i-node */
+    lock(inumber, WRITE);
+
+    inode_t *inode = inode_at(inumber);
+    unsigned int gen = snapshot_generation(), reading = __atomic_load_n(&checkpoint_epoch, __ATOMIC_RELAXED);
+    if (reading && inode->dirtyEpoch == reading) {
+        /* a running checkpoint reads it as the free i-node it was */
+        inode_preserve(inode);
+    } else if (inode->snapGen != gen) {
+        /* not part of any running snapshot */
+        snap_node_free(inode->snap);
+        inode->snap = NULL;
+        inode->snapGen = gen;
+    }
+    inode_mark_dirty(inumber);
+    inode->nodeType = nType;
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode->data.dir = dir_create();
+    } else {
+        inode->data.fileContents = NULL;
+    }
+    return inumber;
+}
+
+/*
+ * Deletes the i-node and returns it to the free list.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: SUCCESS or FAIL
+ */
+int inode_delete(int inumber) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if (!inode_valid(inumber) || (inode_at(inumber)->nodeType == T_NONE)) {
+        printf("inode_delete: invalid inumber\n");
+        return FAIL;
+    }
+    
+    inode_t *inode = inode_at(inumber);
+    inode_preserve(inode);
+    inode_mark_dirty(inumber);
+    /* invalidates cached entries of this directory */
+    __atomic_add_fetch(&inode->generation, 1, __ATOMIC_SEQ_CST);
+    /* lock-free readers may still be traversing the directory */
+    if (inode->nodeType == T_DIRECTORY) {
+        dir_destroy_deferred(inode->data.dir);
+    } else {
+        free(inode->data.fileContents);
+    }
+    __atomic_store_n(&inode->nodeType, T_NONE, __ATOMIC_RELEASE);
+    __atomic_store_n(&inode->data.dir, NULL, __ATOMIC_RELEASE);
+
+    free_list_push(inumber, inumber);
+    return SUCCESS;
+}
+
+/*
+ * Copies the contents of the i-node into the arguments.
+ * Only the fields referenced by non-null arguments are copied.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: pointer to type
+ *  - data: pointer to data
+ * Returns: SUCCESS or FAIL
+ */
+int inode_get(int inumber, type *nType, union Data *data) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if (!inode_valid(inumber) || (inode_at(inumber)->nodeType == T_NONE)) {
+        printf("inode_get: invalid inumber %d\n", inumber);
+ 
+        return FAIL;
+    }
+
+    if (nType)
+        *nType = inode_at(inumber)->nodeType;
+
+    if (data)
+        *data = inode_at(inumber)->data;
+
+    return SUCCESS;
+}
+
+
+/*
+ * Looks for node in directory entry from name.
+ * Input:
+ *  - name: path of node
+ *  - dir: the directory
+ * Returns:
+ *  - inumber: found node's inumber
+ *  - FAIL: if not found
+ */
+int lookup_sub_node(char *name, Directory *dir) {
+ 
+	if (dir == NULL) {
+		return FAIL;
+	}
+	return dir_lookup(dir, name);
+}
+
+
+/*
+ * Resets an entry for a directory.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL
+ */
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+
+    if (!inode_valid(inumber) || (inode_at(inumber)->nodeType == T_NONE)) {
+        printf("inode_reset_entry: invalid inumber\n");
+        return FAIL;
+    }
+
+    if (inode_at(inumber)->nodeType != T_DIRECTORY) {
+        printf("inode_reset_entry: can only reset entry to directories\n");
+        return FAIL;
+    }
+
+    if (!inode_valid(sub_inumber) || (inode_at(sub_inumber)->nodeType == T_NONE)) {
+        printf("inode_reset_entry: invalid entry inumber\n");
+        return FAIL;
+    }
+
+    inode_preserve(inode_at(inumber));
+    inode_mark_dirty(inumber);
+    /* invalidates cached entries of this directory, before they change */
+    __atomic_add_fetch(&inode_at(inumber)->generation, 1, __ATOMIC_SEQ_CST);
+    return dir_remove(inode_at(inumber)->data.dir, sub_name, sub_inumber);
+}
+
+
+/*
+ * Adds an entry to the i-node directory data.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry 
+ * Returns: SUCCESS or FAIL
+ */
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+    
+    /* invalid parent inumber */
+    if (!inode_valid(inumber) || (inode_at(inumber)->nodeType == T_NONE)) {
+        printf("inode_add_entry: invalid inumber\n");
+        return FAIL;
+    }
+
+    /* parent is not a directory */
+    if (inode_at(inumber)->nodeType != T_DIRECTORY) {
+        printf("inode_add_entry: can only add entry to directories\n");
+        return FAIL;
+    }
+
+    /* invalid child inumber */
+    /* at this point, nodeType is already set at nType */
+    if (!inode_valid(sub_inumber) || (inode_at(sub_inumber)->nodeType == T_NONE)) {
+        printf("inode_add_entry: invalid entry inumber\n");
+        return FAIL;
+    }
+
+    /* invalid sub_name */
+    if (strlen(sub_name) == 0 ) {
+        printf("inode_add_entry: \
+               entry name must be non-empty\n");
+        return FAIL;
+    }
+
+    inode_preserve(inode_at(inumber));
+    inode_mark_dirty(inumber);
+    /* the directory grows as needed */
+    return dir_insert(inode_at(inumber)->data.dir, sub_name, sub_inumber);
+}
+
+static int hot_count = 0;
+static __thread unsigned int read_locks = 0;
+/* Set on the owner of a partition of the tree (see lock_partition_owner) */
+static __thread bool partition_owner = false;
+/* Set while the owner's operation runs alongside a snapshot being read */
+static __thread bool partition_shared = false;
+
+/**
+ * Switches an i-node that is not locked by anyone to a big-reader lock.
+ * Input:
+ *  - inumber: number of the i-node
+ */
+void inode_make_hot(int inumber) {
+    inode_t *inode = inode_at(inumber);
+    if (!inode->br) {
+        __atomic_store_n(&inode->br, brlock_create(), __ATOMIC_RELEASE);
+        __atomic_add_fetch(&hot_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Returns the number of i-nodes using a big-reader lock.
+ */
+int inode_hot_count() {
+    return __atomic_load_n(&hot_count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Counts a read lock towards making a directory hot, or hands a write lock
+ * over to a big-reader lock if the directory was found to be hot.
+ * The caller has just locked the i-node's rwlock.
+ */
+static void lock_acquired(inode_t *inode, int inumber, int lockType) {
+    if (lockType == READ) {
+        if (++read_locks % HOT_SAMPLE_INTERVAL == 0 && inode->nodeType == T_DIRECTORY &&
+            __atomic_add_fetch(&inode->readSamples, 1, __ATOMIC_RELAXED) == HOT_READ_SAMPLES) {
+            __atomic_store_n(&inode->promote, true, __ATOMIC_RELAXED);
+        }
+    } else if (__atomic_load_n(&inode->promote, __ATOMIC_RELAXED)) {
+        /* hand the write lock over to the new big-reader lock */
+        brlock *br = brlock_create();
+        brlock_write_lock(br);
+        __atomic_store_n(&inode->br, br, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&hot_count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&inode->promote, false, __ATOMIC_RELAXED);
+        if (pthread_rwlock_unlock(&inode->rwl)) {
+            fprintf(stderr, "Error unlocking inode %d's rwlock!\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Makes this thread the owner of a partition of the tree. No other thread
+ * goes into the i-nodes it goes through, but the root, while it does, so
+ * it skips their locks, unless a snapshot is being read.
+ */
+void lock_partition_owner() {
+    partition_owner = true;
+}
+
+/**
+ * Tells whether an owner's operation runs alongside a snapshot being read,
+ * and must then lock its i-nodes as usual. Set for the whole operation.
+ * Input:
+ *  - shared: whether it does
+ */
+void lock_partition_share(bool shared) {
+    partition_shared = shared;
+}
+
+/**
+ * Returns: whether this thread skips the locks of the i-nodes but the root
+ */
+bool lock_partition_alone() {
+    return partition_owner && !partition_shared;
+}
+
+/**
+ * Locks i-node rwlock, or its big-reader lock if it is hot.
+ * Read locks of directories are sampled; once a directory has enough
+ * samples, the next writer switches it to a big-reader lock while holding
+ * the rwlock for writing, so no one else is inside at that point.
+ * Input:
+ *  - inumber: number of the i-node being locked
+ *  - lockType: READ or WRITE 
+ */
+static void inode_lock(int inumber, int lockType) {
+    inode_t *inode = inode_at(inumber);
+
+    while (true) {
+        brlock *br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE);
+        if (br) {
+            if (lockType == READ) {
+                brlock_read_lock(br);
+            } else {
+                brlock_write_lock(br);
+            }
+            return;
+        }
+
+        if (lockType == READ) {
+            if (pthread_rwlock_rdlock(&inode->rwl)) {
+                fprintf(stderr, "Error locking on read inode %d's rwlock!\n\n", inumber);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            if (pthread_rwlock_wrlock(&inode->rwl)) {
+                fprintf(stderr, "Error locking on write inode %d's rwlock!\n\n", inumber);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        /* the i-node may have been switched while this thread waited */
+        if (!__atomic_load_n(&inode->br, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (pthread_rwlock_unlock(&inode->rwl)) {
+            fprintf(stderr, "Error unlocking inode %d's rwlock!\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    lock_acquired(inode, inumber, lockType);
+}
+
+/**
+ * Locks i-node rwlock, or its big-reader lock if it is hot, unless it is
+ * held by someone else.
+ * Input:
+ *  - inumber: number of the i-node being locked
+ *  - lockType: READ or WRITE
+ * Returns: true if the i-node was locked
+ */
+static bool inode_try_lock(int inumber, int lockType) {
+    inode_t *inode = inode_at(inumber);
+
+    while (true) {
+        brlock *br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE);
+        if (br) {
+            return lockType == READ ? brlock_try_read_lock(br) : brlock_try_write_lock(br);
+        }
+
+        int error = lockType == READ ? pthread_rwlock_tryrdlock(&inode->rwl) :
+                                       pthread_rwlock_trywrlock(&inode->rwl);
+        if (error == EBUSY) {
+            return false;
+        }
+        if (error) {
+            fprintf(stderr, "Error trying to lock inode %d's rwlock!\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+
+        /* the i-node may have been switched since br was read */
+        if (!__atomic_load_n(&inode->br, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (pthread_rwlock_unlock(&inode->rwl)) {
+            fprintf(stderr, "Error unlocking inode %d's rwlock!\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    lock_acquired(inode, inumber, lockType);
+    return true;
+}
+
+/**
+ * Unlocks i-node rwlock, or its big-reader lock if it is hot.
+ * An i-node can only switch to a big-reader lock while no one holds its
+ * rwlock, so the lock to release is the one currently in use.
+ * Input:
+ *  - inumber: number of the i-node being unlocked.
+ */
+static void inode_unlock(int inumber) {
+    inode_t *inode = inode_at(inumber);
+    brlock *br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE);
+    if (br) {
+        brlock_unlock(br);
+    } else if (pthread_rwlock_unlock(&inode->rwl)) { 
+        fprintf(stderr, "Error unlocking inode %d's rwlock!\n", inumber);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Locks i-node, unless this thread owns it alone (see lock_partition_owner).
+ * Input:
+ *  - inumber: number of the i-node being locked
+ *  - lockType: READ or WRITE
+ */
+void lock(int inumber, int lockType) {
+    if (!lock_partition_alone() || inumber == FS_ROOT) {
+        inode_lock(inumber, lockType);
+    }
+}
+
+/**
+ * Locks i-node unless it is held by someone else, or this thread owns it
+ * alone (see lock_partition_owner).
+ * Input:
+ *  - inumber: number of the i-node being locked
+ *  - lockType: READ or WRITE
+ * Returns: true if the i-node was locked
+ */
+bool try_lock(int inumber, int lockType) {
+    return (lock_partition_alone() && inumber != FS_ROOT) || inode_try_lock(inumber, lockType);
+}
+
+/**
+ * Unlocks i-node locked with lock or try_lock.
+ * Input:
+ *  - inumber: number of the i-node being unlocked.
+ */
+void unlock(int inumber) {
+    if (!lock_partition_alone() || inumber == FS_ROOT) {
+        inode_unlock(inumber);
+    }
+}
+
+/**
+ * Unlocks array of inumbers.
+ * Input:
+ *  - inumbers: array containing locked i-nodes
+ *  - size: length of inumbers' array
+ */
+void unlockAll(int inumbers[], int size) {
+    for (int i = size-1; i >= 0; --i) {
+        unlock(inumbers[i]);
+    }
+}
+
+/**
+ * Initializes an empty lock set.
+ * Input:
+ *  - locks: the lock set
+ */
+void lock_set_init(lock_set *locks) {
+    locks->size = 0;
+    locks->removed = 0;
+    memset(locks->slots, 0, sizeof(locks->slots));
+}
+
+/**
+ * Finds the membership slot of an inumber, or the first free slot of its probe.
+ */
+static int lock_set_probe(lock_set *locks, int inumber, bool insert) {
+    int reusable = -1;
+    for (unsigned int i = ((unsigned int) inumber * 2654435761u) & (LOCK_SET_SLOTS - 1); ; i = (i + 1) & (LOCK_SET_SLOTS - 1)) {
+        short slot = locks->slots[i];
+        if (slot == LOCK_SET_EMPTY) {
+            return (insert && reusable != -1) ? reusable : (int) i;
+        }
+        if (slot == LOCK_SET_REMOVED) {
+            if (reusable == -1) {
+                reusable = i;
+            }
+        } else if (locks->inumbers[slot - 1] == inumber) {
+            return i;
+        }
+    }
+}
+
+/**
+ * Checks if an inumber is locked by the lock set's operation.
+ * Input:
+ *  - locks: the lock set
+ *  - inumber: number being checked
+ */
+bool lock_set_contains(lock_set *locks, int inumber) {
+    return locks->slots[lock_set_probe(locks, inumber, false)] > 0;
+}
+
+/**
+ * Records an inumber that was locked outside lock_set_acquire.
+ * Input:
+ *  - locks: the lock set
+ *  - inumber: the locked i-node
+ */
+void lock_set_add(lock_set *locks, int inumber) {
+    if (locks->size == MAX_ACTIVE_LOCKS) {
+        fprintf(stderr, "Error: too many locks held by one operation\n");
+        exit(EXIT_FAILURE);
+    }
+    locks->inumbers[locks->size++] = inumber;
+    locks->slots[lock_set_probe(locks, inumber, true)] = locks->size;
+}
+
+/**
+ * Locks an i-node and records it in the lock set.
+ * Input:
+ *  - locks: the lock set
+ *  - inumber: number of the i-node being locked
+ *  - lockType: READ or WRITE
+ */
+void lock_set_acquire(lock_set *locks, int inumber, int lockType) {
+    lock(inumber, lockType);
+    lock_set_add(locks, inumber);
+}
+
+/**
+ * Unlocks one i-node of the lock set.
+ * Input:
+ *  - locks: the lock set
+ *  - inumber: number of the i-node being unlocked
+ */
+void lock_set_release(lock_set *locks, int inumber) {
+    int i = lock_set_probe(locks, inumber, false);
+    int position = locks->slots[i] - 1;
+    if (position < 0) {
+        return;
+    }
+    unlock(inumber);
+    locks->slots[i] = LOCK_SET_REMOVED;
+    locks->removed++;
+
+    /* move the last lock into the freed position */
+    int last = locks->inumbers[--locks->size];
+    if (position != locks->size) {
+        locks->inumbers[position] = last;
+        locks->slots[lock_set_probe(locks, last, false)] = position + 1;
+    }
+}
+
+/**
+ * Unlocks every i-node of the lock set, and empties its table for the
+ * set's next operation, which would otherwise probe stale slots.
+ * Input:
+ *  - locks: the lock set
+ */
+void lock_set_release_all(lock_set *locks) {
+    unlockAll(locks->inumbers, locks->size);
+    if (locks->removed) {
+        /* the removed slots are only cleared all at once */
+        memset(locks->slots, 0, sizeof(locks->slots));
+    } else {
+        /* newest first: the probe of an entry only goes past older ones */
+        for (int i = locks->size - 1; i >= 0; i--) {
+            locks->slots[lock_set_probe(locks, locks->inumbers[i], false)] = LOCK_SET_EMPTY;
+        }
+    }
+    locks->size = 0;
+    locks->removed = 0;
+}
+
+/*
+ * Reads an i-node as of a snapshot: the state preserved when it first
+ * changed, or else its live state, which has not changed since.
+ * Later changes to the i-node are no longer preserved for this snapshot.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - gen: generation of the snapshot
+ * Returns: the i-node's state, to be released with snap_node_free
+ */
+SnapNode *inode_snapshot(int inumber, unsigned int gen) {
+    inode_t *inode = inode_at(inumber);
+    SnapNode *node;
+
+    /* a dump run by the owner of a partition reads the others too */
+    inode_lock(inumber, READ);
+    if (inode->snapGen == gen && inode->snap) {
+        node = inode->snap;
+        inode->snap = NULL;
+    } else {
+        node = snap_node_create(inode->nodeType,
+            inode->nodeType == T_DIRECTORY ? inode->data.dir : NULL);
+        snap_node_free(inode->snap);
+        inode->snap = NULL;
+        inode->snapGen = gen;
+    }
+    inode_unlock(inumber);
+    return node;
+}
@@ -1,55 +1,127 @@
-#ifndef INODES_H
-#define INODES_H
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <pthread.h>
-#include <stdbool.h>
-#include <errno.h>
-#include "../../tecnicofs-api-constants.h"
-
-/* FS root inode number */
-#define FS_ROOT 0
-
-#define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
-
-#define SUCCESS 0
-#define FAIL -1
-
-#define DELAY 0
-
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
-
-union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
-};
-
-typedef struct inode_t {    
-	type nodeType;
-	union Data data;
-	pthread_rwlock_t rwl;
-} inode_t;
-
-inode_t inode_table[INODE_TABLE_SIZE];
-
-void insert_delay(int cycles);
-void inode_table_init();
-void inode_table_destroy();
-int inode_create(type nType);
-int inode_delete(int inumber);
-int inode_get(int inumber, type *nType, union Data *data);
-int lookup_sub_node(char *name, DirEntry *entries);
-int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void lock(int inumber, int lockType);
-void unlock(int inumber);
-void unlockAll(int inumbers[], int size);
-int inode_print_tree(FILE *fp, int inumber, char *name);
-
-#endif /* INODES_H */
+#ifndef INODES_H
+#define INODES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <errno.h>
+#include "../../tecnicofs-api-constants.h"
+#include "directory.h"
+#include "brlock.h"
+#include "snapshot.h"
+
+/* FS root inode number */
+#define FS_ROOT 0
+
+#define FREE_INODE -1
+
+/* The i-node table is a list of fixed-size segments, allocated on demand */
+#define INODE_SEGMENT_BITS 10
+#define INODE_SEGMENT_SIZE (1 << INODE_SEGMENT_BITS)
+#define INODE_SEGMENT_MASK (INODE_SEGMENT_SIZE - 1)
+#define MAX_INODE_SEGMENTS 16384
+
+/* One in this many read locks of a thread is counted towards making a directory hot */
+#define HOT_SAMPLE_INTERVAL 64
+/* Sampled read locks after which a directory switches to a big-reader lock */
+#define HOT_READ_SAMPLES 256
+
+/* Upper bound of locks held by one operation (two lookups plus a child) */
+#define MAX_PATH_DEPTH (MAX_FILE_NAME / 2 + 1)
+#define MAX_ACTIVE_LOCKS (2 * MAX_PATH_DEPTH + 1)
+
+#define SUCCESS 0
+#define FAIL -1
+
+#define DELAY 0
+
+union Data {
+	char *fileContents; /* for files */
+	Directory *dir; /* for directories */
+};
+
+typedef struct inode_t {    
+	type nodeType;
+	union Data data;
+	pthread_rwlock_t rwl;
+	int nextFree; /* next i-node on the free list, while T_NONE */
+	unsigned int generation; /* changes when an entry is removed or the i-node is deleted */
+	brlock *br;              /* replaces rwl once the i-node is found to be read-hot */
+	unsigned int readSamples;
+	bool promote;
+	unsigned int snapGen;    /* latest snapshot this i-node was preserved or read for */
+	SnapNode *snap;          /* its state as of that snapshot, until the dump reads it */
+	unsigned int dirtyEpoch; /* latest checkpoint epoch this i-node changed in */
+	int nextDirty;           /* next i-node on the dirty list of that epoch */
+} inode_t;
+
+/* Slots of a lock set's membership table (power of two, above the inserts of one operation) */
+#define LOCK_SET_SLOTS 512
+#define LOCK_SET_EMPTY 0
+#define LOCK_SET_REMOVED -1
+
+/*
+ * Locks held by one operation. Membership is checked in O(1) through an
+ * open-addressing table that maps each inumber to its position in inumbers.
+ */
+typedef struct lock_set {
+	int inumbers[MAX_ACTIVE_LOCKS];
+	int size;
+	int removed;                 /* LOCK_SET_REMOVED slots left in the table */
+	short slots[LOCK_SET_SLOTS]; /* position + 1, or LOCK_SET_EMPTY / LOCK_SET_REMOVED */
+} lock_set;
+
+extern inode_t *inode_segments[MAX_INODE_SEGMENTS];
+extern int inode_count;
+
+inode_t *inode_segment_fault(int s);
+
+/*
+ * Returns the i-node with the given inumber.
+ * The inumber must be valid; segments of a mapped image are loaded on first use.
+ */
+static inline inode_t *inode_at(int inumber) {
+	inode_t *segment = __atomic_load_n(&inode_segments[inumber >> INODE_SEGMENT_BITS], __ATOMIC_ACQUIRE);
+	if (__builtin_expect(segment == NULL, 0)) {
+		segment = inode_segment_fault(inumber >> INODE_SEGMENT_BITS);
+	}
+	return &segment[inumber & INODE_SEGMENT_MASK];
+}
+
+/*
+ * Checks if the inumber belongs to the i-node table.
+ */
+static inline bool inode_valid(int inumber) {
+	return inumber >= 0 && inumber < __atomic_load_n(&inode_count, __ATOMIC_ACQUIRE);
+}
+
+void insert_delay(int cycles);
+void inode_table_init();
+void inode_table_destroy();
+int inode_create(type nType);
+int inode_delete(int inumber);
+int inode_get(int inumber, type *nType, union Data *data);
+int lookup_sub_node(char *name, Directory *dir);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name);
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
+void lock_partition_owner();
+void lock_partition_share(bool shared);
+bool lock_partition_alone();
+void lock(int inumber, int lockType);
+bool try_lock(int inumber, int lockType);
+void unlock(int inumber);
+void unlockAll(int inumbers[], int size);
+void inode_make_hot(int inumber);
+int inode_hot_count();
+void lock_set_init(lock_set *locks);
+bool lock_set_contains(lock_set *locks, int inumber);
+void lock_set_acquire(lock_set *locks, int inumber, int lockType);
+void lock_set_release(lock_set *locks, int inumber);
+void lock_set_add(lock_set *locks, int inumber);
+void lock_set_release_all(lock_set *locks);
+SnapNode *inode_snapshot(int inumber, unsigned int gen);
+int *inode_dirty_swap(int *count);
+void inode_dirty_done();
+
+#endif /* INODES_H */
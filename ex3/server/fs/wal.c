@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "wal.h"
+#include "state.h"
+
+/*
+ * Write-ahead log of the operations that change the namespace. Operations
+ * append their record while they still hold the locks of the i-nodes they
+ * changed, so operations that conflict are logged in the order they took
+ * effect, and then wait for the record to be durable (wal_commit) after
+ * releasing their locks, before the client gets its reply.
+ *
+ * Records are appended to an in-memory buffer. A committing thread that
+ * finds no sync in progress becomes the leader: it takes the whole buffer,
+ * leaving the spare one for new records, writes it and syncs it, and wakes
+ * every thread whose record it covered (group commit). In batch and async
+ * modes, a background thread does the syncing instead.
+ */
+
+typedef struct walBuffer {
+    char *data;
+    size_t used;
+    size_t size;
+} WalBuffer;
+
+static int wal_fd = -1;
+static char wal_path[PATH_MAX];
+static int wal_policy = WAL_SYNC_OP;
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_work = PTHREAD_COND_INITIALIZER;
+static WalBuffer pending, spare;
+static uint64_t last_lsn = 0;      /* of the latest appended record */
+static uint64_t durable_lsn = 0;   /* of the latest synced record */
+static bool syncing = false;
+static bool stopping = false;
+static pthread_t syncer;
+static unsigned long stat_records = 0, stat_syncs = 0, stat_bytes = 0, stat_truncated = 0;
+
+/* latest record appended by this thread, not committed yet */
+static __thread uint64_t thread_lsn = 0;
+/* set while this thread appends a group, holding wal_mutex */
+static __thread bool thread_group = false;
+
+/*
+ * Checksums a record (32-bit FNV-1a).
+ */
+static uint32_t wal_checksum(const char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Parses a sync policy name: op, batch or async.
+ * Returns: the policy, or FAIL
+ */
+int wal_parse_policy(const char *policy) {
+    if (!strcmp(policy, "op")) {
+        return WAL_SYNC_OP;
+    } else if (!strcmp(policy, "batch")) {
+        return WAL_SYNC_BATCH;
+    } else if (!strcmp(policy, "async")) {
+        return WAL_SYNC_ASYNC;
+    }
+    return FAIL;
+}
+
+/*
+ * Maps a logged inumber to the inumber replay gave that i-node.
+ * I-nodes replay has not created keep their inumber.
+ */
+static int *replay_map = NULL;
+static int replay_map_size = 0;
+
+static int replay_inumber(int logged) {
+    return logged < replay_map_size && replay_map[logged] ? replay_map[logged] - 1 : logged;
+}
+
+static void replay_bind(int logged, int inumber) {
+    if (logged >= replay_map_size) {
+        int size = replay_map_size ? replay_map_size : 1024;
+        while (size <= logged) {
+            size *= 2;
+        }
+        replay_map = realloc(replay_map, sizeof(int) * size);
+        if (!replay_map) {
+            fprintf(stderr, "Error allocating log replay map!\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(replay_map + replay_map_size, 0, sizeof(int) * (size - replay_map_size));
+        replay_map_size = size;
+    }
+    replay_map[logged] = inumber + 1;
+}
+
+/*
+ * Applies a record to the namespace.
+ * Returns: SUCCESS or FAIL
+ */
+static int replay_record(WalRecord *record) {
+    char *name = (char *) (record + 1);
+    int parent = replay_inumber(record->parent), child;
+
+    switch (record->op & ~WAL_GROUP) {
+        case WAL_CREATE:
+            child = inode_create(record->nodeType);
+            if (child == FAIL) {
+                return FAIL;
+            }
+            unlock(child);
+            replay_bind(record->child, child);
+            return dir_add_entry(parent, child, name);
+        case WAL_DELETE:
+            child = replay_inumber(record->child);
+            if (dir_reset_entry(parent, child, name) == FAIL) {
+                return FAIL;
+            }
+            return inode_delete(child);
+        case WAL_MOVE:
+            child = replay_inumber(record->child);
+            if (dir_reset_entry(parent, child, name) == FAIL) {
+                return FAIL;
+            }
+            return dir_add_entry(replay_inumber(record->newParent), child, name + record->nameLength + 1);
+        default:
+            return FAIL;
+    }
+}
+
+/*
+ * Checks that a whole, intact record follows another one in the log.
+ * Input:
+ *  - log, size: the mapped log
+ *  - offset: where the record starts
+ *  - latest: lsn of the record before it
+ */
+static bool wal_record_valid(char *log, size_t size, size_t offset, uint64_t latest) {
+    if (size - offset < sizeof(WalRecord)) {
+        return false;
+    }
+    WalRecord *record = (WalRecord *) (log + offset);
+    return record->length >= sizeof(WalRecord) + record->nameLength + 1 && record->length % 8 == 0 &&
+           record->length <= size - offset && record->lsn > latest &&
+           record->checksum == wal_checksum(log + offset + 8, record->length - 8);
+}
+
+/*
+ * Replays a log over the namespace, before any operation runs. A torn
+ * record at the end of the log, from a crash while it was being written,
+ * is cut off, together with the rest of its group.
+ * Input:
+ *  - path: the log file
+ *  - fromLsn: records up to this one are already in the namespace
+ * Returns: the lsn of the latest record in the log, at least fromLsn
+ */
+uint64_t wal_replay(const char *path, uint64_t fromLsn) {
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return fromLsn;
+        }
+        perror("Error opening log");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading log");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = st.st_size, offset = 0;
+    uint64_t lsn = fromLsn, latest = 0;
+    char *log = NULL;
+    if (size > 0) {
+        log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (log == MAP_FAILED) {
+            perror("Error mapping log");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (wal_record_valid(log, size, offset, latest)) {
+        WalRecord *record = (WalRecord *) (log + offset);
+        size_t end = offset + record->length;
+        uint64_t last = record->lsn;
+
+        /* a group is only applied if its commit record made it to the log */
+        if (record->op & WAL_GROUP) {
+            WalRecord *next = record;
+            while (next->op & WAL_GROUP) {
+                if (!wal_record_valid(log, size, end, last)) {
+                    break;
+                }
+                next = (WalRecord *) (log + end);
+                last = next->lsn;
+                end += next->length;
+            }
+            if (next->op & WAL_GROUP) {
+                break;
+            }
+        }
+
+        for (size_t at = offset; at < end; ) {
+            record = (WalRecord *) (log + at);
+            if (record->lsn > fromLsn && record->op != WAL_COMMIT) {
+                if (replay_record(record) == FAIL) {
+                    fprintf(stderr, "Error: log record %lu does not apply\n", (unsigned long) record->lsn);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (record->lsn > fromLsn) {
+                lsn = record->lsn;
+            }
+            at += record->length;
+        }
+        latest = last;
+        offset = end;
+    }
+
+    if (offset < size) {
+        fprintf(stderr, "Log: dropping %lu bytes of incomplete records\n", (unsigned long) (size - offset));
+        if (ftruncate(fd, offset) == -1) {
+            perror("Error truncating log");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (log) {
+        munmap(log, size);
+    }
+    close(fd);
+    free(replay_map);
+    replay_map = NULL;
+    replay_map_size = 0;
+    return lsn > latest ? lsn : latest;
+}
+
+/*
+ * Writes and syncs the pending records. The caller must hold wal_mutex,
+ * which is released while writing, and no sync may be in progress.
+ */
+static void wal_sync_locked() {
+    WalBuffer buffer = pending;
+    uint64_t upto = last_lsn;
+
+    pending = spare;
+    pending.used = 0;
+    syncing = true;
+    pthread_mutex_unlock(&wal_mutex);
+
+    for (size_t done = 0; done < buffer.used; ) {
+        ssize_t written = write(wal_fd, buffer.data + done, buffer.used - done);
+        if (written == -1) {
+            perror("Error writing log");
+            exit(EXIT_FAILURE);
+        }
+        done += written;
+    }
+    if (fdatasync(wal_fd) == -1) {
+        perror("Error syncing log");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    stat_syncs++;
+    stat_bytes += buffer.used;
+    spare = buffer;
+    durable_lsn = upto;
+    syncing = false;
+    pthread_cond_broadcast(&wal_synced);
+}
+
+/*
+ * Background syncs, in batch and async modes: whenever enough bytes are
+ * pending, and at least every WAL_SYNC_INTERVAL_US.
+ */
+static void *wal_syncer(void *arg) {
+    pthread_mutex_lock(&wal_mutex);
+    while (!stopping) {
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        long usec = now.tv_usec + WAL_SYNC_INTERVAL_US;
+        deadline.tv_sec = now.tv_sec + usec / 1000000;
+        deadline.tv_nsec = (usec % 1000000) * 1000;
+
+        while (!stopping && pending.used < WAL_BATCH_BYTES) {
+            if (pthread_cond_timedwait(&wal_work, &wal_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (pending.used > 0 && !syncing) {
+            wal_sync_locked();
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    return NULL;
+}
+
+/*
+ * Opens the log for appending, after it was replayed.
+ * Input:
+ *  - path: the log file
+ *  - policy: WAL_SYNC_OP, WAL_SYNC_BATCH or WAL_SYNC_ASYNC
+ *  - lastLsn: lsn of the latest record already in the namespace
+ */
+void wal_open(const char *path, int policy, uint64_t lastLsn) {
+    if (snprintf(wal_path, sizeof(wal_path), "%s", path) >= sizeof(wal_path)) {
+        fprintf(stderr, "Log path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    wal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (wal_fd == -1) {
+        perror("Error opening log");
+        exit(EXIT_FAILURE);
+    }
+    wal_policy = policy;
+    last_lsn = durable_lsn = lastLsn;
+    stopping = false;
+
+    WalBuffer *buffers[] = { &pending, &spare };
+    for (int i = 0; i < 2; i++) {
+        buffers[i]->used = 0;
+        buffers[i]->size = WAL_BUFFER_SIZE;
+        buffers[i]->data = malloc(WAL_BUFFER_SIZE);
+        if (!buffers[i]->data) {
+            fprintf(stderr, "Error allocating log buffer!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (policy != WAL_SYNC_OP) {
+        /* signals are left to the threads of the server */
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        if (pthread_create(&syncer, NULL, wal_syncer, NULL)) {
+            fprintf(stderr, "Log sync thread failed to create\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+}
+
+/*
+ * Syncs the pending records and closes the log.
+ */
+void wal_close() {
+    if (wal_fd == -1) {
+        return;
+    }
+    if (wal_policy != WAL_SYNC_OP) {
+        pthread_mutex_lock(&wal_mutex);
+        stopping = true;
+        pthread_cond_signal(&wal_work);
+        pthread_mutex_unlock(&wal_mutex);
+        pthread_join(syncer, NULL);
+    }
+    wal_flush();
+    close(wal_fd);
+    wal_fd = -1;
+    free(pending.data);
+    free(spare.data);
+}
+
+/*
+ * Appends a record to the pending buffer.
+ * Input:
+ *  - record: the header, without length, checksum and lsn
+ *  - name, newName: the names that follow it; newName may be NULL
+ */
+static void wal_append(WalRecord *record, const char *name, const char *newName) {
+    size_t newLength = newName ? strlen(newName) + 1 : 0;
+    record->nameLength = strlen(name);
+    record->length = (sizeof(WalRecord) + record->nameLength + 1 + newLength + 7) & ~7;
+
+    /* a group holds wal_mutex from its start to its commit record */
+    if (!thread_group) {
+        pthread_mutex_lock(&wal_mutex);
+    } else if (record->op != WAL_COMMIT) {
+        record->op |= WAL_GROUP;
+    }
+    if (pending.used + record->length > pending.size) {
+        while (pending.used + record->length > pending.size) {
+            pending.size *= 2;
+        }
+        pending.data = realloc(pending.data, pending.size);
+        if (!pending.data) {
+            fprintf(stderr, "Error allocating log buffer!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char *data = pending.data + pending.used;
+    record->lsn = ++last_lsn;
+    memset(data, 0, record->length);
+    memcpy(data, record, sizeof(WalRecord));
+    memcpy(data + sizeof(WalRecord), name, record->nameLength + 1);
+    if (newName) {
+        memcpy(data + sizeof(WalRecord) + record->nameLength + 1, newName, newLength);
+    }
+    ((WalRecord *) data)->checksum = wal_checksum(data + 8, record->length - 8);
+    pending.used += record->length;
+    stat_records++;
+    thread_lsn = record->lsn;
+
+    if (wal_policy == WAL_SYNC_BATCH && pending.used >= WAL_BATCH_BYTES) {
+        pthread_cond_signal(&wal_work);
+    }
+    if (!thread_group) {
+        pthread_mutex_unlock(&wal_mutex);
+    }
+}
+
+/*
+ * Logs the creation of an entry. The caller must hold the parent's write lock.
+ */
+void wal_log_create(int parent, int child, const char *name, type nType) {
+    if (wal_fd == -1) {
+        return;
+    }
+    WalRecord record = { .op = WAL_CREATE, .nodeType = nType, .parent = parent, .newParent = FREE_INODE, .child = child };
+    wal_append(&record, name, NULL);
+}
+
+/*
+ * Logs the deletion of an entry and its i-node. The caller must hold the
+ * parent's write lock.
+ */
+void wal_log_delete(int parent, int child, const char *name) {
+    if (wal_fd == -1) {
+        return;
+    }
+    WalRecord record = { .op = WAL_DELETE, .parent = parent, .newParent = FREE_INODE, .child = child };
+    wal_append(&record, name, NULL);
+}
+
+/*
+ * Logs the move of an entry. The caller must hold both parents' write locks.
+ */
+void wal_log_move(int parent, int newParent, int child, const char *name, const char *newName) {
+    if (wal_fd == -1) {
+        return;
+    }
+    WalRecord record = { .op = WAL_MOVE, .parent = parent, .newParent = newParent, .child = child };
+    wal_append(&record, name, newName);
+}
+
+/*
+ * Starts a group of records that replay applies all or none of. The
+ * records of a group are appended back to back, as other threads' records
+ * wait until wal_group_end.
+ */
+void wal_group_begin() {
+    if (wal_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal_mutex);
+    thread_group = true;
+}
+
+/*
+ * Ends the group of records of the calling thread with a commit record.
+ */
+void wal_group_end() {
+    if (wal_fd == -1) {
+        return;
+    }
+    WalRecord record = { .op = WAL_COMMIT, .parent = FREE_INODE, .newParent = FREE_INODE, .child = FREE_INODE };
+    wal_append(&record, "", NULL);
+    thread_group = false;
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/*
+ * Returns the lsn of the latest appended record.
+ */
+uint64_t wal_last_lsn() {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = last_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+/*
+ * Waits, as the sync policy requires, for the latest record appended by
+ * this thread to be durable. Called after the operation released its locks.
+ */
+void wal_commit() {
+    uint64_t lsn = thread_lsn;
+    if (wal_fd == -1 || lsn == 0) {
+        return;
+    }
+    thread_lsn = 0;
+    if (wal_policy == WAL_SYNC_ASYNC) {
+        return;
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    while (durable_lsn < lsn) {
+        if (wal_policy == WAL_SYNC_OP && !syncing) {
+            /* lead a sync for every record appended so far */
+            wal_sync_locked();
+        } else {
+            pthread_cond_wait(&wal_synced, &wal_mutex);
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/*
+ * Waits for every record appended so far to be durable, whatever the policy.
+ */
+void wal_flush() {
+    if (wal_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = last_lsn;
+    while (durable_lsn < lsn) {
+        if (!syncing) {
+            wal_sync_locked();
+        } else {
+            pthread_cond_wait(&wal_synced, &wal_mutex);
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/*
+ * Drops the records a checkpoint made unnecessary, by replacing the log
+ * with a copy of the records after them. Appends go on meanwhile; syncs
+ * wait until the new log is in place.
+ * Input:
+ *  - lsn: records up to this one are in a durable checkpoint
+ */
+void wal_truncate(uint64_t lsn) {
+    if (wal_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal_mutex);
+    while (syncing) {
+        pthread_cond_wait(&wal_synced, &wal_mutex);
+    }
+    syncing = true;
+    pthread_mutex_unlock(&wal_mutex);
+
+    /* only synced records are in the file, all of them whole */
+    struct stat st;
+    if (fstat(wal_fd, &st) == -1) {
+        perror("Error reading log");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = st.st_size, offset = 0;
+    char *log = NULL;
+    if (size > 0) {
+        int fd = open(wal_path, O_RDONLY);
+        if (fd == -1 || (log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            perror("Error mapping log");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    while (offset < size && ((WalRecord *) (log + offset))->lsn <= lsn) {
+        offset += ((WalRecord *) (log + offset))->length;
+    }
+
+    if (offset > 0) {
+        char tmp[PATH_MAX + 4];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", wal_path);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+        if (fd == -1) {
+            perror("Error creating log");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t done = offset; done < size; ) {
+            ssize_t written = write(fd, log + done, size - done);
+            if (written == -1) {
+                perror("Error writing log");
+                exit(EXIT_FAILURE);
+            }
+            done += written;
+        }
+        if (fdatasync(fd) == -1 || rename(tmp, wal_path) == -1) {
+            perror("Error replacing log");
+            exit(EXIT_FAILURE);
+        }
+        close(wal_fd);
+        wal_fd = fd;
+    }
+    if (log) {
+        munmap(log, size);
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    stat_truncated += offset;
+    syncing = false;
+    pthread_cond_broadcast(&wal_synced);
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/*
+ * Prints log statistics.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void wal_print_stats(FILE *fp) {
+    if (wal_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal_mutex);
+    fprintf(fp, "log: %lu records, %lu syncs, %lu bytes, %.1f records per sync, %lu bytes truncated\n",
+            stat_records, stat_syncs, stat_bytes, stat_syncs ? (double) stat_records / stat_syncs : 0.0,
+            stat_truncated);
+    pthread_mutex_unlock(&wal_mutex);
+}
@@ -0,0 +1,60 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../../tecnicofs-api-constants.h"
+
+/* When operations wait for their records to be durable */
+#define WAL_SYNC_OP 0       /* before replying, sharing syncs with concurrent operations */
+#define WAL_SYNC_BATCH 1    /* before replying, at the next time or size triggered sync */
+#define WAL_SYNC_ASYNC 2    /* never; records are synced in the background */
+
+/* Pending records are synced at least this often, in batch and async modes */
+#define WAL_SYNC_INTERVAL_US 2000
+/* Pending bytes that trigger a sync in batch mode */
+#define WAL_BATCH_BYTES (64 * 1024)
+/* Initial size of the in-memory log buffers */
+#define WAL_BUFFER_SIZE (64 * 1024)
+
+/* Record operations */
+#define WAL_CREATE 1
+#define WAL_DELETE 2
+#define WAL_MOVE 3
+#define WAL_COMMIT 4     /* ends a group */
+/* Flag of the records of a group, applied only if its WAL_COMMIT is logged */
+#define WAL_GROUP 0x80
+
+/*
+ * Log record header, followed by the entry name and, for moves, the new
+ * name, both NUL terminated. Records refer to i-nodes by the inumbers they
+ * had when logged; replay maps them to the inumbers it allocates.
+ */
+typedef struct walRecord {
+	uint32_t length;      /* of the whole record, padded to 8 bytes */
+	uint32_t checksum;    /* of the bytes after this field */
+	uint64_t lsn;
+	uint8_t op;
+	uint8_t nodeType;     /* of a created i-node */
+	uint16_t nameLength;  /* of the first name, without the NUL */
+	int32_t parent;       /* directory of the entry (old directory, for moves) */
+	int32_t newParent;    /* new directory, for moves */
+	int32_t child;        /* i-node of the entry */
+} WalRecord;
+
+int wal_parse_policy(const char *policy);
+uint64_t wal_replay(const char *path, uint64_t fromLsn);
+void wal_open(const char *path, int policy, uint64_t lastLsn);
+void wal_close();
+void wal_log_create(int parent, int child, const char *name, type nType);
+void wal_log_delete(int parent, int child, const char *name);
+void wal_log_move(int parent, int newParent, int child, const char *name, const char *newName);
+void wal_group_begin();
+void wal_group_end();
+uint64_t wal_last_lsn();
+void wal_commit();
+void wal_flush();
+void wal_truncate(uint64_t lsn);
+void wal_print_stats(FILE *fp);
+
+#endif /* WAL_H */
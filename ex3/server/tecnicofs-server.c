@@ -7,21 +7,49 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
 #include "fs/operations.h"
+#include "fs/wal.h"
+#include "../tecnicofs-protocol.h"
+#include "tecnicofs-server.h"
+#include "engine.h"
 
 #define MAX_COMMANDS 10
 #define MAX_INPUT_SIZE 100
 
 int numberThreads = 0;
+/* Image the filesystem is loaded from and saved to at shutdown, if any */
+char *imagePath = NULL;
+/* Log of the operations, if any, and when replies wait for it */
+char *logPath = NULL;
+int syncPolicy = WAL_SYNC_OP;
+/* Time between incremental checkpoints to the image, 0 for none */
+int checkpointMs = 0;
+/* How requests reach the workers, and the I/O threads of an event loop */
+int engine = ENGINE_THREADS;
+int ioThreads = ENGINE_IO_THREADS;
+/* Set for each worker to own the top-level directories that route to it */
+bool partitions = false;
+/* Sockets of the workers, next to the server socket, if any */
+int workerSocketCount = 0;
+int workerSockets[TFS_MAX_WORKER_SOCKETS];
 
 /* Socket server related global variables */
 int scsocket;
 struct sockaddr_un server_addr;
 socklen_t ser_addr_len;
+/* Listening socket of the sessions, at the server socket's path plus TFS_SESSION_SUFFIX */
+int sessionSocket;
+/* Listening socket of the clients sharing memory, at its path plus TFS_SHM_SUFFIX, or -1 */
+int shmSocket = -1;
+bool useShm = false;
 
 /**
  * Called when invalid commands are processed and exits program.
@@ -34,19 +62,102 @@ void errorParse() {
 }
 
 /**
- * Initializes TecnicoFS.
+ * Initializes TecnicoFS, from its image if there is one.
  * Input:
  *  - argc: number of input arguments from stdin.
+ *  - argv: input arguments, options first.
  */ 
-void init_fs_aux(int argc) {
+void init_fs_aux(int argc, char * argv[]) {
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:l:s:c:e:n:pw:m")) != -1) {
+        switch (opt) {
+            case 'i':
+                imagePath = optarg;
+                break;
+            case 'l':
+                logPath = optarg;
+                break;
+            case 's':
+                if ((syncPolicy = wal_parse_policy(optarg)) == FAIL) {
+                    fprintf(stderr, "Invalid sync policy %s!\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                if ((checkpointMs = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid checkpoint interval %s!\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if ((engine = engine_parse(optarg)) == FAIL) {
+                    fprintf(stderr, "Invalid engine %s!\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                if ((ioThreads = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid number of I/O threads %s!\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                partitions = true;
+                break;
+            case 'm':
+                useShm = true;
+                break;
+            case 'w':
+                workerSocketCount = atoi(optarg);
+                if (workerSocketCount <= 0 || workerSocketCount > TFS_MAX_WORKER_SOCKETS) {
+                    fprintf(stderr, "Invalid number of worker sockets %s!\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: ./tecnicofs [-i image] [-l log] [-s op|batch|async] [-c checkpoint_ms] [-e threads|epoll|mmsg|uring] [-n io_threads] [-p] [-w worker_sockets] [-m] numberthreads socketname\n");
+                exit(EXIT_FAILURE);
+        }
+    }
 
     /* Validate number of input arguments */ 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: ./tecnicofs numberthreads socketname\n");
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: ./tecnicofs [-i image] [-l log] [-s op|batch|async] [-c checkpoint_ms] [-e threads|epoll|mmsg|uring] [-n io_threads] [-p] [-w worker_sockets] [-m] numberthreads socketname\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (workerSocketCount && engine != ENGINE_THREADS && engine != ENGINE_MMSG) {
+        fprintf(stderr, "Worker sockets need the threads or mmsg engine!\n");
         exit(EXIT_FAILURE);
     }
 
-    init_fs();
+    if (partitions && engine != ENGINE_EPOLL && engine != ENGINE_URING) {
+        fprintf(stderr, "Partitions need the epoll or uring engine!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* shared memory clients are served outside the owners of the partitions */
+    if (partitions && useShm) {
+        fprintf(stderr, "Partitions can't serve shared memory clients!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (checkpointMs && !imagePath) {
+        fprintf(stderr, "Checkpoints need an image (-i)!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    init_fs(imagePath, logPath, syncPolicy, checkpointMs);
+}
+
+/**
+ * Saves an image of TecnicoFS.
+ * Input:
+ *  - path: string containing the image file path
+ */
+int save_tecnicofs_image_aux(char* path) {
+    return save_tecnicofs_image(path);
 }
 
 /**
@@ -56,15 +167,15 @@ void init_fs_aux(int argc) {
  */
 int print_tecnicofs_tree_aux(char* outputPath) {
 
-    FILE* fp = fopen(outputPath, "w");
+    int fd = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     
-    if (!fp) {
+    if (fd == -1) {
         fprintf(stderr, "Output path invalid, please try again!\n");
         exit(EXIT_FAILURE);
     }
 
-    int res = print_tecnicofs_tree(fp);
-    fclose(fp);
+    int res = print_tecnicofs_tree(fd);
+    close(fd);
     return res;
 }
 
@@ -115,6 +226,118 @@ void init_socket(char * socketPath) {
 
 }
 
+/**
+ * Initializes the session socket, next to the server socket.
+ * Input:
+ *  - socketPath: the path of the server socket.
+ */
+void init_session_socket(char * socketPath) {
+    char sessionPath[sizeof(server_addr.sun_path)];
+    struct sockaddr_un addr;
+
+    if (snprintf(sessionPath, sizeof(sessionPath), "%s%s", socketPath, TFS_SESSION_SUFFIX) >= sizeof(sessionPath)) {
+        fprintf(stderr, "Server: socket path too long for sessions\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((sessionSocket = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+        perror("Server: Error opening session socket");
+        exit(EXIT_FAILURE);
+    }
+    if (unlink(sessionPath) == -1 && errno != ENOENT) {
+        perror("Error: Error unlinking session socket path");
+        exit(EXIT_FAILURE);
+    }
+    socklen_t len = setSocketAddressUn(sessionPath, &addr);
+    if (bind(sessionSocket, (struct sockaddr *) &addr, len) == -1 || listen(sessionSocket, SOMAXCONN) == -1) {
+        perror("Server: Error binding name to session socket");
+        exit(EXIT_FAILURE);
+    }
+    if (chmod(sessionPath, 222) == -1) {
+        perror("Server: can't change permissions of session socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Initializes the socket clients pass their shared memory on, next to the
+ * server socket.
+ * Input:
+ *  - socketPath: the path of the server socket.
+ */
+void init_shm_socket(char * socketPath) {
+    char shmPath[sizeof(server_addr.sun_path)];
+    struct sockaddr_un addr;
+
+    if (snprintf(shmPath, sizeof(shmPath), "%s%s", socketPath, TFS_SHM_SUFFIX) >= sizeof(shmPath)) {
+        fprintf(stderr, "Server: socket path too long for shared memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((shmSocket = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1) {
+        perror("Server: Error opening shared memory socket");
+        exit(EXIT_FAILURE);
+    }
+    if (unlink(shmPath) == -1 && errno != ENOENT) {
+        perror("Error: Error unlinking shared memory socket path");
+        exit(EXIT_FAILURE);
+    }
+    socklen_t len = setSocketAddressUn(shmPath, &addr);
+    if (bind(shmSocket, (struct sockaddr *) &addr, len) == -1 || listen(shmSocket, SOMAXCONN) == -1) {
+        perror("Server: Error binding name to shared memory socket");
+        exit(EXIT_FAILURE);
+    }
+    if (chmod(shmPath, 222) == -1) {
+        perror("Server: can't change permissions of shared memory socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Initializes the sockets of the workers, next to the server socket, and
+ * erases those a server with more of them left behind.
+ * Input:
+ *  - socketPath: the path of the server socket.
+ */
+void init_worker_sockets(char * socketPath) {
+    char path[sizeof(server_addr.sun_path)];
+    struct sockaddr_un addr;
+
+    for (int i = 0; ; i++) {
+        if (snprintf(path, sizeof(path), "%s.%d", socketPath, i) >= sizeof(path)) {
+            fprintf(stderr, "Server: socket path too long for worker sockets\n");
+            exit(EXIT_FAILURE);
+        }
+        if (unlink(path) == -1) {
+            if (errno != ENOENT) {
+                perror("Error: Error unlinking worker socket path");
+                exit(EXIT_FAILURE);
+            }
+            /* clients stop looking at the first one missing */
+            if (i >= workerSocketCount) {
+                break;
+            }
+        }
+        if (i >= workerSocketCount) {
+            continue;
+        }
+
+        if ((workerSockets[i] = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+            perror("Server: Error opening worker socket");
+            exit(EXIT_FAILURE);
+        }
+        socklen_t len = setSocketAddressUn(path, &addr);
+        if (bind(workerSockets[i], (struct sockaddr *) &addr, len) == -1) {
+            perror("Server: Error binding name to worker socket");
+            exit(EXIT_FAILURE);
+        }
+        if (chmod(path, 222) == -1) {
+            perror("Server: can't change permissions of worker socket");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 /**
  * Assigns number of threads inputted to global variable "numberThreads".
  */
@@ -128,24 +351,77 @@ void validateNumThreads(char * numThreads) {
     numberThreads = n;
 }
 
+/* Messages parsed and time spent parsing them, per wire format */
+static unsigned long parsed[2], parse_ns[2];
+/* Batch requests, and the operations they carried */
+static unsigned long batches, batched;
+/* Sessions, their requests, and the most requests one had in flight */
+static unsigned long sessionsOpened, sessionRequests, sessionMaxInFlight;
+/* Clients sharing memory, their requests, and the replies that had to wake them */
+static unsigned long shmClients, shmRequests, shmWakeups;
+
 /**
- * Calls the appropriate operation for each given command.
+ * Accounts for the parsing of a message.
  * Input:
- *  - command: the command to be applied.
+ *  - binary: whether it was a binary message
+ *  - start: time parsing started
  */
-int applyCommand(char* command) {
-    int opReturn; 
-    char token;
-    char name[MAX_INPUT_SIZE], arg[MAX_INPUT_SIZE];
-    int numTokens = sscanf(command, "%c %s %s", &token, name, arg);
-    if (numTokens < 2) {
-        fprintf(stderr, "Server: invalid command :%s: in Queue\n", command);
-        exit(EXIT_FAILURE);
+static void countParse(bool binary, unsigned long start) {
+    __atomic_add_fetch(&parse_ns[binary], now_ns() - start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&parsed[binary], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Prints the cost of parsing each wire format.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void printProtocolStats(FILE *fp) {
+    const char *names[] = { "text", "binary" };
+    for (int i = 0; i < 2; i++) {
+        unsigned long n = __atomic_load_n(&parsed[i], __ATOMIC_RELAXED);
+        unsigned long ns = __atomic_load_n(&parse_ns[i], __ATOMIC_RELAXED);
+        fprintf(fp, "protocol: %lu %s messages, %.1f ns per parse\n", n, names[i], n ? (double) ns / n : 0.0);
+    }
+    unsigned long n = __atomic_load_n(&batches, __ATOMIC_RELAXED);
+    unsigned long ops = __atomic_load_n(&batched, __ATOMIC_RELAXED);
+    fprintf(fp, "protocol: %lu batches, %.1f operations per batch\n", n, n ? (double) ops / n : 0.0);
+    fprintf(fp, "sessions: %lu opened, %lu requests, up to %lu in flight on one\n",
+            __atomic_load_n(&sessionsOpened, __ATOMIC_RELAXED), __atomic_load_n(&sessionRequests, __ATOMIC_RELAXED),
+            __atomic_load_n(&sessionMaxInFlight, __ATOMIC_RELAXED));
+    if (useShm) {
+        unsigned long requests = __atomic_load_n(&shmRequests, __ATOMIC_RELAXED);
+        fprintf(fp, "shm: %lu clients, %lu requests, %.1f%% of the replies woke the client\n",
+                __atomic_load_n(&shmClients, __ATOMIC_RELAXED), requests,
+                requests ? 100.0 * __atomic_load_n(&shmWakeups, __ATOMIC_RELAXED) / requests : 0.0);
     }
+}
 
-    switch (token) {
-        case 'c':
-            switch (arg[0]) {
+/**
+ * Accounts for a request received on a session.
+ * Input:
+ *  - inFlight: requests of the session in flight, this one included
+ */
+void countSessionRequest(unsigned long inFlight) {
+    __atomic_add_fetch(&sessionRequests, 1, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&sessionMaxInFlight, __ATOMIC_RELAXED);
+    while (inFlight > max &&
+           !__atomic_compare_exchange_n(&sessionMaxInFlight, &max, inFlight, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Calls the appropriate operation for a decoded request.
+ * Input:
+ *  - request: the request, whose paths the operation may alter.
+ */
+int applyRequest(TfsRequest *request) {
+    int opReturn;
+    char *name = request->paths[0], *arg = request->paths[1];
+
+    switch (request->opcode) {
+        case TFS_OP_CREATE:
+            switch (request->nodeType) {
                 case 'f':
                     opReturn = create_aux(name, T_FILE);
                     break;
@@ -157,18 +433,25 @@ int applyCommand(char* command) {
                     exit(EXIT_FAILURE);
             }
             break;
-        case 'l':
-            opReturn = lookup_aux(name);
+        case TFS_OP_LOOKUP:
+            opReturn = lookup_hashed_aux(name, request->hashes[0], request->hashCount[0]);
             break;
-        case 'd':
+        case TFS_OP_DELETE:
             opReturn = delete_aux(name);
             break;
-        case 'm':
+        case TFS_OP_MOVE:
+            if (!arg) {
+                fprintf(stderr, "Error: move without destination\n");
+                exit(EXIT_FAILURE);
+            }
             opReturn = move_aux(name, arg);
             break;
-        case 'p':
+        case TFS_OP_PRINT:
             opReturn = print_tecnicofs_tree_aux(name);
             break;
+        case TFS_OP_SAVE:
+            opReturn = save_tecnicofs_image_aux(name);
+            break;
         default: { /* error */
             fprintf(stderr, "Error: command to apply\n");
             exit(EXIT_FAILURE);
@@ -179,13 +462,197 @@ int applyCommand(char* command) {
 }
 
 /**
- * Reads commands from the client socket and calls the "applyCommand" function to each one of them.
+ * Checks the size of a datagram: only binary batches get the room of
+ * TFS_MAX_BATCH_MESSAGE, text commands are shorter than MAX_INPUT_SIZE,
+ * as they always were.
+ * Input:
+ *  - message, length: the datagram.
+ * Returns: true if it fits, false if it is to be dropped
+ */
+bool validLength(const char *message, size_t length) {
+    if (!tfs_is_binary(message, length) && length >= MAX_INPUT_SIZE) {
+        fprintf(stderr, "Server: text command too long\n");
+        return false;
+    }
+    return length <= TFS_MAX_BATCH_MESSAGE;
+}
+
+/**
+ * Parses a text command into a request.
+ * Input:
+ *  - command: the command, NUL terminated.
+ *  - request: set to the request.
+ *  - name, arg: MAX_INPUT_SIZE buffers for the tokens it points to.
+ */
+void parseCommand(char *command, TfsRequest *request, char *name, char *arg) {
+    char token;
+    unsigned long start = now_ns();
+    /* words are cut to the MAX_INPUT_SIZE buffers, which the message may not fit in */
+    int numTokens = sscanf(command, "%c %99s %99s", &token, name, arg);
+    if (numTokens < 2) {
+        fprintf(stderr, "Server: invalid command :%s: in Queue\n", command);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(request, 0, sizeof(*request));
+    request->opcode = token;
+    request->pathCount = 1;
+    request->paths[0] = name;
+    if (numTokens == 3 && token == TFS_OP_CREATE) {
+        request->nodeType = arg[0];
+    } else if (numTokens == 3) {
+        request->paths[request->pathCount++] = arg;
+    }
+    countParse(false, start);
+}
+
+/**
+ * Parses a text command and calls the appropriate operation.
+ * Input:
+ *  - command: the command to be applied.
+ */
+int applyCommand(char* command) {
+    char name[MAX_INPUT_SIZE], arg[MAX_INPUT_SIZE];
+    TfsRequest request;
+
+    parseCommand(command, &request, name, arg);
+    return applyRequest(&request);
+}
+
+/**
+ * Applies the operations of a transaction, all or none of them.
+ * Input:
+ *  - requests, count: the creations, deletions and moves, in order
+ *  - results: set to the result of each one
+ * Returns: SUCCESS if the transaction committed, FAIL otherwise
+ */
+int applyTransaction(TfsRequest *requests, int count, int *results) {
+    txn_op ops[MAX_TXN_OPS];
+
+    for (int i = 0; i < count; i++) {
+        TfsRequest *request = &requests[i];
+        ops[i].op = request->opcode;
+        ops[i].path = request->paths[0];
+        ops[i].newPath = request->pathCount > 1 ? request->paths[1] : NULL;
+        ops[i].nodeType = request->nodeType == 'd' ? T_DIRECTORY : T_FILE;
+    }
+
+    return transaction_aux(ops, count, results);
+}
+
+/**
+ * Checks a decoded request is one applyRequest, or a transaction, can apply.
+ * Input:
+ *  - request: the request, with at least one path
+ *  - inTransaction: whether it is an operation of a transaction, which
+ *    only holds creations, deletions and moves
+ * Returns: true if it is, false otherwise
+ */
+bool validRequest(TfsRequest *request, bool inTransaction) {
+    switch (request->opcode) {
+        case TFS_OP_CREATE:
+            return request->nodeType == 'f' || request->nodeType == 'd';
+        case TFS_OP_MOVE:
+            return request->pathCount == 2;
+        case TFS_OP_DELETE:
+            return true;
+        case TFS_OP_LOOKUP:
+        case TFS_OP_PRINT:
+        case TFS_OP_SAVE:
+            return !inTransaction;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Decodes a binary request, or batch of them, in place.
+ * Input:
+ *  - message, length: the request.
+ *  - requests: set to its requests, room for TFS_MAX_BATCH.
+ * Returns: the number of requests, or FAIL if the message is invalid, and
+ *  gets no reply
+ */
+int decodeBinary(char *message, size_t length, TfsRequest *requests) {
+    unsigned long start = now_ns();
+    int opcode = length >= sizeof(TfsHeader) ? ((TfsHeader *) message)->opcode : 0;
+    int count = 1;
+
+    if (opcode == TFS_OP_BATCH || opcode == TFS_OP_TRANSACTION) {
+        if ((count = tfs_decode_batch(message, length, requests)) < 0) {
+            fprintf(stderr, "Server: invalid batch request\n");
+            return FAIL;
+        }
+    } else if (!tfs_decode_request(message, length, &requests[0])) {
+        fprintf(stderr, "Server: invalid binary request\n");
+        return FAIL;
+    }
+    /* applyRequest exits on what it can't apply */
+    for (int i = 0; i < count; i++) {
+        if (!validRequest(&requests[i], opcode == TFS_OP_TRANSACTION)) {
+            fprintf(stderr, "Server: invalid operation in binary request\n");
+            return FAIL;
+        }
+    }
+    countParse(true, start);
+    return count;
+}
+
+/**
+ * Applies a decoded binary request, or batch of them.
+ * Input:
+ *  - message: the request.
+ *  - requests, count: as decodeBinary left them.
+ *  - reply: set to the reply, room for a batch reply.
+ * Returns: the size of the reply
+ */
+size_t applyDecoded(char *message, TfsRequest *requests, int count, char *reply) {
+    int results[TFS_MAX_BATCH];
+    int opcode = ((TfsHeader *) message)->opcode;
+
+    if (opcode == TFS_OP_BATCH || opcode == TFS_OP_TRANSACTION) {
+        if (opcode == TFS_OP_TRANSACTION) {
+            applyTransaction(requests, count, results);
+        } else {
+            __atomic_add_fetch(&batches, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&batched, count, __ATOMIC_RELAXED);
+            /* in order, as if sent one by one */
+            for (int i = 0; i < count; i++) {
+                results[i] = applyRequest(&requests[i]);
+            }
+        }
+        return tfs_encode_batch_reply(reply, opcode, ((TfsHeader *) message)->requestId, results, count);
+    }
+    return tfs_encode_reply(reply, &requests[0], applyRequest(&requests[0]));
+}
+
+/**
+ * Decodes a binary request, or batch of them, and applies it.
+ * Input:
+ *  - message, length: the request, decoded in place.
+ *  - reply: set to the reply, room for a batch reply.
+ * Returns: the size of the reply, or 0 if the message is invalid
+ */
+size_t applyBinary(char *message, size_t length, char *reply) {
+    TfsRequest requests[TFS_MAX_BATCH];
+    int count = decodeBinary(message, length, requests);
+    return count == FAIL ? 0 : applyDecoded(message, requests, count, reply);
+}
+
+/**
+ * Reads commands from a client socket, binary requests or text commands,
+ * and applies each one of them.
+ * Input:
+ *  - arg: the socket, or NULL for the server socket
  */
-void * receiveCommands() {
+void * receiveCommands(void * arg) {
 
+    int sock = arg ? *(int *) arg : scsocket;
     struct sockaddr_un client_addr;
     socklen_t addr_len;
-    char command[MAX_INPUT_SIZE];
+    /* binary requests are decoded in place, and hold 4-byte fields */
+    char command[TFS_MAX_BATCH_MESSAGE + 1] __attribute__((aligned(8)));
+    char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
     int bytesReceived, opReturn;
 
     while (true) {
@@ -193,12 +660,25 @@ void * receiveCommands() {
         addr_len = sizeof(struct sockaddr_un);
 
         /* Receive command sent by the client socket */
-        bytesReceived = recvfrom(scsocket, command, sizeof(command), 0, (struct sockaddr *) &client_addr, &addr_len);
+        bytesReceived = recvfrom(sock, command, sizeof(command) - 1, 0, (struct sockaddr *) &client_addr, &addr_len);
         
         if (bytesReceived == -1) {
             perror("Server: error receiving message from client");
             exit(EXIT_FAILURE);
         }
+        if (!validLength(command, bytesReceived)) {
+            continue;
+        }
+
+        if (tfs_is_binary(command, bytesReceived)) {
+            size_t length = applyBinary(command, bytesReceived, reply);
+            /* an invalid request is dropped */
+            if (length && sendto(sock, reply, length, 0, (struct sockaddr *) &client_addr, addr_len) == -1) {
+                perror("Server: error sending operation return to client");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
         
         command[bytesReceived] = '\0';
 
@@ -206,7 +686,7 @@ void * receiveCommands() {
         opReturn = applyCommand(command);
 
         /* Send such value to the client socket for it to analyse it */
-        if (sendto(scsocket, &opReturn, sizeof(opReturn), 0, (struct sockaddr *) &client_addr, addr_len) == -1) {
+        if (sendto(sock, &opReturn, sizeof(opReturn), 0, (struct sockaddr *) &client_addr, addr_len) == -1) {
             perror("Server: error sending operation return to client");
             exit(EXIT_FAILURE);
         }
@@ -216,22 +696,401 @@ void * receiveCommands() {
 }
 
 
+/* A request received on a session, waiting for a worker */
+typedef struct sessionJob {
+    Session *session;
+    struct sessionJob *next;
+    size_t length;
+    char message[] __attribute__((aligned(8)));
+} SessionJob;
+
+static SessionJob *jobHead = NULL, *jobTail = NULL;
+static pthread_mutex_t jobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Starts a session on an accepted connection.
+ * Input:
+ *  - fd: the connection
+ * Returns: the session, referenced by its reader
+ */
+Session *openSession(int fd) {
+    Session *session = malloc(sizeof(Session));
+    if (!session) {
+        fprintf(stderr, "Server: error allocating session\n");
+        exit(EXIT_FAILURE);
+    }
+    session->fd = fd;
+    session->refs = 1;
+    session->inFlight = 0;
+    pthread_mutex_init(&session->sendMutex, NULL);
+    __atomic_add_fetch(&sessionsOpened, 1, __ATOMIC_RELAXED);
+    return session;
+}
+
+/**
+ * Drops a reference to a session, closing it with the last one.
+ */
+void releaseSession(Session *session) {
+    if (__atomic_sub_fetch(&session->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(session->fd);
+        pthread_mutex_destroy(&session->sendMutex);
+        free(session);
+    }
+}
+
+/**
+ * Applies the requests of every session, as they arrive, and sends each
+ * reply as soon as its request is done, so a session's replies may come
+ * back in another order than its requests.
+ */
+void * applySessionRequests() {
+
+    char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+
+    while (true) {
+        pthread_mutex_lock(&jobMutex);
+        while (!jobHead) {
+            pthread_cond_wait(&jobReady, &jobMutex);
+        }
+        SessionJob *job = jobHead;
+        if (!(jobHead = job->next)) {
+            jobTail = NULL;
+        }
+        pthread_mutex_unlock(&jobMutex);
+
+        Session *session = job->session;
+        size_t length = applyBinary(job->message, job->length, reply);
+
+        pthread_mutex_lock(&session->sendMutex);
+        /* a client that sent an invalid request is let go, and its reader with it */
+        if (!length) {
+            shutdown(session->fd, SHUT_RDWR);
+        }
+        /* a client that went away no longer needs its replies */
+        if (length && send(session->fd, reply, length, MSG_NOSIGNAL) == -1 && errno != EPIPE && errno != ECONNRESET) {
+            perror("Server: error sending reply on a session");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_unlock(&session->sendMutex);
+
+        __atomic_sub_fetch(&session->inFlight, 1, __ATOMIC_RELAXED);
+        releaseSession(session);
+        free(job);
+    }
+
+}
+
+/**
+ * Reads the requests of a session and queues them for the workers,
+ * without waiting for the replies, until the client closes it.
+ * Input:
+ *  - arg: the session
+ */
+void * readSession(void * arg) {
+
+    Session *session = arg;
+    char message[TFS_MAX_BATCH_MESSAGE + 1] __attribute__((aligned(8)));
+
+    while (true) {
+        ssize_t length = recv(session->fd, message, sizeof(message), 0);
+        if (length == 0 || (length == -1 && errno == ECONNRESET)) {
+            break;
+        }
+        if (length == -1) {
+            perror("Server: error receiving from a session");
+            exit(EXIT_FAILURE);
+        }
+        if (length > TFS_MAX_BATCH_MESSAGE || !tfs_is_binary(message, length)) {
+            fprintf(stderr, "Server: sessions only take binary requests\n");
+            break;
+        }
+
+        SessionJob *job = malloc(sizeof(SessionJob) + length);
+        if (!job) {
+            fprintf(stderr, "Server: error allocating session request\n");
+            exit(EXIT_FAILURE);
+        }
+        job->session = session;
+        job->next = NULL;
+        job->length = length;
+        memcpy(job->message, message, length);
+        __atomic_add_fetch(&session->refs, 1, __ATOMIC_RELAXED);
+        countSessionRequest(__atomic_add_fetch(&session->inFlight, 1, __ATOMIC_RELAXED));
+
+        pthread_mutex_lock(&jobMutex);
+        if (jobTail) {
+            jobTail->next = job;
+        } else {
+            jobHead = job;
+        }
+        jobTail = job;
+        pthread_cond_signal(&jobReady);
+        pthread_mutex_unlock(&jobMutex);
+    }
+
+    releaseSession(session);
+    return NULL;
+
+}
+
+/**
+ * Accepts the connections to the session socket, each read by a thread
+ * of its own.
+ */
+void * acceptSessions() {
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (true) {
+        int fd = accept(sessionSocket, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Server: error accepting a session");
+            exit(EXIT_FAILURE);
+        }
+
+        Session *session = openSession(fd);
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, readSession, session) != 0) {
+            fprintf(stderr, "Session thread failed to create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+}
+
+/* A client sharing memory with the server */
+typedef struct shmClient {
+    int fd;                      /* its connection, closed when it goes away */
+    TfsShm *shm;
+} ShmClient;
+
+/**
+ * Applies the requests a client puts in the memory it shares with the
+ * server, as they come, until it goes away.
+ * Input:
+ *  - arg: the client
+ */
+void * pollShm(void * arg) {
+
+    ShmClient *client = arg;
+    TfsShm *shm = client->shm;
+    /* the client may not touch a request before its reply, but is not trusted to */
+    char message[TFS_MAX_BATCH_MESSAGE + 1] __attribute__((aligned(8)));
+    uint32_t slot;
+    char byte;
+
+    while (true) {
+        if (!tfs_ring_wait(&shm->submissions, &slot, TFS_RING_WAIT_MS)) {
+            /* the memory outlives a client that went away */
+            ssize_t n = recv(client->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                break;
+            }
+            continue;
+        }
+
+        TfsShmSlot *request = &shm->slots[slot % TFS_SHM_SLOTS];
+        size_t length = request->length;
+        if (length > TFS_MAX_BATCH_MESSAGE || !tfs_is_binary(request->request, length)) {
+            fprintf(stderr, "Server: invalid request in shared memory\n");
+            break;
+        }
+        memcpy(message, request->request, length);
+        if (!(request->replyLength = applyBinary(message, length, request->reply))) {
+            break;
+        }
+        __atomic_add_fetch(&shmRequests, 1, __ATOMIC_RELAXED);
+        if (tfs_ring_push(&shm->completions, slot)) {
+            __atomic_add_fetch(&shmWakeups, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    munmap(shm, sizeof(TfsShm));
+    close(client->fd);
+    free(client);
+    return NULL;
+
+}
+
+/**
+ * Accepts the clients that share memory with the server, receiving their
+ * memfd, each polled by a thread of its own.
+ */
+void * acceptShm() {
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (true) {
+        int fd = accept(shmSocket, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Server: error accepting a shared memory client");
+            exit(EXIT_FAILURE);
+        }
+
+        char byte;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                              .msg_controllen = sizeof(control) };
+        struct cmsghdr *cmsg;
+        int memfd = -1;
+        struct stat st;
+
+        if (recvmsg(fd, &msg, 0) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+            cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&memfd, CMSG_DATA(cmsg), sizeof(memfd));
+        }
+        /* a client that sent no memory, or too little, is turned away */
+        void *shm = MAP_FAILED;
+        if (memfd != -1 && fstat(memfd, &st) == 0 && st.st_size >= sizeof(TfsShm)) {
+            shm = mmap(NULL, sizeof(TfsShm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        }
+        if (memfd != -1) {
+            close(memfd);
+        }
+        if (shm == MAP_FAILED) {
+            fprintf(stderr, "Server: shared memory client sent no memory\n");
+            close(fd);
+            continue;
+        }
+
+        ShmClient *client = malloc(sizeof(ShmClient));
+        if (!client) {
+            fprintf(stderr, "Server: error allocating shared memory client\n");
+            exit(EXIT_FAILURE);
+        }
+        client->fd = fd;
+        client->shm = shm;
+
+        /* tells the client its memory is in use */
+        if (send(fd, &byte, 1, MSG_NOSIGNAL) == -1) {
+            munmap(shm, sizeof(TfsShm));
+            close(fd);
+            free(client);
+            continue;
+        }
+        __atomic_add_fetch(&shmClients, 1, __ATOMIC_RELAXED);
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, pollShm, client) != 0) {
+            fprintf(stderr, "Shared memory thread failed to create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+}
+
+/**
+ * Waits for signals sent to the server: SIGUSR1 prints the filesystem
+ * statistics to stderr, SIGINT and SIGTERM sync the log and save the
+ * image, if there are any, and stop the server.
+ */
+void * handleSignals(void * arg) {
+
+    sigset_t * signals = arg;
+    int signal;
+
+    while (true) {
+        if (sigwait(signals, &signal) != 0) {
+            fprintf(stderr, "Server: error waiting for signals\n");
+            exit(EXIT_FAILURE);
+        }
+        if (signal == SIGUSR1) {
+            print_fs_stats(stderr);
+            printProtocolStats(stderr);
+            engine_print_stats(stderr);
+        } else if (signal == SIGINT || signal == SIGTERM) {
+            sync_fs();
+            if (imagePath && save_tecnicofs_image(imagePath) == FAIL) {
+                fprintf(stderr, "Server: error saving image to %s\n", imagePath);
+                exit(EXIT_FAILURE);
+            }
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+}
+
+/**
+ * Blocks the handled signals in every thread and starts the thread that waits for them.
+ * Must be called before any other thread is created.
+ */
+void startSignalHandler() {
+
+    static sigset_t signals;
+    pthread_t tid;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        fprintf(stderr, "Server: error blocking signals\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&tid, NULL, handleSignals, &signals) != 0) {
+        fprintf(stderr, "Signal handling thread failed to create\n");
+        exit(EXIT_FAILURE);
+    }
+
+}
+
+/**
+ * Starts the threads applying the requests of the sessions, and the one
+ * accepting them, once the session socket is listening.
+ */
+void startSessionThreads() {
+
+    pthread_t tid;
+
+    for (int i = 0; i < numberThreads; i++) {
+        if (pthread_create(&tid, NULL, applySessionRequests, NULL) != 0 || pthread_detach(tid) != 0) {
+            fprintf(stderr, "Session thread %d failed to create\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pthread_create(&tid, NULL, acceptSessions, NULL) != 0 || pthread_detach(tid) != 0) {
+        fprintf(stderr, "Session accepting thread failed to create\n");
+        exit(EXIT_FAILURE);
+    }
+
+}
+
 /**
  * Initializes the thread pool.
  * Input:
- *  - inputPath: string containing the input file path
+ *  - receive: what each thread receiving datagrams runs
  */
-void startThreadPool() {
+void startThreadPool(void *(*receive)(void *)) {
 
-    pthread_t tid[numberThreads];
+    pthread_t tid[numberThreads], unroutedTid;
 
-    /* Create consuming threads */
+    /* Create consuming threads, split over the worker sockets if there are any */
     for (int i = 0; i < numberThreads; i++) {
-        if (pthread_create(&tid[i], NULL, receiveCommands, NULL) != 0) {
+        void *sock = workerSocketCount ? &workerSockets[i % workerSocketCount] : NULL;
+        if (pthread_create(&tid[i], NULL, receive, sock) != 0) {
             fprintf(stderr, "Thread %d failed to create\n", i);
             exit(EXIT_FAILURE);
         }
     }
+    /* and one for the server socket, for clients that don't route their requests */
+    if (workerSocketCount && (pthread_create(&unroutedTid, NULL, receive, NULL) != 0 ||
+                              pthread_detach(unroutedTid) != 0)) {
+        fprintf(stderr, "Server socket thread failed to create\n");
+        exit(EXIT_FAILURE);
+    }
 
     for (int i = 0; i < numberThreads; i++) {
         if (pthread_join(tid[i], NULL) != 0) {
@@ -245,14 +1104,35 @@ void startThreadPool() {
 int main(int argc, char* argv[]) {
 
     /* Initialize TecnicoFS and i-node table */
-    init_fs_aux(argc);
+    init_fs_aux(argc, argv);
 
     /* Initialize server socket */
-    init_socket(argv[2]);
+    init_socket(argv[optind + 1]);
+    init_session_socket(argv[optind + 1]);
+    init_worker_sockets(argv[optind + 1]);
+    if (useShm) {
+        init_shm_socket(argv[optind + 1]);
+    }
 
     /* TecnicoFS execution */
-    validateNumThreads(argv[1]);
-    startThreadPool();
+    validateNumThreads(argv[optind]);
+    if (workerSocketCount > numberThreads) {
+        fprintf(stderr, "More worker sockets than threads to drain them!\n");
+        exit(EXIT_FAILURE);
+    }
+    startSignalHandler();
+    pthread_t shmTid;
+    if (useShm && (pthread_create(&shmTid, NULL, acceptShm, NULL) != 0 || pthread_detach(shmTid) != 0)) {
+        fprintf(stderr, "Shared memory accepting thread failed to create\n");
+        exit(EXIT_FAILURE);
+    }
+    if (engine == ENGINE_EPOLL || engine == ENGINE_URING) {
+        engine_run(engine, ioThreads, partitions);
+    } else {
+        /* init_session_socket exits unless the session socket is listening */
+        startSessionThreads();
+        startThreadPool(engine == ENGINE_MMSG ? engine_receive_batches : receiveCommands);
+    }
 
     /* Destroy TecnicoFS and i-node table */
     destroy_fs();
@@ -0,0 +1,41 @@
+#ifndef TECNICOFS_SERVER_H
+#define TECNICOFS_SERVER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "../tecnicofs-protocol.h"
+
+/* A client connection to the session socket */
+typedef struct session {
+    int fd;
+    int refs;                    /* its reader, and each of its requests in flight */
+    int inFlight;
+    pthread_mutex_t sendMutex;   /* replies are sent by many workers */
+} Session;
+
+extern int numberThreads;
+extern int scsocket;
+extern int sessionSocket;
+
+/**
+ * Returns the current time in nanoseconds.
+ */
+static inline unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+bool validLength(const char *message, size_t length);
+void parseCommand(char *command, TfsRequest *request, char *name, char *arg);
+int applyRequest(TfsRequest *request);
+int applyCommand(char *command);
+int decodeBinary(char *message, size_t length, TfsRequest *requests);
+size_t applyDecoded(char *message, TfsRequest *requests, int count, char *reply);
+Session *openSession(int fd);
+void releaseSession(Session *session);
+void countSessionRequest(unsigned long inFlight);
+
+#endif /* TECNICOFS_SERVER_H */
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "fs/state.h"
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/*
+ * Sets up a ring and maps its queues.
+ * Input:
+ *  - ring: to set up
+ *  - entries: of the submission queue; the completion queue has four
+ *    times as many, as multishot requests complete many times
+ * Returns: SUCCESS or FAIL, with errno set
+ */
+int uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = io_uring_setup(entries, &params)) == -1) {
+        return FAIL;
+    }
+    /* buffer rings came after single mappings */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return FAIL;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize;
+    ring->sqRing = ring->cqRing = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       ring->fd, IORING_OFF_SQ_RING);
+    ring->sqRingSize = ring->cqRingSize = size;
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return FAIL;
+    }
+
+    char *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    /* each submission entry always sits in its own slot */
+    for (unsigned i = 0; i < ring->sqEntries; i++) {
+        ring->sqArray[i] = i;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Takes the next submission entry, cleared, submitting the pending ones
+ * first if the queue is full.
+ * Returns: the entry
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned tail = *ring->sqTail;
+
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        if (uring_submit_and_wait(ring, 0) == FAIL) {
+            perror("Server: error submitting to io_uring");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->sqPending++;
+    return sqe;
+}
+
+/*
+ * Submits the pending entries, and waits for completions, in one call.
+ * Input:
+ *  - waitFor: completions to wait for
+ * Returns: SUCCESS or FAIL, with errno set
+ */
+int uring_submit_and_wait(Uring *ring, unsigned waitFor) {
+    int submitted;
+    while ((submitted = io_uring_enter(ring->fd, ring->sqPending, waitFor,
+                                       waitFor ? IORING_ENTER_GETEVENTS : 0)) == -1) {
+        if (errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            return FAIL;
+        }
+        /* the entries were not taken: retry them once the completions are read */
+        if (errno != EINTR) {
+            return SUCCESS;
+        }
+    }
+    ring->sqPending -= submitted;
+    return SUCCESS;
+}
+
+/*
+ * Returns: the next completion, or NULL if there is none yet
+ */
+struct io_uring_cqe *uring_peek(Uring *ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+/*
+ * Hands the completion uring_peek returned back to the kernel.
+ */
+void uring_seen(Uring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Allocates a ring of buffers and registers it with a ring.
+ * Input:
+ *  - group: id the receives pick their buffers from it by
+ *  - count: of buffers, a power of 2
+ *  - size: of each buffer
+ * Returns: SUCCESS or FAIL, with errno set
+ */
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, int group, unsigned count, size_t size) {
+    buffers->ring = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffers->memory = malloc(count * size);
+    buffers->count = count;
+    buffers->size = size;
+    buffers->group = group;
+    if (buffers->ring == MAP_FAILED || !buffers->memory) {
+        fprintf(stderr, "Server: error allocating io_uring buffers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long) buffers->ring, .ring_entries = count, .bgid = group
+    };
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        return FAIL;
+    }
+    buffers->ring->tail = 0;
+    for (unsigned i = 0; i < count; i++) {
+        uring_buffer_recycle(buffers, i);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Returns: the buffer of an id
+ */
+char *uring_buffer(UringBuffers *buffers, unsigned id) {
+    return buffers->memory + id * buffers->size;
+}
+
+/*
+ * Gives a buffer back to the kernel, once its contents are no longer needed.
+ */
+void uring_buffer_recycle(UringBuffers *buffers, unsigned id) {
+    unsigned short tail = buffers->ring->tail;
+    struct io_uring_buf *buf = &buffers->ring->bufs[tail & (buffers->count - 1)];
+
+    buf->addr = (unsigned long) uring_buffer(buffers, id);
+    buf->len = buffers->size;
+    buf->bid = id;
+    __atomic_store_n(&buffers->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,42 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, over the raw system calls: a submission and a
+ * completion queue shared with the kernel, and rings of buffers the
+ * kernel picks from for multishot receives.
+ */
+typedef struct uring {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    unsigned sqPending;          /* entries filled in but not submitted */
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+} Uring;
+
+/* A ring of equally sized buffers the kernel fills, registered as a group */
+typedef struct uringBuffers {
+    struct io_uring_buf_ring *ring;
+    char *memory;
+    unsigned count;
+    size_t size;
+    int group;
+} UringBuffers;
+
+int uring_init(Uring *ring, unsigned entries);
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+int uring_submit_and_wait(Uring *ring, unsigned waitFor);
+struct io_uring_cqe *uring_peek(Uring *ring);
+void uring_seen(Uring *ring);
+int uring_buffers_init(Uring *ring, UringBuffers *buffers, int group, unsigned count, size_t size);
+char *uring_buffer(UringBuffers *buffers, unsigned id);
+void uring_buffer_recycle(UringBuffers *buffers, unsigned id);
+
+#endif /* URING_H */
@@ -0,0 +1,418 @@
+/* tecnicofs-protocol.c */
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "tecnicofs-protocol.h"
+
+/*
+ * Hashes a path component (32-bit FNV-1a), as the server indexes directory entries.
+ * Input:
+ *  - name: the component
+ *  - length: its length
+ */
+uint32_t tfs_hash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Hashes the components of a path, in order.
+ * Input:
+ *  - path: the path
+ *  - hashes: set to the hashes, TFS_MAX_COMPONENTS of them at most
+ * Returns: the number of components, or -1 if there are too many
+ */
+int tfs_path_hashes(const char *path, uint32_t *hashes) {
+    int count = 0;
+    while (*path) {
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+        size_t length = strcspn(path, "/");
+        if (count == TFS_MAX_COMPONENTS) {
+            return -1;
+        }
+        hashes[count++] = tfs_hash(path, length);
+        path += length;
+    }
+    return count;
+}
+
+/*
+ * Picks the worker socket of a path, by the hash of its first component.
+ * Input:
+ *  - path: the path
+ *  - sockets: number of worker sockets
+ * Returns: the index of the socket
+ */
+int tfs_route(const char *path, int sockets) {
+    path += strspn(path, "/");
+    return tfs_hash(path, strcspn(path, "/")) % sockets;
+}
+
+/*
+ * Tells binary messages from text commands.
+ */
+bool tfs_is_binary(const void *message, size_t length) {
+    return length > 0 && *(const uint8_t *) message == TFS_MAGIC;
+}
+
+/*
+ * Appends a path to a request.
+ * Returns: the bytes taken, or 0 if the path is too long
+ */
+static size_t tfs_encode_path(char *at, const char *path, bool hashed) {
+    TfsPath *header = (TfsPath *) at;
+    size_t length = strlen(path);
+    if (length >= MAX_FILE_NAME) {
+        return 0;
+    }
+
+    int hashCount = 0;
+    if (hashed && (hashCount = tfs_path_hashes(path, (uint32_t *) (at + sizeof(TfsPath)))) < 0) {
+        hashCount = 0;
+    }
+    header->length = length;
+    header->hashCount = hashCount;
+
+    char *name = at + sizeof(TfsPath) + hashCount * sizeof(uint32_t);
+    memcpy(name, path, length + 1);
+    size_t size = sizeof(TfsPath) + hashCount * sizeof(uint32_t) + length + 1;
+    size_t padded = (size + 3) & ~(size_t) 3;
+    memset(at + size, 0, padded - size);
+    return padded;
+}
+
+/*
+ * Encodes a request.
+ * Input:
+ *  - message: where to encode it, TFS_MAX_MESSAGE bytes, 4-byte aligned
+ *  - opcode: one of TFS_OP_*
+ *  - id: identifies the request in its reply
+ *  - flags: TFS_FLAG_* bits
+ *  - nodeType: 'f' or 'd' for creations, 0 otherwise
+ *  - path: the path of the request
+ *  - path2: the second path of a move, or NULL
+ * Returns: the size of the request, or 0 if a path is too long
+ */
+size_t tfs_encode_request(void *message, int opcode, uint32_t id, int flags, char nodeType,
+                          const char *path, const char *path2) {
+    TfsHeader *header = message;
+    const char *paths[TFS_MAX_PATHS] = { path, path2 };
+    size_t size = sizeof(TfsHeader);
+
+    header->magic = TFS_MAGIC;
+    header->version = TFS_VERSION;
+    header->opcode = opcode;
+    header->flags = flags;
+    header->requestId = id;
+    header->nodeType = nodeType;
+    header->pathCount = 0;
+    for (int i = 0; i < TFS_MAX_PATHS && paths[i]; i++) {
+        size_t taken = tfs_encode_path((char *) message + size, paths[i], flags & TFS_FLAG_HASHES);
+        if (taken == 0) {
+            return 0;
+        }
+        size += taken;
+        header->pathCount++;
+    }
+    header->length = size - sizeof(TfsHeader);
+    return size;
+}
+
+/*
+ * Decodes a request in place: its paths and hashes are left in the message.
+ * Input:
+ *  - message: the request, 4-byte aligned
+ *  - length: its size
+ *  - request: set to the decoded request
+ * Returns: true, or false if the request is malformed
+ */
+bool tfs_decode_request(void *message, size_t length, TfsRequest *request) {
+    TfsHeader *header = message;
+    if (length < sizeof(TfsHeader) || header->magic != TFS_MAGIC || header->version != TFS_VERSION ||
+        header->pathCount < 1 || header->pathCount > TFS_MAX_PATHS ||
+        header->length != length - sizeof(TfsHeader)) {
+        return false;
+    }
+
+    request->opcode = header->opcode;
+    request->id = header->requestId;
+    request->flags = header->flags;
+    request->nodeType = header->nodeType;
+    request->pathCount = header->pathCount;
+
+    char *at = (char *) message + sizeof(TfsHeader), *end = (char *) message + length;
+    for (int i = 0; i < TFS_MAX_PATHS; i++) {
+        request->paths[i] = NULL;
+        request->hashes[i] = NULL;
+        request->hashCount[i] = 0;
+        if (i >= header->pathCount) {
+            continue;
+        }
+
+        TfsPath *path = (TfsPath *) at;
+        if (end - at < sizeof(TfsPath) || path->length >= MAX_FILE_NAME ||
+            path->hashCount > TFS_MAX_COMPONENTS) {
+            return false;
+        }
+        size_t size = sizeof(TfsPath) + path->hashCount * sizeof(uint32_t) + path->length + 1;
+        size_t padded = (size + 3) & ~(size_t) 3;
+        char *name = at + sizeof(TfsPath) + path->hashCount * sizeof(uint32_t);
+        if (end - at < padded || name[path->length] != '\0' || memchr(name, '\0', path->length)) {
+            return false;
+        }
+
+        request->paths[i] = name;
+        if (header->flags & TFS_FLAG_HASHES) {
+            request->hashes[i] = (const uint32_t *) (at + sizeof(TfsPath));
+            request->hashCount[i] = path->hashCount;
+        }
+        at += padded;
+    }
+    return at == end;
+}
+
+/*
+ * Encodes the reply to a request.
+ * Input:
+ *  - message: where to encode it
+ *  - request: the request
+ *  - result: the result of the operation
+ * Returns: the size of the reply
+ */
+size_t tfs_encode_reply(void *message, const TfsRequest *request, int result) {
+    TfsReply *reply = message;
+    reply->magic = TFS_MAGIC;
+    reply->version = TFS_VERSION;
+    reply->opcode = request->opcode;
+    reply->flags = 0;
+    reply->requestId = request->id;
+    reply->result = result;
+    return sizeof(TfsReply);
+}
+
+/*
+ * Decodes the reply to a request.
+ * Input:
+ *  - message, length: the reply
+ *  - id: identifier of the request
+ *  - result: set to the result of the operation
+ * Returns: true, or false if it is not the reply to that request
+ */
+bool tfs_decode_reply(const void *message, size_t length, uint32_t id, int *result) {
+    const TfsReply *reply = message;
+    if (length != sizeof(TfsReply) || reply->magic != TFS_MAGIC ||
+        reply->version != TFS_VERSION || reply->requestId != id) {
+        return false;
+    }
+    *result = reply->result;
+    return true;
+}
+
+/*
+ * Starts a batch request, or a transaction, which has the same layout.
+ * Input:
+ *  - message: where to encode it, TFS_MAX_BATCH_MESSAGE bytes, 4-byte aligned
+ *  - opcode: TFS_OP_BATCH or TFS_OP_TRANSACTION
+ *  - id: identifies the batch in its reply
+ * Returns: the size of the empty batch
+ */
+size_t tfs_batch_begin(void *message, int opcode, uint32_t id) {
+    TfsHeader *header = message;
+    TfsBatch *batch = (TfsBatch *) (header + 1);
+
+    header->magic = TFS_MAGIC;
+    header->version = TFS_VERSION;
+    header->opcode = opcode;
+    header->flags = 0;
+    header->requestId = id;
+    header->nodeType = 0;
+    header->pathCount = 0;
+    header->length = sizeof(TfsBatch);
+    batch->count = 0;
+    batch->reserved = 0;
+    return sizeof(TfsHeader) + sizeof(TfsBatch);
+}
+
+/*
+ * Appends an operation to a batch request, as tfs_encode_request encodes it.
+ * Input:
+ *  - message: the batch
+ *  - size: its current size
+ *  - opcode, flags, nodeType, path, path2: the operation
+ * Returns: the new size of the batch, or 0 if the batch is full or a path
+ *  is too long
+ */
+size_t tfs_batch_add(void *message, size_t size, int opcode, int flags, char nodeType,
+                     const char *path, const char *path2) {
+    TfsHeader *header = message;
+    TfsBatch *batch = (TfsBatch *) (header + 1);
+    if (batch->count == TFS_MAX_BATCH || TFS_MAX_BATCH_MESSAGE - size < TFS_MAX_MESSAGE ||
+        opcode == TFS_OP_BATCH || opcode == TFS_OP_TRANSACTION) {
+        return 0;
+    }
+
+    size_t taken = tfs_encode_request((char *) message + size, opcode, header->requestId, flags,
+                                      nodeType, path, path2);
+    if (taken == 0) {
+        return 0;
+    }
+    batch->count++;
+    header->length += taken;
+    return size + taken;
+}
+
+/*
+ * Decodes a batch request or a transaction in place.
+ * Input:
+ *  - message, length: the batch, 4-byte aligned
+ *  - requests: set to its operations, TFS_MAX_BATCH of them at most
+ * Returns: the number of operations, or -1 if the batch is malformed
+ */
+int tfs_decode_batch(void *message, size_t length, TfsRequest *requests) {
+    TfsHeader *header = message;
+    TfsBatch *batch = (TfsBatch *) (header + 1);
+    if (length < sizeof(TfsHeader) + sizeof(TfsBatch) || header->magic != TFS_MAGIC ||
+        header->version != TFS_VERSION ||
+        (header->opcode != TFS_OP_BATCH && header->opcode != TFS_OP_TRANSACTION) ||
+        header->length != length - sizeof(TfsHeader) || batch->count > TFS_MAX_BATCH) {
+        return -1;
+    }
+
+    char *at = (char *) (batch + 1), *end = (char *) message + length;
+    for (int i = 0; i < batch->count; i++) {
+        TfsHeader *operation = (TfsHeader *) at;
+        if (end - at < sizeof(TfsHeader) ||
+            end - at - sizeof(TfsHeader) < operation->length ||
+            operation->opcode == TFS_OP_BATCH || operation->opcode == TFS_OP_TRANSACTION ||
+            !tfs_decode_request(at, sizeof(TfsHeader) + operation->length, &requests[i])) {
+            return -1;
+        }
+        at += sizeof(TfsHeader) + operation->length;
+    }
+    return at == end ? batch->count : -1;
+}
+
+/*
+ * Encodes the reply to a batch request or a transaction.
+ * Input:
+ *  - message: where to encode it, room for a TfsReply and count results
+ *  - opcode: of the request
+ *  - id: identifier of the batch
+ *  - results, count: the result of each operation
+ * Returns: the size of the reply
+ */
+size_t tfs_encode_batch_reply(void *message, int opcode, uint32_t id, const int *results, int count) {
+    TfsReply *reply = message;
+    int32_t *codes = (int32_t *) (reply + 1);
+    reply->magic = TFS_MAGIC;
+    reply->version = TFS_VERSION;
+    reply->opcode = opcode;
+    reply->flags = 0;
+    reply->requestId = id;
+    reply->result = count;
+    for (int i = 0; i < count; i++) {
+        codes[i] = results[i];
+    }
+    return sizeof(TfsReply) + count * sizeof(int32_t);
+}
+
+/*
+ * Decodes the reply to a batch request or a transaction.
+ * Input:
+ *  - message, length: the reply
+ *  - opcode: of the request
+ *  - id: identifier of the batch
+ *  - results: set to the result of each operation, TFS_MAX_BATCH of them at most
+ * Returns: the number of operations, or -1 if it is not the reply to that batch
+ */
+int tfs_decode_batch_reply(const void *message, size_t length, int opcode, uint32_t id, int *results) {
+    const TfsReply *reply = message;
+    const int32_t *codes = (const int32_t *) (reply + 1);
+    if (length < sizeof(TfsReply) || reply->magic != TFS_MAGIC || reply->version != TFS_VERSION ||
+        reply->opcode != opcode || reply->requestId != id || reply->result < 0 ||
+        reply->result > TFS_MAX_BATCH || length != sizeof(TfsReply) + reply->result * sizeof(int32_t)) {
+        return -1;
+    }
+    for (int i = 0; i < reply->result; i++) {
+        results[i] = codes[i];
+    }
+    return reply->result;
+}
+
+/*
+ * Puts an entry on a ring, waking its consumer if it sleeps. Only one
+ * thread may produce at a time.
+ * Returns: whether the consumer had to be woken
+ */
+bool tfs_ring_push(TfsRing *ring, uint32_t entry) {
+    uint32_t tail = ring->tail;
+    ring->entries[tail % TFS_SHM_SLOTS] = entry;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* the consumer checks the tail again after saying it sleeps */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    syscall(SYS_futex, &ring->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return true;
+}
+
+/*
+ * Takes the oldest entry of a ring, if there is one. Only one thread may
+ * consume at a time.
+ */
+bool tfs_ring_pop(TfsRing *ring, uint32_t *entry) {
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *entry = ring->entries[head % TFS_SHM_SLOTS];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Takes the oldest entry of a ring, waiting for one: spinning for a
+ * while, then sleeping until the producer wakes it.
+ * Input:
+ *  - timeoutMs: how long to sleep before giving up
+ * Returns: false if no entry came in time
+ */
+bool tfs_ring_wait(TfsRing *ring, uint32_t *entry, int timeoutMs) {
+    struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+    /* on a single CPU, spinning only keeps the producer from running */
+    static int spins = -1;
+    if (spins == -1) {
+        spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_RING_SPINS : 0;
+    }
+
+    for (int i = 0; i < spins; i++) {
+        if (tfs_ring_pop(ring, entry)) {
+            return true;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool popped = tfs_ring_pop(ring, entry);
+    if (!popped) {
+        /* returns at once if the tail moved since it was read */
+        syscall(SYS_futex, &ring->tail, FUTEX_WAIT, tail, &timeout, NULL, 0);
+    }
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    return popped || tfs_ring_pop(ring, entry);
+}
@@ -0,0 +1,171 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Binary wire format of requests and replies. A request is a fixed header
+ * followed by its paths, each a length-prefixed, NUL-terminated string
+ * that may be preceded by the hashes of its components, so the server
+ * decodes it in place without copying. The first byte of a binary message
+ * is never a valid text command, so servers keep accepting the text
+ * commands ("c /a d") of older clients.
+ */
+
+#define TFS_MAGIC 0xF5
+#define TFS_VERSION 1
+
+/* Opcodes are the letters of the text commands */
+#define TFS_OP_CREATE 'c'
+#define TFS_OP_DELETE 'd'
+#define TFS_OP_LOOKUP 'l'
+#define TFS_OP_MOVE 'm'
+#define TFS_OP_PRINT 'p'
+#define TFS_OP_SAVE 's'
+#define TFS_OP_BATCH 'b'
+#define TFS_OP_TRANSACTION 't'
+
+/*
+ * Clients may also connect to the server's session socket, at the path of
+ * its datagram socket plus this suffix, and keep many binary requests in
+ * flight on the connection (SOCK_SEQPACKET). Replies carry the request
+ * id, and may arrive in another order than the requests.
+ */
+#define TFS_SESSION_SUFFIX ".session"
+
+/*
+ * A server may also bind one datagram socket per worker, or group of
+ * workers, at the path of its socket plus ".0", ".1", and so on. Clients
+ * send each request to the socket tfs_route picks by the first component
+ * of its path, so each subtree stays with the same workers.
+ */
+#define TFS_MAX_WORKER_SOCKETS 64
+
+/*
+ * Clients on the same host may instead share memory with the server:
+ * they create a TfsShm in a memfd and pass it over a connection to the
+ * socket at the server's path plus this suffix, which stays open while
+ * the memory is in use. A request is written to a free slot, whose index
+ * goes on the submission ring; the server writes the reply to the same
+ * slot and puts its index on the completion ring. Each side only makes a
+ * system call to wake the other when it sleeps on a ring.
+ */
+#define TFS_SHM_SUFFIX ".shm"
+#define TFS_SHM_SLOTS 32         /* a power of 2 */
+/* Times a ring is checked again before its consumer sleeps on it */
+#define TFS_RING_SPINS 4000
+#define TFS_RING_WAIT_MS 100
+
+/* Request flags */
+#define TFS_FLAG_HASHES 0x01   /* paths carry the hashes of their components */
+
+/* Wire formats a client can speak */
+#define TFS_PROTOCOL_TEXT 0
+#define TFS_PROTOCOL_BINARY 1
+#define TFS_PROTOCOL_BINARY_HASHED 2   /* binary, with component hashes */
+
+/* Operations and bytes of one batch request */
+#define TFS_MAX_BATCH 256
+#define TFS_MAX_BATCH_MESSAGE 65532
+
+#define TFS_MAX_PATHS 2
+#define TFS_MAX_COMPONENTS (MAX_FILE_NAME / 2 + 1)
+
+typedef struct tfsHeader {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t requestId;
+    uint8_t nodeType;      /* 'f' or 'd', for creations */
+    uint8_t pathCount;
+    uint16_t length;       /* of the paths that follow */
+} TfsHeader;
+
+/* Followed by hashCount hashes, then the path and its NUL, padded to 4 bytes */
+typedef struct tfsPath {
+    uint16_t length;
+    uint16_t hashCount;
+} TfsPath;
+
+/*
+ * Payload of a batch request, followed by its operations, each a whole
+ * request of its own. The reply to a batch is a TfsReply whose result is
+ * the number of operations, followed by the result of each one.
+ * A transaction has the same layout and reply, but its creations,
+ * deletions and moves are applied all or none.
+ */
+typedef struct tfsBatch {
+    uint16_t count;
+    uint16_t reserved;
+} TfsBatch;
+
+typedef struct tfsReply {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t requestId;
+    int32_t result;
+} TfsReply;
+
+/* Indexes of slots passed from one side to the other; never more than the slots */
+typedef struct tfsRing {
+    uint32_t tail __attribute__((aligned(64)));   /* written by the producer */
+    uint32_t sleeping;                            /* set while the consumer sleeps on tail */
+    uint32_t head __attribute__((aligned(64)));   /* written by the consumer */
+    uint32_t entries[TFS_SHM_SLOTS];
+} TfsRing;
+
+typedef struct tfsShmSlot {
+    uint32_t length, replyLength;
+    char request[TFS_MAX_BATCH_MESSAGE + 4] __attribute__((aligned(8)));
+    char reply[sizeof(TfsReply) + TFS_MAX_BATCH * sizeof(int32_t)] __attribute__((aligned(8)));
+} TfsShmSlot;
+
+typedef struct tfsShm {
+    TfsRing submissions;
+    TfsRing completions;
+    TfsShmSlot slots[TFS_SHM_SLOTS];
+} TfsShm;
+
+/* Largest request: a header and two paths with every hash */
+#define TFS_MAX_MESSAGE (sizeof(TfsHeader) + \
+    TFS_MAX_PATHS * (sizeof(TfsPath) + TFS_MAX_COMPONENTS * sizeof(uint32_t) + MAX_FILE_NAME + 4))
+
+/* A decoded request; paths and hashes point into the message */
+typedef struct tfsRequest {
+    int opcode;
+    uint32_t id;
+    int flags;
+    char nodeType;
+    int pathCount;
+    char *paths[TFS_MAX_PATHS];
+    const uint32_t *hashes[TFS_MAX_PATHS];   /* NULL if not sent */
+    int hashCount[TFS_MAX_PATHS];
+} TfsRequest;
+
+uint32_t tfs_hash(const char *name, size_t length);
+int tfs_path_hashes(const char *path, uint32_t *hashes);
+bool tfs_is_binary(const void *message, size_t length);
+int tfs_route(const char *path, int sockets);
+size_t tfs_encode_request(void *message, int opcode, uint32_t id, int flags, char nodeType,
+                          const char *path, const char *path2);
+bool tfs_decode_request(void *message, size_t length, TfsRequest *request);
+size_t tfs_encode_reply(void *message, const TfsRequest *request, int result);
+bool tfs_decode_reply(const void *message, size_t length, uint32_t id, int *result);
+size_t tfs_batch_begin(void *message, int opcode, uint32_t id);
+size_t tfs_batch_add(void *message, size_t size, int opcode, int flags, char nodeType,
+                     const char *path, const char *path2);
+int tfs_decode_batch(void *message, size_t length, TfsRequest *requests);
+size_t tfs_encode_batch_reply(void *message, int opcode, uint32_t id, const int *results, int count);
+int tfs_decode_batch_reply(const void *message, size_t length, int opcode, uint32_t id, int *results);
+bool tfs_ring_push(TfsRing *ring, uint32_t entry);
+bool tfs_ring_pop(TfsRing *ring, uint32_t *entry);
+bool tfs_ring_wait(TfsRing *ring, uint32_t *entry, int timeoutMs);
+
+#endif /* TECNICOFS_PROTOCOL_H */